@@ -0,0 +1,203 @@
+/************************************************************************//**
+ * adapt: Adaptive chunk length control.
+ ****************************************************************************/
+#include "adapt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+/// Epoch throughput below this fraction of the smoothed one halves chunks
+#define ADAPT_DROP		0.7
+/// Name of the file remembering chunk lengths, in the home directory
+#define ADAPT_FILE		".wflash_chunks"
+/// Maximum number of hosts remembered
+#define ADAPT_HOSTS		64
+/// Maximum length of a host name
+#define ADAPT_HOSTLEN	255
+
+/// Chunk lengths remembered for a host
+typedef struct {
+	char host[ADAPT_HOSTLEN + 1];	///< Host name or address
+	uint32_t prog;					///< Program chunk length
+	uint32_t read;					///< Read chunk length
+} AdaptHost;
+
+// Rounds a length to a multiple of the step, within limits.
+static uint32_t AdaptClamp(const Adapt *a, uint32_t len) {
+	len = (len + a->step - 1) / a->step * a->step;
+	return MAX(a->min, MIN(a->max, len));
+}
+
+/************************************************************************//**
+ * Initializes a chunk length controller. If min and max are equal, the
+ * chunk length is fixed, but throughput is still measured.
+ *
+ * \param[out] a     Controller to initialize.
+ * \param[in]  len   Initial chunk length.
+ * \param[in]  min   Minimum chunk length.
+ * \param[in]  max   Maximum chunk length.
+ * \param[in]  step  Additive increase step. Lengths are kept multiple of it.
+ * \param[in]  epoch Chunks per measurement epoch (e.g. the pipeline
+ *                   window).
+ ****************************************************************************/
+void AdaptInit(Adapt *a, uint32_t len, uint32_t min, uint32_t max,
+		uint32_t step, uint32_t epoch) {
+	memset(a, 0, sizeof(Adapt));
+	a->min = min;
+	a->max = max;
+	a->step = step?step:1;
+	a->epoch = epoch?epoch:1;
+	a->len = min == max?min:AdaptClamp(a, len);
+	a->bestLen = a->len;
+}
+
+/************************************************************************//**
+ * Starts measuring a transfer. Must be called before sending the first
+ * chunk of each transfer.
+ *
+ * \param[in] a Controller.
+ ****************************************************************************/
+void AdaptStart(Adapt *a) {
+	a->chunks = a->bytes = a->epochs = 0;
+	a->start = TimeUs();
+}
+
+/************************************************************************//**
+ * Accounts a completed chunk. At the end of each epoch, the chunk length
+ * is updated.
+ *
+ * \param[in] a     Controller.
+ * \param[in] len   Length of the chunk.
+ * \param[in] ackUs Acknowledge latency of the last command, or 0 if not
+ *                  known.
+ ****************************************************************************/
+void AdaptDone(Adapt *a, uint32_t len, uint32_t ackUs) {
+	uint64_t now, elapsed;
+	double rate;
+	uint32_t bdp;
+
+	a->chunks++;
+	a->bytes += len;
+	if (ackUs && (!a->minAckUs || ackUs < a->minAckUs)) a->minAckUs = ackUs;
+	if (a->chunks < a->epoch) return;
+
+	now = TimeUs();
+	elapsed = MAX(now - a->start, 1);
+	rate = a->bytes * 1e6 / elapsed;
+	a->chunks = a->bytes = 0;
+	a->start = now;
+	// First epoch fills the buffers along the way, skip it
+	if (!a->epochs++) return;
+	if (rate > a->bestRate) {
+		a->bestRate = rate;
+		a->bestLen = a->len;
+	}
+	if (a->min == a->max) return;
+
+	if (a->rate && rate < a->rate * ADAPT_DROP) {
+		// Multiplicative decrease, and restart smoothing from here
+		a->len = AdaptClamp(a, a->len / 2);
+		a->rate = rate;
+	} else {
+		// Additive increase
+		a->rate = a->rate?a->rate + (rate - a->rate) / 4:rate;
+		a->len = AdaptClamp(a, a->len + a->step);
+	}
+	// Chunks in flight must cover the data the link carries in a round
+	// trip, or the link idles waiting for acknowledges.
+	if (a->minAckUs) {
+		bdp = a->rate * a->minAckUs / 1e6 / a->epoch;
+		a->len = MAX(a->len, AdaptClamp(a, bdp));
+	}
+}
+
+// Obtains the path of the file remembering chunk lengths.
+static int AdaptPath(char *path, size_t len) {
+	const char *home = getenv("HOME");
+
+#ifdef __OS_WIN
+	if (!home) home = getenv("USERPROFILE");
+#endif
+	if (!home) return 1;
+	return snprintf(path, len, "%s/%s", home, ADAPT_FILE) >= len;
+}
+
+// Reads the remembered chunk lengths. Returns the number of hosts.
+static int AdaptRead(AdaptHost *h) {
+	char path[FILENAME_MAX];
+	FILE *f;
+	int n = 0;
+
+	if (AdaptPath(path, sizeof(path)) || !(f = fopen(path, "r"))) return 0;
+	while (n < ADAPT_HOSTS && fscanf(f, "%255s %u %u", h[n].host,
+				&h[n].prog, &h[n].read) == 3) n++;
+	fclose(f);
+
+	return n;
+}
+
+/************************************************************************//**
+ * Loads the chunk lengths remembered for a host.
+ *
+ * \param[in]  host Host name or address.
+ * \param[out] prog Program chunk length. Unchanged if not remembered.
+ * \param[out] read Read chunk length. Unchanged if not remembered.
+ *
+ * \return 0 if lengths were found for the host, nonzero otherwise.
+ ****************************************************************************/
+int AdaptLoad(const char *host, uint32_t *prog, uint32_t *read) {
+	AdaptHost h[ADAPT_HOSTS];
+	int i, n;
+
+	n = AdaptRead(h);
+	for (i = 0; i < n; i++) {
+		if (!strcmp(h[i].host, host)) {
+			if (h[i].prog) *prog = h[i].prog;
+			if (h[i].read) *read = h[i].read;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/************************************************************************//**
+ * Remembers the chunk lengths for a host. A length of 0 keeps the
+ * previously remembered one.
+ *
+ * \param[in] host Host name or address.
+ * \param[in] prog Program chunk length.
+ * \param[in] read Read chunk length.
+ *
+ * \return 0 if OK, nonzero if the lengths could not be saved.
+ ****************************************************************************/
+int AdaptSave(const char *host, uint32_t prog, uint32_t read) {
+	AdaptHost h[ADAPT_HOSTS];
+	char path[FILENAME_MAX];
+	FILE *f;
+	int i, n;
+
+	if (strlen(host) > ADAPT_HOSTLEN || AdaptPath(path, sizeof(path))) {
+		return 1;
+	}
+	n = AdaptRead(h);
+	for (i = 0; i < n && strcmp(h[i].host, host); i++);
+	if (i == n) {
+		// Forget the oldest host if full
+		if (n == ADAPT_HOSTS) memmove(h, h + 1, --n * sizeof(AdaptHost));
+		i = n++;
+		strcpy(h[i].host, host);
+		h[i].prog = h[i].read = 0;
+	}
+	if (prog) h[i].prog = prog;
+	if (read) h[i].read = read;
+
+	if (!(f = fopen(path, "w"))) return 1;
+	for (i = 0; i < n; i++) {
+		fprintf(f, "%s %u %u\n", h[i].host, h[i].prog, h[i].read);
+	}
+
+	return fclose(f) != 0;
+}
+
@@ -0,0 +1,106 @@
+/************************************************************************//**
+ * \brief Adaptive chunk length control.
+ *
+ * Chooses the length of the program and read chunks from the measured
+ * link behaviour, AIMD style: while throughput holds, the chunk grows by a
+ * fixed step, and when throughput drops sharply, the chunk is halved.
+ * Throughput is measured over epochs of as many chunks as commands can be
+ * in flight, so pipelined and batched transfers are measured on completed
+ * work. The first epoch of each transfer is not used, because chunks are
+ * sent to empty buffers and look faster than the link. The acknowledge
+ * latency of program commands bounds the chunk from below, so the chunks
+ * in flight still cover the link round trip.
+ *
+ * Lengths giving the best throughput can be remembered per host, to start
+ * the next transfer from them.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Adapt adapt
+ * \{
+ ****************************************************************************/
+
+#ifndef _ADAPT_H_
+#define _ADAPT_H_
+
+#include <stdint.h>
+
+/// Chunk length controller
+typedef struct {
+	uint32_t len;		///< Current chunk length
+	uint32_t min;		///< Minimum chunk length
+	uint32_t max;		///< Maximum chunk length
+	uint32_t step;		///< Additive increase step
+	uint32_t epoch;		///< Chunks per measurement epoch
+	uint32_t chunks;	///< Chunks in the current epoch
+	uint32_t bytes;		///< Bytes in the current epoch
+	uint32_t epochs;	///< Epochs measured in the current transfer
+	uint64_t start;		///< Start time of the current epoch, in us
+	uint32_t minAckUs;	///< Lowest acknowledge latency seen, in us
+	double rate;		///< Smoothed throughput, in bytes per second
+	double bestRate;	///< Best epoch throughput, in bytes per second
+	uint32_t bestLen;	///< Chunk length of the best epoch
+} Adapt;
+
+/************************************************************************//**
+ * Initializes a chunk length controller. If min and max are equal, the
+ * chunk length is fixed, but throughput is still measured.
+ *
+ * \param[out] a     Controller to initialize.
+ * \param[in]  len   Initial chunk length.
+ * \param[in]  min   Minimum chunk length.
+ * \param[in]  max   Maximum chunk length.
+ * \param[in]  step  Additive increase step. Lengths are kept multiple of it.
+ * \param[in]  epoch Chunks per measurement epoch (e.g. the pipeline
+ *                   window).
+ ****************************************************************************/
+void AdaptInit(Adapt *a, uint32_t len, uint32_t min, uint32_t max,
+		uint32_t step, uint32_t epoch);
+
+/************************************************************************//**
+ * Starts measuring a transfer. Must be called before sending the first
+ * chunk of each transfer.
+ *
+ * \param[in] a Controller.
+ ****************************************************************************/
+void AdaptStart(Adapt *a);
+
+/************************************************************************//**
+ * Accounts a completed chunk. At the end of each epoch, the chunk length
+ * is updated.
+ *
+ * \param[in] a     Controller.
+ * \param[in] len   Length of the chunk.
+ * \param[in] ackUs Acknowledge latency of the last command, or 0 if not
+ *                  known.
+ ****************************************************************************/
+void AdaptDone(Adapt *a, uint32_t len, uint32_t ackUs);
+
+/************************************************************************//**
+ * Loads the chunk lengths remembered for a host.
+ *
+ * \param[in]  host Host name or address.
+ * \param[out] prog Program chunk length. Unchanged if not remembered.
+ * \param[out] read Read chunk length. Unchanged if not remembered.
+ *
+ * \return 0 if lengths were found for the host, nonzero otherwise.
+ ****************************************************************************/
+int AdaptLoad(const char *host, uint32_t *prog, uint32_t *read);
+
+/************************************************************************//**
+ * Remembers the chunk lengths for a host. A length of 0 keeps the
+ * previously remembered one.
+ *
+ * \param[in] host Host name or address.
+ * \param[in] prog Program chunk length.
+ * \param[in] read Read chunk length.
+ *
+ * \return 0 if OK, nonzero if the lengths could not be saved.
+ ****************************************************************************/
+int AdaptSave(const char *host, uint32_t prog, uint32_t read);
+
+#endif /*_ADAPT_H_*/
+
+/** \} */
+
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Runs the wflash benchmark matrix against the wfsim cartridge stand-in,
+# and writes the results as JSON lines (one per run) to $OUT.
+#
+# Every variable below can be overridden from the environment, e.g.:
+#   SIZES=262144 CHUNKS="1440 64800" WINDOWS=1 make bench
+# Flash timing is disabled by default (TIME_SCALE=0), so results show the
+# transport costs the client can change. Use TIME_SCALE=100 to add the
+# typical erase and program times of the emulated chip.
+# BENCH can list several drivers (e.g. classic and io_uring builds, as done
+# by make bench-uring), each one is run with the same parameters.
+
+cd "$(dirname "$0")/.."
+
+SIM=${SIM:-sim/wfsim}
+BENCH=${BENCH:-bench/wfbench}
+OUT=${OUT:-bench/results.jsonl}
+PORT=${PORT:-19890}
+SIZES=${SIZES:-"262144 1048576"}
+# Chunk lengths previously tried by hand, plus the current defaults
+CHUNKS=${CHUNKS:-"1440 2304 3840 57600 64800"}
+WINDOWS=${WINDOWS:-"1 4"}
+OPS=${OPS:-"flash read erase cycle"}
+TIME_SCALE=${TIME_SCALE:-0}
+# Link profiles: name and wfsim options
+PROFILES=${PROFILES:-"loopback:-r0 lan:-r2,-b4096 wifi:-r10,-b800,-g100"}
+
+: > "$OUT"
+for prof in $PROFILES; do
+	name=${prof%%:*}
+	flags=${prof#*:}
+	"$SIM" -p "$PORT" -t "$TIME_SCALE" ${flags//,/ } > /dev/null &
+	sim=$!
+	sleep 0.3
+	if ! kill -0 $sim 2> /dev/null; then
+		echo "Could not start $SIM for profile $name" >&2
+		exit 1
+	fi
+
+	for len in $SIZES; do
+		for op in $OPS; do
+			# Erase does not depend on chunk and window
+			chunks=$CHUNKS; windows=$WINDOWS
+			[ "$op" = erase ] && chunks=${CHUNKS%% *} windows=${WINDOWS%% *}
+			for chunk in $chunks; do
+				for win in $windows; do
+					for bench in $BENCH; do
+						"$bench" -p "$PORT" -P "$name" -o "$op" -l "$len" \
+							-c "$chunk" -w "$win" | tee -a "$OUT"
+					done
+				done
+			done
+		done
+	done
+
+	kill $sim
+	wait $sim 2> /dev/null
+done
+
+echo "Results written to $OUT"
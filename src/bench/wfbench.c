@@ -0,0 +1,347 @@
+/************************************************************************//**
+ * \brief wfbench: wflash throughput benchmark driver.
+ *
+ * Runs a single benchmark (flash, read, erase or a complete flash and
+ * verify cycle) against a cartridge or a wfsim stand-in, using the wflash
+ * module, and writes the results as a JSON line to stdout. Chunk length
+ * and pipeline window are configurable, so the matrix run by bench.sh can
+ * be used to choose them from data.
+ *
+ * Throughput is given in image MB (10^6 bytes) per second, so a cycle
+ * (erase, flash, read and compare) is slower than a flash for the same
+ * image. Per-chunk latency is the wall time of each chunk call. With a
+ * pipeline window of 1 this is the chunk round trip. With bigger windows
+ * it is the time between chunk completions once the pipeline is full.
+ * Read latency is always the time between chunk completions.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup WfBench wfbench
+ * \{
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "../wflash.h"
+#include "../util.h"
+
+/// Version major number
+#define VERSION_MAJOR	0x00
+/// Version minor number
+#define VERSION_MINOR	0x01
+
+/// Default server port
+#define BENCH_DEF_PORT	1989
+
+/// Read commands in flight
+static unsigned int readWindow = 1;
+/// Connection to the cart under test
+static WfCtx *wf;
+
+/// Benchmark results
+typedef struct {
+	double *lat;		///< Per-chunk latencies, in seconds
+	uint32_t nLat;		///< Number of latency samples
+	uint32_t maxLat;	///< Capacity of the latency array
+	double secs;		///< Total benchmark time
+	int ok;				///< Benchmark completed (and verified)
+} BenchRes;
+
+/// Benchmark operation
+typedef int (*BenchOp)(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img, uint8_t *buf);
+
+/// Long command-line options
+static const struct option opt[] = {
+	{"wflash-addr",	required_argument,	NULL,	'a'},
+	{"wflash-port",	required_argument,	NULL,	'p'},
+	{"op",			required_argument,	NULL,	'o'},
+	{"length",		required_argument,	NULL,	'l'},
+	{"chunk",		required_argument,	NULL,	'c'},
+	{"window",		required_argument,	NULL,	'w'},
+	{"profile",		required_argument,	NULL,	'P'},
+	{"version",		no_argument,		NULL,	'V'},
+	{"help",		no_argument,		NULL,	'h'},
+	{NULL,			0,					NULL,	0}
+};
+
+/// Descriptions of the command-line options
+static const char *description[] = {
+	"wflash server address (default 127.0.0.1)",
+	"wflash server port (default 1989)",
+	"Operation: flash, read, erase or cycle (flash and verify)",
+	"Image length in bytes (default 1048576)",
+	"Chunk length in bytes (default 64800)",
+	"Pipeline window for flash and read commands (default 1)",
+	"Link profile label, copied to the results",
+	"Show program version",
+	"Print help screen and exit"
+};
+
+// Returns the monotonic time in seconds.
+static double Now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void PrintVersion(char prgName[]) {
+	printf("%s version %d.%d, doragasu 2017.\n", prgName,
+			VERSION_MAJOR, VERSION_MINOR);
+}
+
+static void PrintHelp(char *prgName) {
+	int i;
+
+	PrintVersion(prgName);
+	printf("Usage: %s [OPTIONS [OPTION_ARG]]\nSupported options:\n\n",
+			prgName);
+	for (i = 0; opt[i].name; i++) {
+		printf(" -%c, --%s%s: %s.\n", opt[i].val, opt[i].name,
+				opt[i].has_arg == required_argument?" <arg>":"",
+				description[i]);
+	}
+}
+
+// Adds a latency sample.
+static inline void BenchLat(BenchRes *r, double t) {
+	if (r->nLat < r->maxLat) r->lat[r->nLat++] = t;
+}
+
+// Programs the image in chunks, through the pipeline.
+static int BenchProgram(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img) {
+	uint32_t addr, toWrite;
+	double t;
+
+	for (addr = 0; addr < len; addr += toWrite) {
+		toWrite = MIN(chunkLen, len - addr);
+		t = Now();
+		if (WfFlashPipe(wf, addr, toWrite, img + addr) != WF_OK) return 1;
+		// Last chunk completes when its acknowledge arrives
+		if (addr + toWrite == len && WfPipeFlush(wf) != WF_OK) return 1;
+		BenchLat(r, Now() - t);
+	}
+	return 0;
+}
+
+/// Destination of the chunks read by BenchReadChunks()
+typedef struct {
+	BenchRes *r;		///< Benchmark results
+	uint8_t *buf;		///< Buffer receiving the whole range
+	uint32_t chunkLen;	///< Chunk length
+	double t;			///< Completion time of the previous chunk
+} BenchReadCtx;
+
+// Copies a read chunk to the range buffer, and takes a latency sample.
+static uint32_t BenchReadChunk(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx) {
+	BenchReadCtx *c = (BenchReadCtx*)ctx;
+	double t = Now();
+
+	memcpy(c->buf + addr, data, len);
+	BenchLat(c->r, t - c->t);
+	c->t = t;
+	return c->chunkLen;
+}
+
+// Reads len bytes in chunks, through the read pipeline.
+static int BenchReadChunks(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *buf) {
+	BenchReadCtx c = {r, buf, chunkLen, Now()};
+	uint8_t *chunk;
+	int err;
+
+	if (!(chunk = malloc(chunkLen))) return 1;
+	err = WfReadPipe(wf, 0, len, chunkLen, readWindow, chunk, chunkLen,
+			BenchReadChunk, &c) != WF_OK;
+	free(chunk);
+
+	return err;
+}
+
+// Erases the image range, timed as a single sample.
+static int BenchErase(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img, uint8_t *buf) {
+	double t = Now();
+
+	if (WfFlashErase(wf, 0, len) != WF_OK) return 1;
+	BenchLat(r, Now() - t);
+
+	return 0;
+}
+
+// Programs a previously erased range.
+static int BenchFlash(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img, uint8_t *buf) {
+	return BenchProgram(r, len, chunkLen, img);
+}
+
+// Reads the image range.
+static int BenchRead(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img, uint8_t *buf) {
+	return BenchReadChunks(r, len, chunkLen, buf);
+}
+
+// Erases, programs, reads back and compares.
+static int BenchCycle(BenchRes *r, uint32_t len, uint32_t chunkLen,
+		uint8_t *img, uint8_t *buf) {
+	if (BenchErase(r, len, chunkLen, img, buf) ||
+			BenchProgram(r, len, chunkLen, img) ||
+			BenchReadChunks(r, len, chunkLen, buf)) return 1;
+	if (memcmp(img, buf, len)) {
+		PrintErr("Verify failed!\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int DblCmp(const void *a, const void *b) {
+	const double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+// Obtains a percentile from the sorted latency samples.
+static double Percentile(const BenchRes *r, unsigned int pct) {
+	if (!r->nLat) return 0;
+	return r->lat[MIN(r->nLat - 1, (uint32_t)(r->nLat * pct / 100))];
+}
+
+int main(int argc, char *argv[]) {
+	static const char * const opName[] = {"flash", "read", "erase", "cycle"};
+	static const BenchOp ops[] = {BenchFlash, BenchRead, BenchErase,
+		BenchCycle};
+	const WfIoStats *io;
+	char *host = "127.0.0.1";
+	const char *profile = "";
+	long port = BENCH_DEF_PORT;
+	long len = 1024 * 1024;
+	long chunkLen = 64800;
+	long window = 1;
+	int op = -1;
+	BenchRes r;
+	uint8_t *img, *buf;
+	uint32_t i, seed;
+	char *endPtr;
+	double mb;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "a:p:o:l:c:w:P:Vh", opt, NULL))
+			!= -1) {
+		switch (c) {
+			case 'a':
+				host = optarg;
+				break;
+
+			case 'p':
+				port = strtol(optarg, &endPtr, 0);
+				if (*endPtr != '\0' || port <= 0 || port > 65535) {
+					PrintErr("Invalid port %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'o':
+				for (op = 0; op < 4 && strcmp(optarg, opName[op]); op++);
+				if (op == 4) {
+					PrintErr("Invalid operation %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'l':
+			case 'c':
+			case 'w':
+				if ((strtol(optarg, &endPtr, 0) <= 0) || *endPtr != '\0') {
+					PrintErr("Invalid value %s!\n", optarg);
+					return 1;
+				}
+				if (c == 'l') len = strtol(optarg, NULL, 0);
+				else if (c == 'c') chunkLen = strtol(optarg, NULL, 0);
+				else window = strtol(optarg, NULL, 0);
+				break;
+
+			case 'P':
+				profile = optarg;
+				break;
+
+			case 'V':
+				PrintVersion(argv[0]);
+				return 0;
+
+			case 'h':
+				PrintHelp(argv[0]);
+				return 0;
+
+			default:
+				return 1;
+		}
+	}
+	if (op < 0) {
+		PrintErr("No operation specified!\n");
+		return 1;
+	}
+	if (chunkLen > 65535) {
+		PrintErr("Chunk length must be less than 64 KiB!\n");
+		return 1;
+	}
+
+	memset(&r, 0, sizeof(BenchRes));
+	r.maxLat = (len + chunkLen - 1) / chunkLen * 2 + 1;
+	img = malloc(len);
+	buf = malloc(len);
+	r.lat = malloc(r.maxLat * sizeof(double));
+	if (!img || !buf || !r.lat) {
+		perror("Allocating buffers");
+		return 1;
+	}
+	// Pseudo-random image, so nothing can be skipped or compressed
+	for (i = 0, seed = 1; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		img[i] = seed >> 16;
+	}
+
+	if (!(wf = WfCtxNew()) || (WfConnect(wf, host, port) != WF_OK) ||
+			(WfReady(wf, 5000) < 0)) return 1;
+	if (WfPipeWindowSet(wf, window) != WF_OK) {
+		PrintErr("Invalid window %ld!\n", window);
+		return 1;
+	}
+	readWindow = window;
+	// Flash benchmark needs the range erased, out of the measurement
+	if (ops[op] == BenchFlash && WfFlashErase(wf, 0, len) != WF_OK) return 1;
+
+	WfIoStatsReset(wf);
+	r.secs = Now();
+	r.ok = !ops[op](&r, len, chunkLen, img, buf);
+	r.secs = Now() - r.secs;
+	io = WfIoStatsGet(wf);
+	WfClose(wf);
+
+	qsort(r.lat, r.nLat, sizeof(double), DblCmp);
+	// Throughput is image bytes per second, for every operation
+	mb = len / 1e6;
+	printf("{\"op\":\"%s\",\"profile\":\"%s\",\"len\":%ld,\"chunk\":%ld,"
+			"\"window\":%ld,\"ok\":%s,\"secs\":%.6f,\"mb_per_s\":%.3f,"
+			"\"chunks\":%u,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+			"\"syscalls_per_mb\":%.1f,\"backend\":\"%s\"}\n", opName[op],
+			profile, len, chunkLen, window, r.ok?"true":"false", r.secs,
+			mb / r.secs, r.nLat, Percentile(&r, 50) * 1000,
+			Percentile(&r, 99) * 1000, (io->sendCalls + io->recvCalls) / mb,
+			WfBackend(wf));
+
+	WfCtxFree(wf);
+	free(r.lat);
+	free(buf);
+	free(img);
+
+	return !r.ok;
+}
+
+/** \} */
@@ -13,7 +13,11 @@
 /// Major number of the commands implementation
 #define WF_VERSION_MAJOR	0x00
 /// Minor number of the commands implementation
-#define WF_VERSION_MINOR	0x01
+#define WF_VERSION_MINOR	0x03
+/// First minor number (with major 0) supporting WF_CMD_CRC32
+#define WF_CRC32_MINOR		0x02
+/// First minor number (with major 0) supporting WF_CMD_PROGRAM_LZ
+#define WF_LZ_MINOR			0x03
 
 /// Maximum payload length
 //#define WF_MAX_DATALEN	1152
@@ -33,6 +37,8 @@ enum {
 	WF_CMD_READ,				///< Read data
 	WF_CMD_RUN,					///< Run from address
 	WF_CMD_AUTORUN,				///< Run from entry point in cart header
+	WF_CMD_CRC32,				///< CRC-32 of the blocks of a range
+	WF_CMD_PROGRAM_LZ,			///< Program compressed data
 	WF_CMD_MAX					///< Maximum command value delimiter
 };
 
@@ -41,12 +47,39 @@ enum {
 /// ERROR reply code to a command
 #define WF_CMD_ERROR		1
 
+/// Maximum number of CRCs in a WF_CMD_CRC32 reply
+#define WF_CRC32_MAX		((WF_MAX_DATALEN - WF_HEADLEN) / 4)
+
 /// Memory range definition
 typedef struct {
 	uint32_t addr;	///< Start address of the range
 	uint32_t len;	///< Length of the memory range
 } WfMemRange;
 
+/// WF_CMD_CRC32 arguments. The range is split in blocks of blockLen bytes
+/// (the last one can be shorter), and the reply carries the CRC-32 of each
+/// block, in order. The range must not have more than WF_CRC32_MAX blocks.
+typedef struct {
+	uint32_t addr;		///< Start address of the range
+	uint32_t len;		///< Length of the range
+	uint32_t blockLen;	///< Length of each block
+} WfCrcRange;
+
+/// Maximum decompressed length of a WF_CMD_PROGRAM_LZ command
+#define WF_LZ_CHUNK_MAX		65536
+
+/// WF_CMD_PROGRAM_LZ arguments. The command is followed by zLen bytes of
+/// payload in LZ4 block format, that decompress to the len bytes to program
+/// at addr. Each chunk is compressed on its own, so matches only reference
+/// data of the same chunk (already programmed when the match is decoded).
+/// Neither len nor zLen can exceed WF_LZ_CHUNK_MAX. Acknowledged like
+/// WF_CMD_PROGRAM, before the payload is received.
+typedef struct {
+	uint32_t addr;		///< Address to program
+	uint32_t len;		///< Decompressed length
+	uint32_t zLen;		///< Compressed payload length
+} WfLzRange;
+
 /// Command definition
 typedef struct {
 	uint16_t cmd;	///< Command code
@@ -60,6 +93,10 @@ typedef struct {
 		uint32_t dwdata [(WF_MAX_DATALEN - 4) / 4];
 		/// Memory range
 		WfMemRange mem;
+		/// CRC range
+		WfCrcRange crc;
+		/// Compressed program range
+		WfLzRange lz;
 	};
 } WfCmd;
 
@@ -0,0 +1,71 @@
+/************************************************************************//**
+ * crc32: CRC-32 computation, slice-by-8.
+ ****************************************************************************/
+#include "crc32.h"
+
+/// Reflected CRC-32 polynomial
+#define CRC32_POLY	0xEDB88320
+
+/// Lookup tables. Table k gives the CRC of a byte followed by k zeros.
+static uint32_t tab[8][256];
+/// Tables built
+static int ready = 0;
+
+/************************************************************************//**
+ * Builds the lookup tables. Called by Crc32() if needed, but must be
+ * called before using Crc32() from several threads.
+ ****************************************************************************/
+void Crc32Init(void) {
+	uint32_t crc;
+	int i, j;
+
+	if (ready) return;
+	for (i = 0; i < 256; i++) {
+		for (crc = i, j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (CRC32_POLY & -(crc & 1));
+		}
+		tab[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			tab[j][i] = (tab[j - 1][i] >> 8) ^ tab[0][tab[j - 1][i] & 0xFF];
+		}
+	}
+	ready = 1;
+}
+
+/************************************************************************//**
+ * Updates a CRC-32 with a data block. Use 0 as initial CRC.
+ *
+ * \param[in] crc  CRC of the previous data, or 0 to start.
+ * \param[in] data Data block.
+ * \param[in] len  Length of the data block.
+ *
+ * \return CRC of the previous data followed by the data block.
+ ****************************************************************************/
+uint32_t Crc32(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = (const uint8_t*)data;
+	uint32_t lo, hi;
+
+	Crc32Init();
+	crc = ~crc;
+	// Byte by byte until aligned, so words can be loaded directly
+	for (; len && ((uintptr_t)p & 7); len--) {
+		crc = (crc >> 8) ^ tab[0][(crc ^ *p++) & 0xFF];
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		// Words are loaded in little endian order
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = tab[7][lo & 0xFF] ^ tab[6][(lo >> 8) & 0xFF] ^
+			tab[5][(lo >> 16) & 0xFF] ^ tab[4][lo >> 24] ^
+			tab[3][hi & 0xFF] ^ tab[2][(hi >> 8) & 0xFF] ^
+			tab[1][(hi >> 16) & 0xFF] ^ tab[0][hi >> 24];
+	}
+	for (; len; len--) {
+		crc = (crc >> 8) ^ tab[0][(crc ^ *p++) & 0xFF];
+	}
+
+	return ~crc;
+}
+
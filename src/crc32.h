@@ -0,0 +1,42 @@
+/************************************************************************//**
+ * \brief CRC-32 computation.
+ *
+ * Standard CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320, the one
+ * used by zlib), as computed by the wflash bootloader to verify flash
+ * ranges. Uses the slice-by-8 algorithm, processing 8 bytes per step with
+ * eight lookup tables.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Crc32 crc32
+ * \{
+ ****************************************************************************/
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/************************************************************************//**
+ * Builds the lookup tables. Called by Crc32() if needed, but must be
+ * called before using Crc32() from several threads.
+ ****************************************************************************/
+void Crc32Init(void);
+
+/************************************************************************//**
+ * Updates a CRC-32 with a data block. Use 0 as initial CRC.
+ *
+ * \param[in] crc  CRC of the previous data, or 0 to start.
+ * \param[in] data Data block.
+ * \param[in] len  Length of the data block.
+ *
+ * \return CRC of the previous data followed by the data block.
+ ****************************************************************************/
+uint32_t Crc32(uint32_t crc, const void *data, size_t len);
+
+#endif /*_CRC32_H_*/
+
+/** \} */
+
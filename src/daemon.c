@@ -0,0 +1,327 @@
+/************************************************************************//**
+ * daemon: Serves jobs submitted by short lived clients through a local UNIX
+ * socket. The client passes its standard output and error descriptors
+ * along with the job (SCM_RIGHTS), so the job prints to the client console.
+ ****************************************************************************/
+#include "daemon.h"
+#include "util.h"
+#include <stdio.h>
+
+#ifdef __OS_WIN
+int DaemonServe(const char *path, DaemonJob job, void *ctx) {
+	PrintErr("Daemon mode is not supported on Windows!\n");
+	return 1;
+}
+
+int DaemonSubmit(const char *path, int argc, char **argv) {
+	PrintErr("Daemon mode is not supported on Windows!\n");
+	return 1;
+}
+#else
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// Number of descriptors passed with each job (standard output and error)
+#define DAEMON_NFDS		2
+/// Maximum number of arguments of a job
+#define DAEMON_ARGS_MAX	256
+
+/// Set when a termination signal is received
+static volatile sig_atomic_t quit = FALSE;
+
+static void DaemonSig(int sig) {
+	quit = TRUE;
+}
+
+// Fills a UNIX socket address. Returns nonzero if the path is too long.
+static int DaemonAddr(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		PrintErr("Socket path %s is too long!\n", path);
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+// Creates a UNIX socket connected to path. Returns the socket, or -1.
+static int DaemonConnect(const char *path) {
+	struct sockaddr_un addr;
+	int s;
+
+	if (DaemonAddr(&addr, path)) return -1;
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+// Receives exactly len bytes. Returns nonzero on error or end of stream.
+static int DaemonRecvAll(int s, void *buf, size_t len) {
+	ssize_t recvd;
+
+	for (; len; len -= recvd, buf = (uint8_t*)buf + recvd) {
+		if ((recvd = recv(s, buf, len, MSG_WAITALL)) <= 0) {
+			if (recvd < 0 && errno == EINTR) recvd = 0;
+			else return 1;
+		}
+	}
+	return 0;
+}
+
+/************************************************************************//**
+ * Receives a job message: its length, the descriptors of the client and
+ * the message itself (working directory and arguments, each one ending in
+ * a null character).
+ *
+ * \param[in]  s   Client socket.
+ * \param[out] msg Message buffer, DAEMON_MSG_MAX bytes long.
+ * \param[out] fds Received descriptors.
+ *
+ * \return Length of the message, or 0 on error.
+ ****************************************************************************/
+static uint32_t DaemonJobRecv(int s, char *msg, int fds[DAEMON_NFDS]) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(DAEMON_NFDS * sizeof(int))];
+	} ctl;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+	uint32_t len;
+
+	memset(&mh, 0, sizeof(struct msghdr));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(uint32_t);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(s, &mh, MSG_WAITALL) != sizeof(uint32_t)) return 0;
+	cm = CMSG_FIRSTHDR(&mh);
+	if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+			cm->cmsg_len != CMSG_LEN(DAEMON_NFDS * sizeof(int))) {
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cm), DAEMON_NFDS * sizeof(int));
+	if (!len || len > DAEMON_MSG_MAX || DaemonRecvAll(s, msg, len) ||
+			msg[len - 1] != '\0') {
+		close(fds[0]);
+		close(fds[1]);
+		return 0;
+	}
+	return len;
+}
+
+/************************************************************************//**
+ * Runs a received job, from the client working directory and printing to
+ * the client descriptors. The daemon working directory and descriptors
+ * are restored afterwards.
+ *
+ * \param[in] msg Job message.
+ * \param[in] len Length of the message.
+ * \param[in] fds Client standard output and error.
+ * \param[in] job Function running the job.
+ * \param[in] ctx Context passed to the job function.
+ *
+ * \return Exit status of the job.
+ ****************************************************************************/
+static int DaemonJobRun(char *msg, uint32_t len, const int fds[DAEMON_NFDS],
+		DaemonJob job, void *ctx) {
+	char *argv[DAEMON_ARGS_MAX + 1];
+	int saved[DAEMON_NFDS];
+	int argc = 0;
+	int cwd, i;
+	int status;
+	char *p;
+
+	// First string is the working directory, then the arguments
+	for (p = msg + strlen(msg) + 1; p < msg + len && argc < DAEMON_ARGS_MAX;
+			p += strlen(p) + 1) {
+		argv[argc++] = p;
+	}
+	argv[argc] = NULL;
+	if (!argc) return 1;
+
+	fflush(stdout);
+	fflush(stderr);
+	saved[0] = dup(STDOUT_FILENO);
+	saved[1] = dup(STDERR_FILENO);
+	cwd = open(".", O_RDONLY);
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	if (chdir(msg)) {
+		perror(msg);
+		status = 1;
+	} else status = job(argc, argv, ctx);
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = 0; i < DAEMON_NFDS; i++) {
+		dup2(saved[i], i + STDOUT_FILENO);
+		close(saved[i]);
+	}
+	if (cwd >= 0) {
+		if (fchdir(cwd)) perror("Restoring working directory");
+		close(cwd);
+	}
+	return status;
+}
+
+/************************************************************************//**
+ * Serves jobs on a UNIX socket, until SIGINT or SIGTERM is received. A
+ * stale socket file is replaced, but the function fails if another daemon
+ * is serving on it.
+ *
+ * \param[in] path Path of the UNIX socket.
+ * \param[in] job  Function running each job.
+ * \param[in] ctx  Context passed to the job function.
+ *
+ * \return 0 if the daemon ended on request, nonzero on error.
+ ****************************************************************************/
+int DaemonServe(const char *path, DaemonJob job, void *ctx) {
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	int fds[DAEMON_NFDS];
+	int32_t status;
+	uint32_t len;
+	char *msg;
+	int ls, s;
+
+	if (DaemonAddr(&addr, path)) return 1;
+	if ((s = DaemonConnect(path)) >= 0) {
+		close(s);
+		PrintErr("A daemon is already serving on %s!\n", path);
+		return 1;
+	}
+	unlink(path);
+	if (!(msg = malloc(DAEMON_MSG_MAX))) {
+		perror("Allocating job buffer");
+		return 1;
+	}
+	if ((ls = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+			bind(ls, (struct sockaddr*)&addr, sizeof(addr)) ||
+			listen(ls, 8)) {
+		perror(path);
+		if (ls >= 0) close(ls);
+		free(msg);
+		return 1;
+	}
+
+	// Signals must interrupt accept(), so they are not restarted. A client
+	// going away while the job prints must not kill the daemon.
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = DaemonSig;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	printf("Serving jobs on %s.\n", path);
+	fflush(stdout);
+
+	while (!quit) {
+		if ((s = accept(ls, NULL, NULL)) < 0) {
+			if (errno != EINTR) perror("accept");
+			continue;
+		}
+		if ((len = DaemonJobRecv(s, msg, fds))) {
+			status = DaemonJobRun(msg, len, fds, job, ctx);
+			close(fds[0]);
+			close(fds[1]);
+			send(s, &status, sizeof(int32_t), MSG_NOSIGNAL);
+		} else PrintErr("Invalid job received!\n");
+		close(s);
+	}
+
+	close(ls);
+	unlink(path);
+	free(msg);
+	return 0;
+}
+
+/************************************************************************//**
+ * Submits a job to a daemon, and waits for it to complete. The job prints
+ * to the standard output and error of the caller.
+ *
+ * \param[in] path Path of the UNIX socket of the daemon.
+ * \param[in] argc Number of arguments.
+ * \param[in] argv Arguments, the first one being the program name.
+ *
+ * \return Exit status of the job, or nonzero if it could not be submitted.
+ ****************************************************************************/
+int DaemonSubmit(const char *path, int argc, char **argv) {
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(DAEMON_NFDS * sizeof(int))];
+	} ctl;
+	const int fds[DAEMON_NFDS] = {STDOUT_FILENO, STDERR_FILENO};
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov[2];
+	uint32_t len, argLen;
+	int32_t status;
+	char *msg;
+	int s, i;
+
+	if (!(msg = malloc(DAEMON_MSG_MAX))) {
+		perror("Allocating job buffer");
+		return 1;
+	}
+	if (!getcwd(msg, DAEMON_MSG_MAX)) {
+		perror("Getting working directory");
+		free(msg);
+		return 1;
+	}
+	len = strlen(msg) + 1;
+	for (i = 0; i < argc; i++, len += argLen) {
+		argLen = strlen(argv[i]) + 1;
+		if (len + argLen > DAEMON_MSG_MAX || i == DAEMON_ARGS_MAX) {
+			PrintErr("Job command line too long!\n");
+			free(msg);
+			return 1;
+		}
+		memcpy(msg + len, argv[i], argLen);
+	}
+	if ((s = DaemonConnect(path)) < 0) {
+		PrintErr("Could not connect to daemon at %s!\n", path);
+		free(msg);
+		return 1;
+	}
+
+	// Output descriptors travel with the message length
+	memset(&mh, 0, sizeof(struct msghdr));
+	iov[0].iov_base = &len;
+	iov[0].iov_len = sizeof(uint32_t);
+	iov[1].iov_base = msg;
+	iov[1].iov_len = len;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(DAEMON_NFDS * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, DAEMON_NFDS * sizeof(int));
+	fflush(stdout);
+	fflush(stderr);
+	// Small messages fit the socket buffer, so a single call sends them
+	if (sendmsg(s, &mh, MSG_NOSIGNAL) != (ssize_t)(sizeof(uint32_t) + len) ||
+			DaemonRecvAll(s, &status, sizeof(int32_t))) {
+		PrintErr("Job was not completed by daemon at %s!\n", path);
+		status = 1;
+	}
+	close(s);
+	free(msg);
+
+	return status;
+}
+
+#endif /*__OS_WIN*/
@@ -0,0 +1,71 @@
+/************************************************************************//**
+ * \brief Persistent session daemon.
+ *
+ * Connecting to the cart and waiting for the bootloader to be ready takes
+ * most of the time of short jobs (reading the flash IDs, erasing a few
+ * sectors, booting). A daemon keeps the connection open, and runs jobs
+ * submitted by short lived clients through a local UNIX socket, so jobs
+ * after the first one start in a few milliseconds.
+ *
+ * A job is a command line. The client sends its working directory and its
+ * arguments, along with its standard output and error descriptors, so the
+ * job reads and writes files as if run by the client, and prints to the
+ * client console. The client waits for the job exit status, and returns
+ * it. Jobs are run one at a time, in the order they arrive.
+ *
+ * Not supported on Windows.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Daemon daemon
+ * \{
+ ****************************************************************************/
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+/// Maximum length of a job message (working directory and arguments)
+#define DAEMON_MSG_MAX	65536
+
+/************************************************************************//**
+ * Runs a job. Called by the daemon with the standard output and error of
+ * the client, and from its working directory.
+ *
+ * \param[in] argc Number of arguments.
+ * \param[in] argv Arguments, the first one being the program name.
+ * \param[in] ctx  Context passed to DaemonServe().
+ *
+ * \return Exit status of the job, returned by the client.
+ ****************************************************************************/
+typedef int (*DaemonJob)(int argc, char **argv, void *ctx);
+
+/************************************************************************//**
+ * Serves jobs on a UNIX socket, until SIGINT or SIGTERM is received. A
+ * stale socket file is replaced, but the function fails if another daemon
+ * is serving on it.
+ *
+ * \param[in] path Path of the UNIX socket.
+ * \param[in] job  Function running each job.
+ * \param[in] ctx  Context passed to the job function.
+ *
+ * \return 0 if the daemon ended on request, nonzero on error.
+ ****************************************************************************/
+int DaemonServe(const char *path, DaemonJob job, void *ctx);
+
+/************************************************************************//**
+ * Submits a job to a daemon, and waits for it to complete. The job prints
+ * to the standard output and error of the caller.
+ *
+ * \param[in] path Path of the UNIX socket of the daemon.
+ * \param[in] argc Number of arguments.
+ * \param[in] argv Arguments, the first one being the program name.
+ *
+ * \return Exit status of the job, or nonzero if it could not be submitted.
+ ****************************************************************************/
+int DaemonSubmit(const char *path, int argc, char **argv);
+
+#endif /*_DAEMON_H_*/
+
+/** \} */
+
@@ -0,0 +1,185 @@
+/************************************************************************//**
+ * flash_geom: Flash chip geometry database and erase planner.
+ *
+ * Sector maps and typical times are taken from the chip datasheets. IDs
+ * are the bytes returned by WfFlashIdsGet(): manufacturer ID followed by
+ * the device ID cycles.
+ ****************************************************************************/
+#include "flash_geom.h"
+#include <stddef.h>
+#include <string.h>
+#include "util.h"
+
+/// Known flash chips
+static const FlashGeom chips[] = {
+	{"Spansion S29GL032N (uniform)", {0x01, 0x7E, 0x1D, 0x00}, 3,
+		4 * 1024 * 1024, 60, {{64, 65536, 500}}},
+	{"Spansion S29GL032N (bottom boot)", {0x01, 0x7E, 0x1A, 0x00}, 4,
+		4 * 1024 * 1024, 60, {{8, 8192, 500}, {63, 65536, 500}}},
+	{"Spansion S29GL032N (top boot)", {0x01, 0x7E, 0x1A, 0x01}, 4,
+		4 * 1024 * 1024, 60, {{63, 65536, 500}, {8, 8192, 500}}},
+	{"Macronix MX29LV320 (top boot)", {0xC2, 0xA7}, 2,
+		4 * 1024 * 1024, 11, {{63, 65536, 700}, {8, 8192, 700}}},
+	{"Macronix MX29LV320 (bottom boot)", {0xC2, 0xA8}, 2,
+		4 * 1024 * 1024, 11, {{8, 8192, 700}, {63, 65536, 700}}},
+	{"SST SST39VF3201", {0xBF, 0x5B}, 2,
+		4 * 1024 * 1024, 7, {{1024, 4096, 18}}}
+};
+
+/// Number of known flash chips
+#define FLASH_GEOM_CHIPS	(sizeof(chips) / sizeof(FlashGeom))
+
+// Obtains the region and the sector containing an address.
+static const FlashRegion *FlashGeomRegion(const FlashGeom *g, uint32_t addr,
+		uint32_t *start, uint32_t *len) {
+	const FlashRegion *r;
+	uint32_t base = 0;
+	int i;
+
+	for (i = 0; i < FLASH_GEOM_REGIONS && g->region[i].count; i++) {
+		r = &g->region[i];
+		if (addr < (base + r->count * r->len)) {
+			*start = base + (addr - base) / r->len * r->len;
+			*len = r->len;
+			return r;
+		}
+		base += r->count * r->len;
+	}
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Searches the geometry of a flash chip.
+ *
+ * \param[in] ids Flash chip IDs, as returned by WfFlashIdsGet().
+ *
+ * \return The chip geometry, or NULL if the chip is not known.
+ ****************************************************************************/
+const FlashGeom *FlashGeomFind(const uint8_t ids[4]) {
+	unsigned int i;
+
+	for (i = 0; i < FLASH_GEOM_CHIPS; i++) {
+		if (!memcmp(chips[i].ids, ids, chips[i].idLen)) return &chips[i];
+	}
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Obtains the sector containing an address.
+ *
+ * \param[in]  g     Chip geometry. If NULL, uniform sectors of
+ *                   FLASH_GEOM_DEF_SECT bytes are assumed.
+ * \param[in]  addr  Address to search.
+ * \param[out] start Start address of the sector.
+ * \param[out] len   Length of the sector.
+ *
+ * \return 0 if OK, nonzero if the address is beyond the chip capacity.
+ ****************************************************************************/
+int FlashGeomSect(const FlashGeom *g, uint32_t addr, uint32_t *start,
+		uint32_t *len) {
+	if (!g) {
+		*start = addr & ~(FLASH_GEOM_DEF_SECT - 1);
+		*len = FLASH_GEOM_DEF_SECT;
+		return 0;
+	}
+
+	return !FlashGeomRegion(g, addr, start, len);
+}
+
+/************************************************************************//**
+ * Obtains the length of the biggest sector of the chip.
+ *
+ * \param[in] g Chip geometry. If NULL, FLASH_GEOM_DEF_SECT is returned.
+ *
+ * \return Length of the biggest sector.
+ ****************************************************************************/
+uint32_t FlashGeomMaxSect(const FlashGeom *g) {
+	uint32_t max = 0;
+	int i;
+
+	if (!g) return FLASH_GEOM_DEF_SECT;
+	for (i = 0; i < FLASH_GEOM_REGIONS && g->region[i].count; i++) {
+		max = MAX(max, g->region[i].len);
+	}
+
+	return max;
+}
+
+/************************************************************************//**
+ * Plans the sector erases needed to write a memory range, in chunks of
+ * chunkLen bytes. Each chunk gets an erase operation covering the sectors
+ * it touches that have not been erased yet, so erases can be scheduled
+ * right ahead of the data that needs them instead of all up front.
+ *
+ * \param[in]  g        Chip geometry. If NULL, a single operation
+ *                      erasing the requested range is planned, and the
+ *                      cart is left to round it to sectors.
+ * \param[in]  addr     Start address of the range to write.
+ * \param[in]  len      Length of the range to write.
+ * \param[in]  chunkLen Length of the write chunks. If 0, a single erase
+ *                      operation covering the whole range is planned.
+ * \param[out] plan     Planned erase operations.
+ * \param[in]  max      Maximum number of operations in plan.
+ *
+ * \return Number of planned operations, or -1 if the range is beyond the
+ * chip capacity or the plan does not fit.
+ ****************************************************************************/
+int FlashGeomPlan(const FlashGeom *g, uint32_t addr, uint32_t len,
+		uint32_t chunkLen, FlashErase plan[], int max) {
+	const FlashRegion *r;
+	FlashErase *op;
+	uint32_t end, pos, chunkEnd;
+	uint32_t erased = addr, sect, sectLen;
+	int n = 0;
+
+	if (!len) return 0;
+	if (max < 1) return -1;
+	if (!g) {
+		plan->addr = plan->before = addr;
+		plan->len = len;
+		plan->sects = plan->ms = 0;
+		return 1;
+	}
+	if ((len > g->capacity) || (addr > g->capacity - len)) return -1;
+	end = addr + len;
+	if (!chunkLen) chunkLen = len;
+
+	// Everything before the sector containing addr is left untouched
+	FlashGeomRegion(g, addr, &erased, &sectLen);
+	for (pos = addr; pos < end; pos = chunkEnd) {
+		chunkEnd = MIN(pos + chunkLen, end);
+		if (erased >= chunkEnd) continue;
+		if (n == max) return -1;
+		op = &plan[n++];
+		op->addr = erased;
+		op->before = pos;
+		op->sects = op->ms = 0;
+		// Erase whole sectors until the chunk is covered
+		while (erased < chunkEnd) {
+			r = FlashGeomRegion(g, erased, &sect, &sectLen);
+			op->sects++;
+			op->ms += r->eraseMs;
+			erased += sectLen;
+		}
+		op->len = erased - op->addr;
+	}
+
+	return n;
+}
+
+/************************************************************************//**
+ * Estimates the typical time needed to program a number of bytes.
+ *
+ * \param[in] g   Chip geometry.
+ * \param[in] len Number of bytes to program.
+ *
+ * \return Typical program time in ms, or 0 if the chip is not known.
+ ****************************************************************************/
+uint32_t FlashGeomProgMs(const FlashGeom *g, uint32_t len) {
+	if (!g) return 0;
+	// Flash is programmed in 16-bit words
+	return (uint64_t)((len + 1) / 2) * g->progUs / 1000;
+}
+
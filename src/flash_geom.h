@@ -0,0 +1,121 @@
+/************************************************************************//**
+ * \brief Flash chip geometry database and erase planner.
+ *
+ * Flash chips are identified by the manufacturer and device IDs returned
+ * by WfFlashIdsGet(). For each known chip, the sector map, capacity and
+ * typical erase and program times are available. The erase planner uses
+ * the sector map to obtain the minimal set of sector erases covering a
+ * write.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup FlashGeom flash_geom
+ * \{
+ ****************************************************************************/
+
+#ifndef _FLASH_GEOM_H_
+#define _FLASH_GEOM_H_
+
+#include <stdint.h>
+
+/// Maximum number of sector regions of a chip
+#define FLASH_GEOM_REGIONS	3
+/// Sector length assumed for unknown chips
+#define FLASH_GEOM_DEF_SECT	65536
+
+/// Region of consecutive sectors with the same length
+typedef struct {
+	uint16_t count;		///< Number of sectors in the region (0 ends map)
+	uint32_t len;		///< Length of each sector
+	uint16_t eraseMs;	///< Typical erase time of each sector, in ms
+} FlashRegion;
+
+/// Flash chip geometry
+typedef struct {
+	const char *name;	///< Chip name
+	uint8_t ids[4];		///< Manufacturer and device IDs
+	uint8_t idLen;		///< Number of significant bytes in ids
+	uint32_t capacity;	///< Chip capacity in bytes
+	uint16_t progUs;	///< Typical word program time, in us
+	/// Sector map, starting at address 0
+	FlashRegion region[FLASH_GEOM_REGIONS];
+} FlashGeom;
+
+/// Erase operation of an erase plan
+typedef struct {
+	uint32_t addr;		///< Start address (sector aligned)
+	uint32_t len;		///< Length (whole sectors)
+	uint32_t before;	///< Erase must complete before writing this address
+	uint32_t sects;		///< Number of sectors erased
+	uint32_t ms;		///< Typical erase time, in ms
+} FlashErase;
+
+/************************************************************************//**
+ * Searches the geometry of a flash chip.
+ *
+ * \param[in] ids Flash chip IDs, as returned by WfFlashIdsGet().
+ *
+ * \return The chip geometry, or NULL if the chip is not known.
+ ****************************************************************************/
+const FlashGeom *FlashGeomFind(const uint8_t ids[4]);
+
+/************************************************************************//**
+ * Obtains the sector containing an address.
+ *
+ * \param[in]  g     Chip geometry. If NULL, uniform sectors of
+ *                   FLASH_GEOM_DEF_SECT bytes are assumed.
+ * \param[in]  addr  Address to search.
+ * \param[out] start Start address of the sector.
+ * \param[out] len   Length of the sector.
+ *
+ * \return 0 if OK, nonzero if the address is beyond the chip capacity.
+ ****************************************************************************/
+int FlashGeomSect(const FlashGeom *g, uint32_t addr, uint32_t *start,
+		uint32_t *len);
+
+/************************************************************************//**
+ * Obtains the length of the biggest sector of the chip.
+ *
+ * \param[in] g Chip geometry. If NULL, FLASH_GEOM_DEF_SECT is returned.
+ *
+ * \return Length of the biggest sector.
+ ****************************************************************************/
+uint32_t FlashGeomMaxSect(const FlashGeom *g);
+
+/************************************************************************//**
+ * Plans the sector erases needed to write a memory range, in chunks of
+ * chunkLen bytes. Each chunk gets an erase operation covering the sectors
+ * it touches that have not been erased yet, so erases can be scheduled
+ * right ahead of the data that needs them instead of all up front.
+ *
+ * \param[in]  g        Chip geometry. If NULL, a single operation
+ *                      erasing the requested range is planned, and the
+ *                      cart is left to round it to sectors.
+ * \param[in]  addr     Start address of the range to write.
+ * \param[in]  len      Length of the range to write.
+ * \param[in]  chunkLen Length of the write chunks. If 0, a single erase
+ *                      operation covering the whole range is planned.
+ * \param[out] plan     Planned erase operations.
+ * \param[in]  max      Maximum number of operations in plan.
+ *
+ * \return Number of planned operations, or -1 if the range is beyond the
+ * chip capacity or the plan does not fit.
+ ****************************************************************************/
+int FlashGeomPlan(const FlashGeom *g, uint32_t addr, uint32_t len,
+		uint32_t chunkLen, FlashErase plan[], int max);
+
+/************************************************************************//**
+ * Estimates the typical time needed to program a number of bytes.
+ *
+ * \param[in] g   Chip geometry.
+ * \param[in] len Number of bytes to program.
+ *
+ * \return Typical program time in ms, or 0 if the chip is not known.
+ ****************************************************************************/
+uint32_t FlashGeomProgMs(const FlashGeom *g, uint32_t len);
+
+#endif /*_FLASH_GEOM_H_*/
+
+/** \} */
+
@@ -0,0 +1,524 @@
+/************************************************************************//**
+ * fleet: Flashes the same image to many carts concurrently, with a thread
+ * and a connection context per cart, sharing a read-only mapping of the
+ * image.
+ ****************************************************************************/
+#include "fleet.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifndef __OS_WIN
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "wflash.h"
+#include "flash_geom.h"
+#include "rom_head.h"
+#include "crc32.h"
+#include "trace.h"
+
+/// Length of the blocks verified by CRC
+#define FLEET_CRC_BLOCK		65536
+/// Read commands in flight when verifying by reading back
+#define FLEET_READ_WINDOW	8
+/// Maximum time to wait for the bootloader to be ready after connecting
+#define FLEET_READY_MS		5000
+/// Progress refresh period, in ms
+#define FLEET_TICK_MS		250
+/// Maximum length of a cart address, including the port
+#define FLEET_HOST_LEN		256
+/// Stack size of the cart threads
+#define FLEET_STACK_LEN		(256 * 1024)
+
+/// Cart processing state
+typedef enum {
+	FLEET_WAIT = 0,		///< Not started
+	FLEET_CONNECT,		///< Connecting and waiting for the bootloader
+	FLEET_FLASH,		///< Erasing and flashing
+	FLEET_VERIFY,		///< Verifying
+	FLEET_BOOT,			///< Booting
+	FLEET_DONE			///< Finished
+} FleetState;
+
+/// State names, for the progress display
+static const char * const stateName[] = {
+	"waiting", "connect", "flash", "verify", "boot", "done"
+};
+
+struct Fleet;
+
+/// Cart of the fleet
+typedef struct {
+	struct Fleet *fleet;	///< Fleet the cart belongs to
+	char host[FLEET_HOST_LEN];///< Host name or address
+	char name[FLEET_HOST_LEN + 8];///< Host and port, for display
+	uint16_t port;			///< Port
+	pthread_t thread;		///< Thread driving the cart
+	FleetState state;		///< Processing state
+	const char *err;		///< Failed step, NULL if OK
+	uint32_t done;			///< Bytes flashed
+	uint64_t start;			///< Start time, in us
+	uint64_t end;			///< End time, in us
+	uint8_t bad;			///< Verification found a difference
+} FleetCart;
+
+/// Fleet data, shared by all the cart threads
+typedef struct Fleet {
+	const FleetJob *job;	///< Job run on each cart
+	const uint8_t *img;		///< Image, mapped read-only
+	uint8_t *head;			///< Patched copy of the first chunk, or NULL
+	uint32_t headLen;		///< Length of the patched copy
+	uint32_t *crc;			///< CRC of each FLEET_CRC_BLOCK of the image
+	uint32_t nCrc;			///< Number of CRCs
+	FleetCart *cart;		///< Carts
+	int n;					///< Number of carts
+	int running;			///< Number of carts not finished
+	pthread_mutex_t lock;	///< Protects cart progress and state
+	pthread_cond_t change;	///< Signalled when a cart finishes
+#ifndef __OS_WIN
+	size_t mapLen;			///< Length of the mapping
+#endif
+} Fleet;
+
+/************************************************************************//**
+ * Parses a list of cart addresses: comma separated host[:port] entries, or
+ * '@' followed by the name of a file with an entry per line.
+ *
+ * \param[in]  list  Address list. It is modified.
+ * \param[out] hosts Parsed addresses, FLEET_MAX_CARTS entries long. They
+ *                   must be freed with FleetHostsFree().
+ *
+ * \return Number of addresses, or -1 on error.
+ ****************************************************************************/
+int FleetHostsParse(char *list, char *hosts[]) {
+	char line[FLEET_HOST_LEN + 8];
+	const char *sep = ",";
+	char *tok;
+	FILE *f = NULL;
+	int n = 0;
+
+	if (list[0] == '@') {
+		if (!(f = fopen(list + 1, "r"))) {
+			perror(list + 1);
+			return -1;
+		}
+		sep = " \t\r\n";
+	}
+	while (f?fgets(line, sizeof(line), f) != NULL:n == 0) {
+		for (tok = strtok(f?line:list, sep); tok; tok = strtok(NULL, sep)) {
+			if (tok[0] == '#') break;
+			if (n == FLEET_MAX_CARTS || strlen(tok) >= FLEET_HOST_LEN) {
+				PrintErr("Too many carts, or address %s too long!\n", tok);
+				FleetHostsFree(hosts, n);
+				if (f) fclose(f);
+				return -1;
+			}
+			if (!(hosts[n] = strdup(tok))) {
+				perror("Allocating cart list");
+				FleetHostsFree(hosts, n);
+				if (f) fclose(f);
+				return -1;
+			}
+			n++;
+		}
+		if (!f) break;
+	}
+	if (f) fclose(f);
+	if (!n) PrintErr("Empty cart list!\n");
+
+	return n?n:-1;
+}
+
+/************************************************************************//**
+ * Frees the addresses obtained by FleetHostsParse().
+ *
+ * \param[in] hosts Addresses.
+ * \param[in] n     Number of addresses.
+ ****************************************************************************/
+void FleetHostsFree(char *hosts[], int n) {
+	while (n--) free(hosts[n]);
+}
+
+// Maps the image file read-only. Without mmap, it is read to memory.
+static int FleetImageMap(Fleet *f) {
+	const FleetJob *j = f->job;
+#ifdef __OS_WIN
+	FILE *rom;
+	uint8_t *img;
+
+	if (!(rom = fopen(j->file, "rb"))) {
+		perror(j->file);
+		return 1;
+	}
+	if (!(img = malloc(j->len)) || (fread(img, j->len, 1, rom) != 1)) {
+		perror(j->file);
+		free(img);
+		fclose(rom);
+		return 1;
+	}
+	fclose(rom);
+	f->img = img;
+#else
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(j->file, O_RDONLY)) < 0) {
+		perror(j->file);
+		return 1;
+	}
+	if (fstat(fd, &st) || (st.st_size < j->len)) {
+		PrintErr("%s is shorter than %u bytes!\n", j->file, j->len);
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, j->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(j->file);
+		return 1;
+	}
+	f->img = map;
+	f->mapLen = j->len;
+#endif
+	return 0;
+}
+
+static void FleetImageUnmap(Fleet *f) {
+#ifdef __OS_WIN
+	free((uint8_t*)f->img);
+#else
+	munmap((void*)f->img, f->mapLen);
+#endif
+}
+
+/************************************************************************//**
+ * Prepares the data shared by all the carts: maps the image, patches a
+ * copy of the first chunk if needed, and computes the CRCs used to verify.
+ *
+ * \param[out] f   Fleet data.
+ * \param[in]  job Job to run on each cart.
+ *
+ * \return 0 if OK, nonzero on error.
+ ****************************************************************************/
+static int FleetImagePrepare(Fleet *f, const FleetJob *job) {
+	uint32_t off, len, i;
+
+	f->job = job;
+	if (FleetImageMap(f)) return 1;
+	// Chunks are sent from the mapping, but the first one
+	if (!job->addr && !job->noPatch && job->len >= ROM_HEAD_LEN) {
+		f->headLen = MIN(MAX(job->chunkLen, ROM_HEAD_LEN), job->len);
+		if (!(f->head = malloc(f->headLen))) {
+			perror("Allocating ROM header");
+			return 1;
+		}
+		memcpy(f->head, f->img, f->headLen);
+		RomHeadPatch(f->head);
+	}
+	// CRC tables must be built before using them from several threads
+	Crc32Init();
+	if (job->verify) {
+		f->nCrc = (job->len + FLEET_CRC_BLOCK - 1) / FLEET_CRC_BLOCK;
+		if (!(f->crc = malloc(f->nCrc * sizeof(uint32_t)))) {
+			perror("Allocating CRCs");
+			return 1;
+		}
+		for (i = 0, off = 0; i < f->nCrc; i++, off += len) {
+			len = MIN(FLEET_CRC_BLOCK, job->len - off);
+			f->crc[i] = 0;
+			// Only the first block can overlap the patched header
+			if (off < f->headLen) {
+				f->crc[i] = Crc32(0, f->head, MIN(len, f->headLen));
+			}
+			if (off + len > f->headLen) {
+				f->crc[i] = Crc32(f->crc[i], f->img + MAX(off, f->headLen),
+						off + len - MAX(off, f->headLen));
+			}
+		}
+	}
+	return 0;
+}
+
+// Obtains the data to flash at an offset of the image.
+static inline const uint8_t *FleetData(const Fleet *f, uint32_t off) {
+	return off < f->headLen?f->head + off:f->img + off;
+}
+
+// Updates the state of a cart.
+static void FleetStateSet(FleetCart *c, FleetState state) {
+	pthread_mutex_lock(&c->fleet->lock);
+	c->state = state;
+	pthread_mutex_unlock(&c->fleet->lock);
+}
+
+// Compares a chunk read back with the image.
+static uint32_t FleetReadChunk(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx) {
+	FleetCart *c = (FleetCart*)ctx;
+	const Fleet *f = c->fleet;
+	uint32_t off = addr - f->job->addr;
+	uint32_t headPart = off < f->headLen?MIN(len, f->headLen - off):0;
+
+	if (memcmp(data, FleetData(f, off), headPart) ||
+			memcmp(data + headPart, f->img + off + headPart,
+				len - headPart)) {
+		c->bad = TRUE;
+		return 0;
+	}
+	return f->job->readLen;
+}
+
+// Verifies the flashed image by CRC if supported, reading it back if not.
+static int FleetVerify(WfCtx *wf, FleetCart *c) {
+	const Fleet *f = c->fleet;
+	const FleetJob *j = f->job;
+	uint32_t *crc;
+	uint8_t *buf;
+	int err;
+
+	if (WfCrc32Supported(wf)) {
+		if (!(crc = malloc(f->nCrc * sizeof(uint32_t)))) return 1;
+		err = WfCrc32(wf, j->addr, j->len, FLEET_CRC_BLOCK, crc);
+		if (!err && memcmp(crc, f->crc, f->nCrc * sizeof(uint32_t))) {
+			c->bad = TRUE;
+			err = 1;
+		}
+		free(crc);
+		return err;
+	}
+	if (!(buf = malloc(j->readLen))) return 1;
+	err = WfReadPipe(wf, j->addr, j->len, j->readLen, FLEET_READ_WINDOW, buf,
+			j->readLen, FleetReadChunk, c);
+	free(buf);
+	return err;
+}
+
+/************************************************************************//**
+ * Cart thread: connects to the cart, erases the sectors covered by the
+ * image right ahead of the chunks that need them, flashes the image,
+ * verifies it and boots it, as requested.
+ *
+ * \param[in] arg Cart.
+ *
+ * \return NULL.
+ ****************************************************************************/
+static void *FleetWorker(void *arg) {
+	FleetCart *c = (FleetCart*)arg;
+	Fleet *f = c->fleet;
+	const FleetJob *j = f->job;
+	FlashErase *plan = NULL;
+	uint32_t off, toWrite;
+	uint8_t *ids;
+	int nop = 0, next = 0, max;
+	WfCtx *wf;
+
+	TraceThreadName(c->name);
+	c->start = TimeUs();
+	FleetStateSet(c, FLEET_CONNECT);
+	if (!(wf = WfCtxNew()) || WfConnect(wf, c->host, c->port) || (WfReady(wf, FLEET_READY_MS) < 0)) {
+		c->err = "connect";
+		goto out;
+	}
+	if (j->erase) {
+		max = j->len / j->chunkLen + 2;
+		if (!(ids = WfFlashIdsGet(wf)) || !(plan = malloc(max *
+						sizeof(FlashErase))) || ((nop = FlashGeomPlan(
+						FlashGeomFind(ids), j->addr, j->len, j->chunkLen,
+						plan, max)) < 0)) {
+			c->err = "erase plan";
+			goto out;
+		}
+	}
+
+	FleetStateSet(c, FLEET_FLASH);
+	WfPipeWindowSet(wf, j->window);
+	// The image stays mapped, so commands can be batched
+	WfBatchBegin(wf);
+	for (off = 0; off < j->len; off += toWrite) {
+		toWrite = MIN(j->chunkLen, j->len - off);
+		for (; next < nop && plan[next].before < j->addr + off + toWrite;
+				next++) {
+			if (WfErasePipe(wf, plan[next].addr, plan[next].len)) break;
+		}
+		if (next < nop && plan[next].before < j->addr + off + toWrite) break;
+		if (WfFlashPipe(wf, j->addr + off, toWrite,
+					(uint8_t*)FleetData(f, off))) break;
+		pthread_mutex_lock(&f->lock);
+		c->done = off + toWrite;
+		pthread_mutex_unlock(&f->lock);
+	}
+	if (WfBatchEnd(wf) || (off < j->len) || WfPipeFlush(wf)) {
+		c->err = "flash";
+		goto out;
+	}
+	if (j->verify) {
+		FleetStateSet(c, FLEET_VERIFY);
+		if (FleetVerify(wf, c)) {
+			c->err = c->bad?"verify mismatch":"verify";
+			goto out;
+		}
+	}
+	if (j->bootAddr || j->autoRun) {
+		FleetStateSet(c, FLEET_BOOT);
+		if ((j->bootAddr?WfBoot(wf, j->bootAddr):WfAutoRun(wf)) != WF_OK) {
+			c->err = "boot";
+		}
+	}
+
+out:
+	WfCtxFree(wf);
+	free(plan);
+	pthread_mutex_lock(&f->lock);
+	c->end = TimeUs();
+	c->state = FLEET_DONE;
+	f->running--;
+	pthread_cond_signal(&f->change);
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Draws the progress of every cart, a line each, overwriting the previous
+ * drawing. The fleet lock must be held.
+ *
+ * \param[in] f       Fleet.
+ * \param[in] columns Number of columns of the console.
+ * \param[in] redraw  TRUE if the previous drawing has to be overwritten.
+ ****************************************************************************/
+static void FleetDraw(const Fleet *f, int columns, int redraw) {
+	const FleetCart *c;
+	uint64_t now = TimeUs();
+	char line[256];
+	int width = MIN(columns - 1, (int)sizeof(line) - 1);
+	int i, len, bar, fill;
+
+	if (redraw) printf("\e[%dA", f->n);
+	for (i = 0; i < f->n; i++) {
+		c = &f->cart[i];
+		len = snprintf(line, sizeof(line), "%-21.21s %-7s %3u%% %8.1f KiB/s ",
+				c->name, c->err?"FAILED":stateName[c->state],
+				(unsigned)((uint64_t)100 * c->done / f->job->len),
+				c->start && c->done?c->done / 1.024 /
+				((c->end?c->end:now) - c->start) * 1000:0.0);
+		// Fill the rest of the line with a bar, if there is room
+		if ((bar = width - len - 2) > 4) {
+			fill = (uint64_t)bar * c->done / f->job->len;
+			line[len++] = '[';
+			memset(line + len, '=', fill);
+			memset(line + len + fill, ' ', bar - fill);
+			len += bar;
+			line[len++] = ']';
+		}
+		line[MIN(len, width)] = '\0';
+		printf("\r%s\e[K\n", line);
+	}
+	fflush(stdout);
+}
+
+// Prints the result of each cart, and returns the number of failures.
+static int FleetReport(const Fleet *f, uint64_t us) {
+	const FleetCart *c;
+	int i, failed = 0;
+	double secs;
+
+	for (i = 0; i < f->n; i++) failed += f->cart[i].err != NULL;
+	printf("Fleet: %d of %d cart%s OK, %d failed, %.2f s.\n", f->n - failed,
+			f->n, f->n == 1?"":"s", failed, us / 1e6);
+	for (i = 0; i < f->n; i++) {
+		c = &f->cart[i];
+		secs = (c->end - c->start) / 1e6;
+		if (c->err) {
+			printf("  %-21s FAIL (%s)\n", c->name, c->err);
+		} else {
+			printf("  %-21s PASS %6.3f MB/s %7.2f s\n", c->name,
+					secs?f->job->len / 1e6 / secs:0, secs);
+		}
+	}
+	return failed;
+}
+
+/************************************************************************//**
+ * Flashes an image to many carts concurrently, and prints the result of
+ * each one.
+ *
+ * \param[in] job     Job to run on each cart.
+ * \param[in] hosts   Cart addresses, in host[:port] format.
+ * \param[in] n       Number of carts.
+ * \param[in] columns Number of columns of the console.
+ *
+ * \return Number of carts that failed, or -1 if the job could not start.
+ ****************************************************************************/
+int FleetFlash(const FleetJob *job, char *hosts[], int n, int columns) {
+	Fleet f;
+	FleetCart *c;
+	pthread_attr_t attr;
+	struct timespec ts;
+	uint64_t start = TimeUs();
+	int tty = isatty(STDOUT_FILENO);
+	char *port;
+	int i, failed;
+
+	memset(&f, 0, sizeof(Fleet));
+	if (!job->len || !job->chunkLen || FleetImagePrepare(&f, job) ||
+			!(f.cart = calloc(n, sizeof(FleetCart)))) {
+		if (f.img) FleetImageUnmap(&f);
+		free(f.head);
+		free(f.crc);
+		return -1;
+	}
+	f.n = n;
+	pthread_mutex_init(&f.lock, NULL);
+	pthread_cond_init(&f.change, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, FLEET_STACK_LEN);
+
+	printf("Flashing %s to %d cart%s at 0x%06X...\n", job->file, n,
+			n == 1?"":"s", job->addr);
+	pthread_mutex_lock(&f.lock);
+	for (i = 0; i < n; i++) {
+		c = &f.cart[i];
+		c->fleet = &f;
+		strcpy(c->host, hosts[i]);
+		c->port = job->port;
+		if ((port = strchr(c->host, ':'))) {
+			*port++ = '\0';
+			c->port = strtol(port, NULL, 0);
+		}
+		snprintf(c->name, sizeof(c->name), "%s:%u", c->host, c->port);
+		if (pthread_create(&c->thread, &attr, FleetWorker, c)) {
+			c->err = "thread";
+			c->state = FLEET_DONE;
+		} else f.running++;
+	}
+	pthread_attr_destroy(&attr);
+
+	// Refresh progress until all the carts finish
+	if (tty) FleetDraw(&f, columns, FALSE);
+	while (f.running) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FLEET_TICK_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&f.change, &f.lock, &ts);
+		if (tty) FleetDraw(&f, columns, TRUE);
+	}
+	pthread_mutex_unlock(&f.lock);
+	for (i = 0; i < n; i++) {
+		if (f.cart[i].thread) pthread_join(f.cart[i].thread, NULL);
+	}
+
+	failed = FleetReport(&f, TimeUs() - start);
+	pthread_mutex_destroy(&f.lock);
+	pthread_cond_destroy(&f.change);
+	FleetImageUnmap(&f);
+	free(f.head);
+	free(f.crc);
+	free(f.cart);
+
+	return failed;
+}
@@ -0,0 +1,77 @@
+/************************************************************************//**
+ * \brief Fleet mode: flashes the same image to many carts concurrently.
+ *
+ * Each cart is driven by its own thread and wflash connection context. The
+ * image is mapped read-only once and shared by all the threads, so memory
+ * usage does not grow with the number of carts. Only the first chunk is
+ * copied, when its ROM header has to be patched. Progress of each cart is
+ * displayed while flashing, followed by a per-cart result with its
+ * throughput.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Fleet fleet
+ * \{
+ ****************************************************************************/
+
+#ifndef _FLEET_H_
+#define _FLEET_H_
+
+#include <stdint.h>
+
+/// Maximum number of carts in a fleet
+#define FLEET_MAX_CARTS		256
+
+/// Fleet job, the same for all the carts
+typedef struct {
+	const char *file;	///< Image file
+	uint32_t addr;		///< Flash address of the image
+	uint32_t len;		///< Length of the image
+	uint32_t chunkLen;	///< Length of each program chunk
+	uint32_t readLen;	///< Length of each read chunk, when reading back
+	unsigned int window;///< Program commands in flight
+	uint32_t bootAddr;	///< Boot address when done, 0 for no boot
+	uint16_t port;		///< Port of the carts not specifying one
+	uint8_t autoRun;	///< Boot from header entry point when done
+	uint8_t erase;		///< Erase the sectors covered by the image
+	uint8_t verify;		///< Verify the image after flashing
+	uint8_t noPatch;	///< Do not patch the ROM header
+} FleetJob;
+
+/************************************************************************//**
+ * Parses a list of cart addresses: comma separated host[:port] entries, or
+ * '@' followed by the name of a file with an entry per line.
+ *
+ * \param[in]  list  Address list. It is modified.
+ * \param[out] hosts Parsed addresses, FLEET_MAX_CARTS entries long. They
+ *                   must be freed with FleetHostsFree().
+ *
+ * \return Number of addresses, or -1 on error.
+ ****************************************************************************/
+int FleetHostsParse(char *list, char *hosts[]);
+
+/************************************************************************//**
+ * Frees the addresses obtained by FleetHostsParse().
+ *
+ * \param[in] hosts Addresses.
+ * \param[in] n     Number of addresses.
+ ****************************************************************************/
+void FleetHostsFree(char *hosts[], int n);
+
+/************************************************************************//**
+ * Flashes an image to many carts concurrently, and prints the result of
+ * each one.
+ *
+ * \param[in] job     Job to run on each cart.
+ * \param[in] hosts   Cart addresses, in host[:port] format.
+ * \param[in] n       Number of carts.
+ * \param[in] columns Number of columns of the console.
+ *
+ * \return Number of carts that failed, or -1 if the job could not start.
+ ****************************************************************************/
+int FleetFlash(const FleetJob *job, char *hosts[], int n, int columns);
+
+#endif /*_FLEET_H_*/
+
+/** \} */
@@ -0,0 +1,166 @@
+/************************************************************************//**
+ * lz: LZ compression of program payloads, in LZ4 block format.
+ ****************************************************************************/
+#include "lz.h"
+#include "util.h"
+#include <string.h>
+
+/// Shortest match
+#define LZ_MIN_MATCH		4
+/// Bytes at the end of a block that are always literals
+#define LZ_LAST_LITERALS	5
+/// Matches must start at least this number of bytes before the block end
+#define LZ_MF_LIMIT			12
+/// Longest match distance
+#define LZ_MAX_OFFSET		65535
+/// Length of the match finder hash, in bits
+#define LZ_HASH_BITS		12
+/// Literals scanned without a match before the search step grows, in bits
+#define LZ_SKIP_BITS		6
+
+// Reads 4 unaligned bytes.
+static inline uint32_t LzRead32(const uint8_t *p) {
+	uint32_t val;
+
+	memcpy(&val, p, 4);
+	return val;
+}
+
+// Hashes the 4 bytes starting a match.
+static inline uint32_t LzHash(uint32_t val) {
+	return (val * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the extension bytes of a length field.
+static uint8_t *LzLenPut(uint8_t *op, uint32_t len) {
+	for (; len >= 255; len -= 255) *op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+// Writes a sequence: a literal run followed by a match of matchLen bytes
+// at off bytes back. The last sequence has no match (off is 0). Returns
+// the end of the sequence, or NULL if it does not fit before oend.
+static uint8_t *LzSeqPut(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+		uint32_t litLen, uint32_t off, uint32_t matchLen) {
+	uint8_t *token = op;
+	uint32_t need = 1 + litLen + (litLen >= 15?litLen / 255 + 1:0);
+
+	if (off) {
+		matchLen -= LZ_MIN_MATCH;
+		need += 2 + (matchLen >= 15?matchLen / 255 + 1:0);
+	}
+	if (need > (uint32_t)(oend - op)) return NULL;
+	*op++ = MIN(litLen, 15) << 4;
+	if (litLen >= 15) op = LzLenPut(op, litLen - 15);
+	memcpy(op, lit, litLen);
+	op += litLen;
+	if (!off) return op;
+	*op++ = off;
+	*op++ = off >> 8;
+	*token |= MIN(matchLen, 15);
+	if (matchLen >= 15) op = LzLenPut(op, matchLen - 15);
+	return op;
+}
+
+uint32_t LzCompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t dstLen) {
+	// Position of the last occurrence of each hash
+	uint32_t table[1<<LZ_HASH_BITS];
+	const uint8_t *end = src + len;
+	const uint8_t *ip = src, *anchor = src, *ref;
+	uint8_t *op = dst;
+	uint32_t h, matchLen;
+
+	memset(table, 0, sizeof(table));
+	while (len > LZ_MF_LIMIT && ip <= end - LZ_MF_LIMIT) {
+		h = LzHash(LzRead32(ip));
+		ref = src + table[h];
+		table[h] = ip - src;
+		if ((ref >= ip) || (ip - ref > LZ_MAX_OFFSET) ||
+				(LzRead32(ref) != LzRead32(ip))) {
+			// Skip faster through data that does not compress
+			ip += 1 + ((ip - anchor) >> LZ_SKIP_BITS);
+			continue;
+		}
+		for (matchLen = LZ_MIN_MATCH; (ip + matchLen < end -
+					LZ_LAST_LITERALS) && (ref[matchLen] == ip[matchLen]);
+				matchLen++);
+		if (!(op = LzSeqPut(op, dst + dstLen, anchor, ip - anchor, ip - ref,
+						matchLen))) return 0;
+		ip += matchLen;
+		anchor = ip;
+		// Matches ending a run are likely to start another one
+		table[LzHash(LzRead32(ip - 2))] = ip - 2 - src;
+	}
+	if (!(op = LzSeqPut(op, dst + dstLen, anchor, end - anchor, 0, 0))) {
+		return 0;
+	}
+
+	return op - dst;
+}
+
+// Reads the extension bytes of a length field. Returns FALSE if the data
+// ends before the length.
+static int LzLenGet(const uint8_t **ip, const uint8_t *iend, uint32_t *len) {
+	uint8_t b;
+
+	do {
+		if (*ip >= iend) return FALSE;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return TRUE;
+}
+
+int LzDecode(LzDec *d, const uint8_t *src, uint32_t avail, uint32_t zLen,
+		uint8_t *dst, uint32_t len) {
+	const uint8_t *ip, *lit, *ref;
+	const uint8_t *iend = src + avail;
+	uint32_t n, m, off;
+	uint8_t *op;
+	uint8_t token;
+
+	while (d->in < avail) {
+		ip = src + d->in;
+		token = *ip++;
+		n = token >> 4;
+		if ((n == 15) && !LzLenGet(&ip, iend, &n)) break;
+		if (n > (uint32_t)(iend - ip)) break;
+		if (n > len - d->out) return -1;
+		lit = ip;
+		ip += n;
+		// The last sequence has no match
+		m = off = 0;
+		if (ip - src < zLen) {
+			if (iend - ip < 2) break;
+			off = ip[0] | ip[1]<<8;
+			ip += 2;
+			m = token & 15;
+			if ((m == 15) && !LzLenGet(&ip, iend, &m)) break;
+			m += LZ_MIN_MATCH;
+			if (!off || (off > d->out + n) || (m > len - d->out - n)) {
+				return -1;
+			}
+		}
+		// Sequence is complete
+		op = dst + d->out;
+		memcpy(op, lit, n);
+		op += n;
+		// Byte by byte, matches can overlap the data they produce
+		for (ref = op - off; m--;) *op++ = *ref++;
+		d->out = op - dst;
+		d->in = ip - src;
+	}
+
+	if (d->in == zLen) return 1;
+	// An incomplete sequence at the end of the block is corrupt
+	return avail < zLen?0:-1;
+}
+
+int LzDecompress(const uint8_t *src, uint32_t zLen, uint8_t *dst,
+		uint32_t len) {
+	LzDec d = {0, 0};
+
+	return LzDecode(&d, src, zLen, zLen, dst, len) == 1?(int)d.out:-1;
+}
@@ -0,0 +1,81 @@
+/************************************************************************//**
+ * \brief LZ compression of program payloads.
+ *
+ * Compresses and decompresses data in LZ4 block format: a sequence of
+ * literal runs, each followed by a match copying previous data (up to 64
+ * KiB back). Decoding only takes byte copies and needs no tables, so it is
+ * cheap on the cart side, and the compressor is a single pass greedy one,
+ * fast enough to compress chunks while previous ones are being sent. Blocks
+ * follow the LZ4 end of block rules (the last 5 bytes are literals, and the
+ * last match starts at least 12 bytes before the end), so they can also be
+ * decoded with any LZ4 block decoder.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Lz lz
+ * \{
+ ****************************************************************************/
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#include <stdint.h>
+
+/// Decompression progress, to decompress a block while it is received
+typedef struct {
+	uint32_t in;	///< Compressed bytes decoded
+	uint32_t out;	///< Decompressed bytes obtained
+} LzDec;
+
+/************************************************************************//**
+ * Compresses a data block. Compression is abandoned as soon as the output
+ * does not fit in dst, so the length of dst also sets the worst ratio
+ * worth sending.
+ *
+ * \param[in]  src    Data to compress.
+ * \param[in]  len    Length of the data.
+ * \param[out] dst    Compressed data.
+ * \param[in]  dstLen Length of dst.
+ *
+ * \return Length of the compressed data, or 0 if it does not fit in dst.
+ ****************************************************************************/
+uint32_t LzCompress(const uint8_t *src, uint32_t len, uint8_t *dst,
+		uint32_t dstLen);
+
+/************************************************************************//**
+ * Decompresses a data block.
+ *
+ * \param[in]  src  Compressed data.
+ * \param[in]  zLen Length of the compressed data.
+ * \param[out] dst  Decompressed data.
+ * \param[in]  len  Length of dst.
+ *
+ * \return Length of the decompressed data, or -1 if the compressed data is
+ * corrupt or does not fit in dst.
+ ****************************************************************************/
+int LzDecompress(const uint8_t *src, uint32_t zLen, uint8_t *dst,
+		uint32_t len);
+
+/************************************************************************//**
+ * Decompresses the part of a block received so far. Only complete
+ * sequences are decoded, the rest is decoded on the next call, once more
+ * data is available. Start with a zeroed progress.
+ *
+ * \param[inout] d     Decompression progress.
+ * \param[in]    src   Compressed data received so far.
+ * \param[in]    avail Length of the compressed data received so far.
+ * \param[in]    zLen  Length of the whole compressed block.
+ * \param[out]   dst   Decompressed data. Matches reference the data
+ *                     already there.
+ * \param[in]    len   Length of dst.
+ *
+ * \return 1 if the whole block was decompressed, 0 if more data is
+ * needed, or -1 if the compressed data is corrupt or does not fit in dst.
+ ****************************************************************************/
+int LzDecode(LzDec *d, const uint8_t *src, uint32_t avail, uint32_t zLen,
+		uint8_t *dst, uint32_t len);
+
+#endif /*_LZ_H_*/
+
+/** \} */
@@ -17,11 +17,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "progbar.h"
 #include "wflash.h"
+#include "cmds.h"
 #include "rom_head.h"
+#include "stream.h"
+#include "flash_geom.h"
+#include "adapt.h"
+#include "crc32.h"
+#include "daemon.h"
+#include "manifest.h"
+#include "fleet.h"
+#include "stats.h"
+#include "trace.h"
+#ifdef WF_URING
+#include "uring.h"
+#endif
 
 /// Maximum length of the file name string.
 #define MAX_FILELEN		255
@@ -33,6 +48,33 @@
 #define VERSION_MAJOR	0x00
 /// Minor version of the comman-line application
 #define VERSION_MINOR	0x01
+/// Default number of program commands in flight
+#define DEF_WINDOW		1
+/// Length of the data sent on each program command
+#define FLASH_CHUNK_LEN	64800
+/// Length of the data requested on each read command
+#define READ_CHUNK_LEN	3840
+/// Minimum chunk length when adapting (a full segment of data)
+#define CHUNK_MIN_LEN	1440
+/// Maximum chunk length when adapting
+#define CHUNK_MAX_LEN	64800
+/// Chunk length adaptation step
+#define CHUNK_STEP		1440
+/// Minimum number of read commands in flight
+#define READ_WINDOW		8
+/// Default read length
+#define READ_DEF_LEN	(4*1024*1024)
+/// Maximum time to wait for the bootloader to be ready after connecting
+#define READY_TIMEOUT_MS	5000
+/// Maximum number of cart connections kept by the daemon
+#define SESS_CARTS		8
+/// Maximum number of sectors checked by each CRC request
+#define CRC_SECTS		64
+
+#ifndef O_BINARY
+/// Binary open() mode, only needed on Windows
+#define O_BINARY		0
+#endif
 
 /// Structure containing a memory image (file, address and length)
 typedef struct {
@@ -41,6 +83,20 @@ typedef struct {
 	uint32_t len;	///< Block length
 } MemImage;
 
+/// Cart connection kept by the daemon between jobs
+typedef struct {
+	char host[MAX_FILELEN + 1];	///< Host of the connected cart
+	uint16_t port;				///< Port of the connected cart
+	WfCtx *wf;					///< Connection context
+	uint32_t lastJob;			///< Number of the last job using it
+} SessCart;
+
+/// Cart connections kept by the daemon between jobs, one per cart
+typedef struct {
+	SessCart cart[SESS_CARTS];	///< Connections
+	uint32_t jobs;				///< Number of jobs run
+} Session;
+
 /// Commandline flags (for arguments without parameters).
 typedef struct {
 	union {
@@ -55,7 +111,13 @@ typedef struct {
 			uint8_t boot:1;			///< Enter bootloader
 			uint8_t noPatch:1;		///< Do not patch the source ROM
 			uint8_t autoRun:1;		///< Run from entry point in cart header
-			uint8_t unused:7;
+			uint8_t stream:1;		///< Stream ROM from disk while flashing
+			uint8_t zeroCopy:1;		///< Send ROM directly from file descriptor
+			uint8_t delta:1;		///< Only flash sectors that changed
+			uint8_t adaptive:1;		///< Adapt chunk lengths to the link
+			uint8_t readback:1;		///< Verify by reading back
+			uint8_t compress:1;		///< Send compressed chunks when worth it
+			uint8_t unused:1;
 		};
 	};
 	int cols;						///< Number of columns of the terminal
@@ -67,16 +129,32 @@ static const struct option opt[] = {
 		{"wflash-port",	required_argument,	NULL,   'p'},
         {"flash",       required_argument,  NULL,   'f'},
         {"read",        required_argument,  NULL,   'r'},
+		{"manifest",	required_argument,	NULL,   'M'},
+		{"fleet",		required_argument,	NULL,   'F'},
 		{"auto-erase",	no_argument,		NULL,   'e'},
+		{"window",		required_argument,	NULL,   'w'},
+		{"adaptive",	no_argument,		NULL,   'c'},
+		{"stream",		no_argument,		NULL,   'S'},
+		{"zero-copy",	no_argument,		NULL,   'z'},
+		{"compress",	no_argument,		NULL,   'Z'},
+		{"delta",		no_argument,		NULL,   'D'},
         {"sect-erase",  required_argument,  NULL,   's'},
         {"verify",      no_argument,        NULL,   'V'},
+		{"readback",	no_argument,		NULL,   'k'},
 		{"no-patch",    no_argument,        NULL,   'n'},
 		{"boot",        required_argument,  NULL,   'B'},
 		{"auto-boot",   required_argument,  NULL,   'A'},
         {"flash-id",    no_argument,        NULL,   'i'},
 		{"pushbutton",  no_argument,        NULL,   'P'},
         {"boot-ver",    no_argument,        NULL,   'b'},
+		{"stats",		required_argument,	NULL,   'T'},
+		{"trace",		required_argument,	NULL,   't'},
+		{"record",		required_argument,	NULL,   'C'},
+		{"sndbuf",		required_argument,	NULL,   'U'},
+		{"notsent-lowat", required_argument,	NULL,   'L'},
 		{"dry-run",     no_argument,		NULL,   'd'},
+		{"daemon",		required_argument,	NULL,   'Y'},
+		{"session",		required_argument,	NULL,   'j'},
         {"version",     no_argument,        NULL,   'R'},
         {"verbose",     no_argument,        NULL,   'v'},
         {"help",        no_argument,        NULL,   'h'},
@@ -89,21 +167,106 @@ static const char *description[] = {
 	"wflash server port (default 1989)",
 	"Flash rom file",
 	"Read ROM/Flash to file",
+	"Run the flash, erase, read, verify and boot operations listed in "
+		"the manifest file, flashing all the images as a single stream",
+	"Flash the rom file to all the carts in the list (comma separated "
+		"host[:port] entries, or @file with an entry per line) concurrently",
 	"Automatically erase before write",
+	"Program commands in flight while flashing (default 1, max 32)",
+	"Adapt program and read chunk lengths to the link, remembering them "
+		"for the next run with the same host",
+	"Stream ROM from disk while flashing, using bounded memory",
+	"Send ROM directly from file to socket, without copying to user space",
+	"Stream ROM from disk, compressing each chunk while the previous ones "
+		"are sent, and send it compressed when it saves enough (requires "
+		"bootloader 0.3)",
+	"Only erase and flash the sectors that differ from cart contents",
 	"Erase flash range (with sector granularity)",
-	"Verify flash after writing file",
+	"Verify flash after writing file (by CRC if the bootloader supports it)",
+	"Verify by reading back, while flashing when possible, even if the "
+		"bootloader supports CRC",
 	"Do not patch ROM. Warning, this will overwrite the bootloader!",
 	"Run from Flash, at specified address",
 	"Automatically run from entry point specified in ROM header",
 	"Obtain flash chip identifiers",
 	"Pushbutton status read (bit 1:event, bit0:pressed)",
 	"Switch to bootloader mode",
+	"Report performance statistics when done: 'text' prints a summary, "
+		"'json' prints them as JSON, otherwise they are written as JSON to "
+		"the specified file",
+	"Record a timeline of the session, and write it to the specified file "
+		"in Chrome trace format (e.g. for ui.perfetto.dev)",
+	"Record the commands sent and the replies received to the specified "
+		"file, to play them later with wfreplay",
+	"Socket send buffer size in bytes (SO_SNDBUF), if the TCP statistics "
+		"show the congestion window is limited by it",
+	"Maximum bytes queued in the socket not sent yet (TCP_NOTSENT_LOWAT), "
+		"if the TCP statistics show data waiting to be sent delays commands",
 	"Dry run: don't actually do anything",
+	"Run as daemon, keeping cart connections open between the jobs "
+		"submitted on the specified UNIX socket",
+	"Submit the job to the daemon serving on the specified UNIX socket",
 	"Show program version",
 	"Show additional information",
 	"Print help screen and exit"
 };
 
+/// Destination of the data read by StreamRead()
+typedef struct {
+	FILE *dump;				///< File receiving the read data, or NULL
+	const char *dumpName;	///< Name of the dump file
+	FILE *ref;				///< File to verify read data against, or NULL
+	const char *refName;	///< Name of the verify file
+	uint8_t *refBuf;		///< Buffer for the verify file data
+	const uint8_t *img;		///< Image in memory to verify against, or NULL
+	uint32_t start;			///< Start address of the read
+	uint32_t len;			///< Length of the read
+	uint32_t badAddr;		///< First address failing verification
+	uint8_t wrote;			///< Byte written to badAddr
+	uint8_t read;			///< Byte read from badAddr
+	uint8_t bad;			///< Verification failed
+	uint8_t patch;			///< Verify file header was patched when flashing
+	ProgBar *bar;			///< Progress bar
+} ReadSink;
+
+/// Destination of the data read by CartRead()
+typedef struct {
+	uint8_t *buf;		///< Buffer receiving the range
+	uint32_t start;		///< Start address of the range
+} CartBuf;
+
+/// Delta flash counters
+typedef struct {
+	uint32_t written;	///< Bytes programmed
+	uint32_t skipped;	///< Image bytes not programmed
+	uint32_t changed;	///< Sectors programmed
+	uint32_t erased;	///< Sectors erased
+	uint32_t readBack;	///< Bytes read back from the cart
+} DeltaStats;
+
+/// Erase plan being executed while flashing
+typedef struct {
+	FlashErase *op;		///< Planned erase operations
+	int n;				///< Number of planned operations
+	int next;			///< Next operation to issue
+} ErasePlan;
+
+/// Connection context of the cart the job runs on.
+static WfCtx *wf = NULL;
+/// Geometry of the cart flash chip, NULL if unknown.
+static const FlashGeom *chip = NULL;
+/// Program chunk length controller
+static Adapt progChunk;
+/// Read chunk length controller
+static Adapt readChunk;
+#ifdef WF_URING
+/// io_uring for image file I/O, NULL to use stdio
+static Uring *fileRing = NULL;
+#endif
+/// Command line as given, submitted to the daemon, since parsing modifies
+/// the arguments.
+static char **cmdArgv = NULL;
+
 /// Default IP address of the MegaWiFi cartridge.
 const static char defIp[] = "192.168.1.60";
 /// Default port of the MegaWiFi cartridge.
@@ -145,8 +308,19 @@ void PrintHelp(char *prgName) {
 		   " - Auto erase Flash and write entire ROM to cartridge: %s -ef rom_file\n"
 		   " - Flash and verify 32 KiB to 0x700000: "
 		   "%s -Vf rom_file:0x700000:32768\n"
-		   " - Dump 1 MiB of the cartridge: %s -r rom_file::1048576\n",
-		   prgName, prgName, prgName);
+		   " - Dump 1 MiB of the cartridge: %s -r rom_file::1048576\n"
+		   " - Keep the cart connection open between runs: "
+		   "%s -Y /tmp/wflash.sock &\n"
+		   "   %s -j /tmp/wflash.sock -ef rom_file\n"
+		   " - Flash and verify a ROM on three carts at once: "
+		   "%s -F 192.168.1.61,192.168.1.62,192.168.1.63 -eVf rom_file\n"
+		   "\nManifest files have an operation per line:\n"
+		   "    flash file[:addr[:len]]\n"
+		   "    erase addr:len\n"
+		   "    read file[:addr[:len]]\n"
+		   "    verify\n"
+		   "    boot addr | autoboot\n",
+		   prgName, prgName, prgName, prgName, prgName, prgName);
 		   
 }
 
@@ -268,6 +442,266 @@ void PrintMemError(int code) {
 	}
 }
 
+/************************************************************************//**
+ * Obtains the length of the memory image file if not specified, and checks
+ * the image can be flashed: if the ROM header is covered by the range, it
+ * must be completely covered, unless auto-erase is used.
+ *
+ * \param[inout] fWr      Memory image to flash.
+ * \param[in]    autoErase Auto-erase requested.
+ *
+ * \return 0 if OK, nonzero if error.
+ *
+ * \note fWr.len is updated if not specified.
+ ****************************************************************************/
+int FlashImageCheck(MemImage *fWr, int autoErase) {
+	FILE *rom;
+
+	// Obtain length if not specified
+	if (!fWr->len) {
+		if (!(rom = fopen(fWr->file, "rb"))) {
+			perror(fWr->file);
+			return 1;
+		}
+	    fseek(rom, 0, SEEK_END);
+	    fWr->len = ftell(rom);
+		fclose(rom);
+	}
+	// If header covered by range, but not completeley, reject flash command
+	if (!autoErase && ((fWr->addr < ROM_HEAD_LEN && fWr->addr) ||
+			(!fWr->addr && fWr->len < ROM_HEAD_LEN))) {
+		PrintErr("ROM header must be completely covered by the range!\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Plans the sector erases needed to flash a list of segments, sorted by
+ * address and not sharing sectors, and prints a summary of the plan. If
+ * the flash chip geometry is known, only the sectors covered by the
+ * segments are erased, each one right ahead of the first chunk that needs
+ * it. Otherwise each segment range is erased before flashing it, letting
+ * the cart round it to sectors.
+ *
+ * \param[out] p        Erase plan. Must be freed with free(p->op).
+ * \param[in]  seg      Segments to flash.
+ * \param[in]  nseg     Number of segments.
+ * \param[in]  chunkLen Length of the chunks used to flash the segments.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int ErasePlanSegs(ErasePlan *p, const ManSeg *seg, int nseg,
+		uint32_t chunkLen) {
+	uint32_t sects = 0, ms = 0, len = 0;
+	int max = 0;
+	int i, n;
+
+	for (i = 0; i < nseg; i++) max += seg[i].len / chunkLen + 2;
+	p->next = p->n = 0;
+	if (!(p->op = malloc(max * sizeof(FlashErase)))) {
+		perror("Allocating erase plan");
+		return 1;
+	}
+	for (i = 0; i < nseg; i++, p->n += n, len += seg[i - 1].len) {
+		if ((n = FlashGeomPlan(chip, seg[i].addr, seg[i].len, chunkLen,
+						p->op + p->n, max - p->n)) < 0) {
+			PrintErr("Range 0x%06X:%06X is beyond the %s capacity!\n",
+					seg[i].addr, seg[i].len, chip->name);
+			free(p->op);
+			p->op = NULL;
+			return 1;
+		}
+	}
+	// Nothing to erase for empty segments
+	if (!p->n) return 0;
+	printf("Auto-erasing range 0x%06X:%06X", p->op[0].addr,
+			p->op[p->n - 1].addr + p->op[p->n - 1].len - p->op[0].addr);
+	if (chip) {
+		for (i = 0; i < p->n; i++) {
+			sects += p->op[i].sects;
+			ms += p->op[i].ms;
+		}
+		printf(" (%u sectors, ~%u ms erase, ~%u ms program)", sects, ms,
+				FlashGeomProgMs(chip, len));
+	}
+	printf("...\n");
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Plans the sector erases needed to flash a memory image, and prints a
+ * summary of the plan. See ErasePlanSegs().
+ *
+ * \param[out] p        Erase plan. Must be freed with free(p->op).
+ * \param[in]  addr     Start address of the image.
+ * \param[in]  len      Length of the image.
+ * \param[in]  chunkLen Length of the chunks used to flash the image.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int ErasePlanMake(ErasePlan *p, uint32_t addr, uint32_t len,
+		uint32_t chunkLen) {
+	const ManSeg seg = {addr, len, NULL, 1};
+
+	return ErasePlanSegs(p, &seg, 1, chunkLen);
+}
+
+/************************************************************************//**
+ * Issues the planned erase operations that must complete before writing
+ * a chunk. Erases are pipelined with program commands.
+ *
+ * \param[in] p    Erase plan.
+ * \param[in] addr Address of the chunk about to be written.
+ * \param[in] len  Length of the chunk about to be written.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int ErasePlanRun(ErasePlan *p, uint32_t addr, uint32_t len) {
+	FlashErase *op;
+
+	for (; p->next < p->n && p->op[p->next].before < addr + len;
+			p->next++) {
+		op = &p->op[p->next];
+		if (WfErasePipe(wf, op->addr, op->len)) {
+			PrintErr("Auto-erase failed!\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Reads len bytes from a file, at offset off. When using stdio, off must be
+// the current position of the file. Returns 0 if OK.
+static int FileRead(FILE *f, void *buf, uint32_t len, uint32_t off) {
+	uint64_t startUs = TimeUs();
+	int err;
+#ifdef WF_URING
+	uint32_t left;
+	ssize_t done = 0;
+
+	if (fileRing) {
+		for (left = len; left && (done = UringRead(fileRing, fileno(f),
+						(uint8_t*)buf + len - left, left, off + len - left)) > 0;
+				left -= done);
+		// File is shorter than expected
+		if (left && !done) errno = EIO;
+		err = left != 0;
+	} else
+#endif
+	err = fread(buf, len, 1, f) != 1;
+	TraceSpan("file", "file read", startUs, off, len);
+	return err;
+}
+
+// Writes len bytes to a file, at offset off. When using stdio, off must be
+// the current position of the file. Returns 0 if OK.
+static int FileWrite(FILE *f, const void *buf, uint32_t len, uint32_t off) {
+	uint64_t startUs = TimeUs();
+	int err;
+#ifdef WF_URING
+	uint32_t left;
+	ssize_t done = 0;
+
+	if (fileRing) {
+		for (left = len; left && (done = UringWrite(fileRing, fileno(f),
+						(uint8_t*)buf + len - left, left, off + len - left)) > 0;
+				left -= done);
+		if (left && !done) errno = EIO;
+		err = left != 0;
+	} else
+#endif
+	err = fwrite(buf, len, 1, f) != 1;
+	TraceSpan("file", "file write", startUs, off, len);
+	return err;
+}
+
+// Compares read data with the data written, recording the first
+// difference.
+static void VerifyCheck(ReadSink *s, uint32_t addr, const uint8_t *data,
+		const uint8_t *ref, uint32_t len) {
+	uint32_t i;
+
+	if (s->bad || (i = MemDiff(data, ref, len)) == len) return;
+	s->bad = TRUE;
+	s->badAddr = addr + i;
+	s->wrote = ref[i];
+	s->read = data[i];
+}
+
+// Verifies a chunk read back while flashing, against the image in memory.
+static uint32_t VerifyChunk(uint32_t addr, const uint8_t *data, uint32_t len,
+		void *ctx) {
+	ReadSink *s = (ReadSink*)ctx;
+
+	VerifyCheck(s, addr, data, s->img + addr - s->start, len);
+	return len;
+}
+
+// Prints the verification result. Returns nonzero if it failed.
+static int VerifyReport(const ReadSink *s) {
+	if (s->bad) {
+		printf("Verify failed at addr 0x%07X!\n", s->badAddr);
+		printf("Wrote: 0x%02X; Read: 0x%02X\n", s->wrote, s->read);
+		return 1;
+	}
+	printf("Verify OK!\n");
+	return 0;
+}
+
+/************************************************************************//**
+ * Programs a memory image through the pipeline, issuing the planned erases
+ * ahead of the chunks that need them. Commands must be batched, and are
+ * not waited for, so several images can be flashed as a single program
+ * stream.
+ *
+ * \param[in] img     Image to flash.
+ * \param[in] addr    Address of the image.
+ * \param[in] len     Length of the image.
+ * \param[in] plan    Erase plan.
+ * \param[in] columns Number of columns of the console, used to display
+ *                    the progress bar while flashing.
+ * \param[in] verify  If not NULL, each chunk is read back into back and
+ *                    checked by VerifyChunk(). The image must be the one
+ *                    set in verify.
+ * \param[in] back    Read back buffer, progChunk.max bytes long.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int ProgramImage(const uint8_t *img, uint32_t addr, uint32_t len,
+		ErasePlan *plan, int columns, ReadSink *verify, uint8_t *back) {
+	uint32_t toWrite;
+	uint32_t i;
+	ProgBar *bar;
+
+	bar = ProgBarStart(addr, len, columns);
+	AdaptStart(&progChunk);
+	for (i = 0; i < len;) {
+//		toWrite = MIN(2*1152, len - i);
+//		toWrite = MIN(57600, len - i);
+//		toWrite = MIN(1440, len - i);
+		toWrite = MIN(progChunk.len, len - i);
+		if (ErasePlanRun(plan, addr, toWrite) ||
+				WfFlashPipe(wf, addr, toWrite, (uint8_t*)img + i) ||
+				(verify && WfReadQueue(wf, addr, toWrite, back, VerifyChunk,
+									   verify))) {
+			ProgBarEnd(bar);
+			return 1;
+		}
+		AdaptDone(&progChunk, toWrite, WfPipeStatsGet(wf)->ackUs);
+		// Update vars and draw progress bar
+		i += toWrite;
+		addr += toWrite;
+		ProgBarSet(bar, i);
+	}
+	ProgBarEnd(bar);
+
+	return 0;
+}
+
 /************************************************************************//**
  * Allocs a buffer, reads a file to the buffer, and flashes the file pointed 
  * by the file argument. The buffer must be deallocated when not needed,
@@ -280,6 +714,9 @@ void PrintMemError(int code) {
  * 			  be neither patched nor trimmed).
  * \param[in] columns  Number of columns of the console, used to display
  *            the progress bar while flashing.
+ * \param[out] verify If not NULL, each chunk is read back right after
+ *            being programmed, while the next chunks are sent, and compared
+ *            with the image. The result is left here.
  *
  * \return Pointer to the allocated and flashed memory if OK, NULL if error.
  *
@@ -288,163 +725,976 @@ void PrintMemError(int code) {
  *          function, using a free() call.
  ****************************************************************************/
 uint16_t *AllocAndFlash(MemImage *fWr, int autoErase, int noPatch,
-		int columns) {
+		int columns, ReadSink *verify) {
     FILE *rom;
 	uint16_t *writeBuf;
-	uint32_t addr;
-	int toWrite;
-	uint32_t i;
-	// Address string, e.g.: 0x123456
-	char addrStr[9];
+	uint8_t *back = NULL;
+	ErasePlan plan = {NULL, 0, 0};
 
-	// If header covered by range, but not completeley, reject flash command
-	if (!autoErase && ((fWr->addr < ROM_HEAD_LEN && fWr->addr) ||
-			(!fWr->addr && fWr->len < ROM_HEAD_LEN))) return NULL;
+	if (FlashImageCheck(fWr, autoErase)) return NULL;
 	// Open the file to flash
 	if (!(rom = fopen(fWr->file, "rb"))) {
 		perror(fWr->file);
 		return NULL;
 	}
 
-	// Obtain length if not specified
-	if (!fWr->len) {
-	    fseek(rom, 0, SEEK_END);
-	    fWr->len = ftell(rom);
-	    fseek(rom, 0, SEEK_SET);
-	}
-
     writeBuf = malloc(fWr->len);
 	if (!writeBuf) {
 		perror("Allocating write buffer RAM");
 		fclose(rom);
 		return NULL;
 	}
-    fread(writeBuf, fWr->len, 1, rom);
+	if (FileRead(rom, writeBuf, fWr->len, 0)) {
+		perror(fWr->file);
+		free(writeBuf);
+		fclose(rom);
+		return NULL;
+	}
 	fclose(rom);
-	// If requested, perform auto-erase
-	if (autoErase) {
-		printf("Auto-erasing range 0x%06X:%06X...\n", fWr->addr, fWr->len);
-		if (WfFlashErase(fWr->addr, fWr->len)) {
+	// If requested, plan auto-erase
+	if (autoErase && ErasePlanMake(&plan, fWr->addr, fWr->len,
+				progChunk.min)) {
+		free(writeBuf);
+		return NULL;
+	}
+
+	// If header is included in flash image, and unless prohibited
+	if (!fWr->addr && !noPatch) RomHeadPatch((uint8_t*)writeBuf);
+	// Read back buffer. Chunks are received and compared one at a time.
+	if (verify) {
+		memset(verify, 0, sizeof(ReadSink));
+		verify->img = (uint8_t*)writeBuf;
+		verify->start = fWr->addr;
+		verify->len = fWr->len;
+		if (!(back = malloc(progChunk.max))) {
+			perror("Allocating read back buffer RAM");
+			free(plan.op);
 			free(writeBuf);
-			PrintErr("Auto-erase failed!\n");
 			return NULL;
 		}
 	}
 
-	// If header is included in flash image, and unless prohibited
-	if (!fWr->addr && !noPatch) RomHeadPatch((uint8_t*)writeBuf);
+   	printf("Flashing ROM %s starting at 0x%06X%s...\n", fWr->file, fWr->addr,
+			verify?" and verifying":"");
+
+	// The whole ROM is in memory, so pipelined commands can be batched
+	WfBatchBegin(wf);
+	if (ProgramImage((uint8_t*)writeBuf, fWr->addr, fWr->len, &plan,
+				columns, verify, back)) {
+		WfBatchEnd(wf);
+		free(plan.op);
+		free(back);
+		free(writeBuf);
+		PrintErr("Couldn't write to cart!\n");
+		return NULL;
+	}
+	free(plan.op);
+	// Wait for the chunks still in flight
+	if (WfBatchEnd(wf) || WfPipeFlush(wf)) {
+		free(back);
+		free(writeBuf);
+		PrintErr("Couldn't write to cart!\n");
+		return NULL;
+	}
+	free(back);
+	return writeBuf;
+}
 
-   	printf("Flashing ROM %s starting at 0x%06X...\n", fWr->file, fWr->addr);
+/************************************************************************//**
+ * Prints how much compression saved while flashing, and the throughput
+ * obtained.
+ *
+ * \param[in] start Program statistics when flashing started.
+ * \param[in] us    Time flashing took, in us.
+ ****************************************************************************/
+void PrintLzStats(const WfProgStats *start, uint64_t us) {
+	const WfProgStats *p = &WfStatsGet(wf)->prog;
+	uint64_t bytes = p->bytes - start->bytes;
+	uint64_t sent = p->sent - start->sent;
+
+	if (!sent || !us) return;
+	printf("Compressed %u of %u chunks: %llu bytes sent for %llu (%.2f:1), "
+			"%.1f KiB/s effective, %.1f KiB/s sent.\n",
+			p->lzChunks - start->lzChunks, p->chunks - start->chunks,
+			(unsigned long long)sent, (unsigned long long)bytes,
+			(double)bytes / sent, bytes * 1e6 / 1024 / us,
+			sent * 1e6 / 1024 / us);
+}
 
-	for (i = 0, addr = fWr->addr; i < fWr->len;) {
-//		toWrite = MIN(2*1152, fWr->len - i);
-//		toWrite = MIN(57600, fWr->len - i);
-//		toWrite = MIN(1440, fWr->len - i);
-		toWrite = MIN(64800, fWr->len - i);
-		if (WfFlash(addr, toWrite, ((uint8_t*)writeBuf) + i)) {
-			free(writeBuf);
+/************************************************************************//**
+ * Flashes the file pointed by the memory image argument, streaming it from
+ * disk. The file is read in chunks through a small ring of buffers, while
+ * previous chunks are being sent, so memory usage does not depend on the
+ * file length.
+ *
+ * \param[in] fWr      Memory image to flash.
+ * \param[in] autoErase Set to true to perform an erase operation before
+ *            flashing the memory image. Only the covered range is erased.
+ * \param[in] noPatch  If nonzero, ROM must be written 1:1 (i.e. it will
+ * 			  be neither patched nor trimmed).
+ * \param[in] lz       If nonzero and the bootloader supports it, chunks are
+ *            also compressed while read, and sent compressed when it saves
+ *            enough.
+ * \param[in] columns  Number of columns of the console, used to display
+ *            the progress bar while flashing.
+ *
+ * \return 0 if OK, nonzero if error.
+ *
+ * \note fWr.len is updated if not specified.
+ ****************************************************************************/
+int StreamFlash(MemImage *fWr, int autoErase, int noPatch, int lz,
+		int columns) {
+	Stream *rom;
+	uint8_t *chunk;
+	const uint8_t *z;
+	uint32_t addr;
+	uint32_t toWrite, zLen;
+	uint32_t i;
+	uint32_t chunkLen = progChunk.len;
+	WfProgStats prog = WfStatsGet(wf)->prog;
+	uint64_t startUs;
+	ErasePlan plan = {NULL, 0, 0};
+	ProgBar *bar;
+	int err = 0;
+
+	if (FlashImageCheck(fWr, autoErase)) return 1;
+	if (lz && !WfLzSupported(wf)) {
+		printf("Bootloader does not support compressed data, sending it "
+				"raw.\n");
+		lz = FALSE;
+	}
+	// Compressed chunks are decompressed by the cart on their own
+	if (lz) chunkLen = MIN(chunkLen, WF_LZ_CHUNK_MAX);
+	// Start reading the file. If header is included in flash image, and
+	// unless prohibited, the reader patches it. Stream chunks have a fixed
+	// length, so it cannot be adapted while flashing.
+	if (!(rom = StreamOpen(fWr->file, fWr->len, chunkLen,
+					!fWr->addr && !noPatch, lz))) return 1;
+	// If requested, plan auto-erase
+	if (autoErase && ErasePlanMake(&plan, fWr->addr, fWr->len, chunkLen)) {
+		StreamClose(rom);
+		return 1;
+	}
+
+   	printf("Flashing ROM %s starting at 0x%06X%s...\n", fWr->file, fWr->addr,
+			lz?", compressed":"");
+
+	bar = ProgBarStart(fWr->addr, fWr->len, columns);
+	AdaptStart(&progChunk);
+	startUs = TimeUs();
+	for (i = 0, addr = fWr->addr; i < fWr->len; i += toWrite) {
+		if (!(chunk = StreamGet(rom, &toWrite))) {
+			PrintErr("\nError reading %s!\n", fWr->file);
+			err = 1;
+			break;
+		}
+		z = lz?StreamLzGet(rom, &zLen):NULL;
+		err = ErasePlanRun(&plan, addr, toWrite) || (z?
+				WfFlashLzPipe(wf, addr, toWrite, z, zLen):
+				WfFlashPipe(wf, addr, toWrite, chunk));
+		// Data has been sent, chunk can be reused
+		StreamRelease(rom);
+		if (err) {
 			PrintErr("Couldn't write to cart!\n");
-			return NULL;
+			break;
 		}
+		AdaptDone(&progChunk, toWrite, WfPipeStatsGet(wf)->ackUs);
 		// Update vars and draw progress bar
-		i += toWrite;
 		addr += toWrite;
-   	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, fWr->len, columns, addrStr);
+		ProgBarSet(bar, i + toWrite);
 	}
-   	putchar('\n');
-	return writeBuf;
+	ProgBarEnd(bar);
+	free(plan.op);
+	if (StreamClose(rom)) err = 1;
+	// Wait for the chunks still in flight
+	if (!err && WfPipeFlush(wf)) {
+		PrintErr("Couldn't write to cart!\n");
+		err = 1;
+	}
+	if (!err && lz) PrintLzStats(&prog, TimeUs() - startUs);
+
+	return err;
 }
 
 /************************************************************************//**
- * Allocs a buffer and reads from cart. Does NOT save the buffer to a file.
- * Buffer must be deallocated using free() when not needed anymore.
+ * Flashes the file pointed by the memory image argument, sending the file
+ * directly from its descriptor to the socket (zero-copy on Linux). Only the
+ * ROM header is read to user memory, to patch it before sending.
  *
- * \param[in] fRd     Memory image to read.
- * \param[in] columns Number of columns of the console, used to display
- *                    the progress bar while flashing.
+ * \param[in] fWr      Memory image to flash.
+ * \param[in] autoErase Set to true to perform an erase operation before
+ *            flashing the memory image. Only the covered range is erased.
+ * \param[in] noPatch  If nonzero, ROM must be written 1:1 (i.e. it will
+ * 			  be neither patched nor trimmed).
+ * \param[in] columns  Number of columns of the console, used to display
+ *            the progress bar while flashing.
  *
- * \return Pointer to the allocated and readed memory if OK, NULL if error.
+ * \return 0 if OK, nonzero if error.
  *
- * \warning A successfully allocated buffer must be freed externally to the
- *          function, using a free() call.
+ * \note fWr.len is updated if not specified.
  ****************************************************************************/
-uint16_t *AllocAndRead(MemImage *fRd, int columns) {
-	uint16_t *readBuf;
-	int toRead;
+int ZeroCopyFlash(MemImage *fWr, int autoErase, int noPatch, int columns) {
+	int rom;
+	uint8_t head[ROM_HEAD_LEN];
+	uint32_t headLen = 0;
 	uint32_t addr;
+	uint32_t toWrite;
 	uint32_t i;
-	// Address string, e.g.: 0x123456
-	char addrStr[9];
+	ErasePlan plan = {NULL, 0, 0};
+	ProgBar *bar;
+	int err = 0;
 
-	readBuf = malloc(fRd->len);
-	if (!readBuf) {
-		perror("Allocating read buffer RAM");
-		return NULL;
+	if (FlashImageCheck(fWr, autoErase)) return 1;
+	if ((rom = open(fWr->file, O_RDONLY | O_BINARY)) < 0) {
+		perror(fWr->file);
+		return 1;
+	}
+	// If header is included in flash image, and unless prohibited, read
+	// and patch it. It will be sent from here instead of from the file.
+	if (!fWr->addr && !noPatch) {
+		headLen = ROM_HEAD_LEN;
+		if (read(rom, head, headLen) != headLen) {
+			perror(fWr->file);
+			close(rom);
+			return 1;
+		}
+		RomHeadPatch(head);
+	}
+	// If requested, plan auto-erase
+	if (autoErase && ErasePlanMake(&plan, fWr->addr, fWr->len,
+				progChunk.min)) {
+		close(rom);
+		return 1;
 	}
-	printf("Reading cart starting at 0x%06X...\n", fRd->addr);
 
-	fflush(stdout);
-	for (i = 0, addr = fRd->addr; i < fRd->len;) {
-		toRead = MIN(3840, fRd->len - i);
-		if (WfRead(addr, toRead, ((uint8_t*)readBuf) + i)) {
-			free(readBuf);
-			PrintErr("Couldn't read from cart!\n");
-			return NULL;
+   	printf("Flashing ROM %s starting at 0x%06X...\n", fWr->file, fWr->addr);
+
+	bar = ProgBarStart(fWr->addr, fWr->len, columns);
+	AdaptStart(&progChunk);
+	for (i = 0, addr = fWr->addr; i < fWr->len; i += toWrite) {
+		toWrite = MIN(progChunk.len, fWr->len - i);
+		if (ErasePlanRun(&plan, addr, toWrite) ||
+				WfFlashFd(wf, addr, toWrite, rom, i, head, i?0:headLen)) {
+			PrintErr("Couldn't write to cart!\n");
+			err = 1;
+			break;
 		}
-		fflush(stdout);
+		AdaptDone(&progChunk, toWrite, WfPipeStatsGet(wf)->ackUs);
 		// Update vars and draw progress bar
-		i += toRead;
-		addr += toRead;
-   	    sprintf(addrStr, "0x%06X", addr);
-   	    ProgBarDraw(i, fRd->len, columns, addrStr);
+		addr += toWrite;
+		ProgBarSet(bar, i + toWrite);
 	}
-	putchar('\n');
-	return readBuf;
+	ProgBarEnd(bar);
+	free(plan.op);
+	close(rom);
+	// Wait for the chunks still in flight
+	if (!err && WfPipeFlush(wf)) {
+		PrintErr("Couldn't write to cart!\n");
+		err = 1;
+	}
+
+	return err;
+}
+
+// Copies a chunk read by CartRead() to its place in the buffer. Returns
+// the next chunk length.
+static uint32_t CartReadChunk(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx) {
+	CartBuf *b = (CartBuf*)ctx;
+
+	AdaptDone(&readChunk, len, 0);
+	memcpy(b->buf + addr - b->start, data, len);
+
+	return readChunk.len;
 }
 
 /************************************************************************//**
- * Entry point. Parses command line and executes requested actions.
+ * Reads a memory range from the cart, keeping several read commands in
+ * flight.
+ *
+ * \param[in]  addr   Start address of the range to read.
+ * \param[in]  len    Length of the range to read.
+ * \param[in]  window Number of read commands in flight.
+ * \param[out] buf    Buffer where the read data will be placed.
+ * \param[in]  chunk  Buffer receiving each chunk, readChunk.max bytes long.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int CartRead(uint32_t addr, uint32_t len, unsigned int window, uint8_t *buf,
+		uint8_t *chunk) {
+	CartBuf b = {buf, addr};
+
+	AdaptStart(&readChunk);
+	return WfReadPipe(wf, addr, len, readChunk.len, window, chunk,
+			readChunk.max, CartReadChunk, &b) != WF_OK;
+}
+
+// Programs the part of a sector that differs from the current cart
+// contents. The sector is erased only if any bit has to go from 0 to 1.
+// Returns nonzero if error.
+static int DeltaSect(uint32_t sect, uint32_t sectLen, uint32_t off,
+		uint32_t len, uint8_t *img, const uint8_t *cart, DeltaStats *d) {
+	uint32_t first, last, i;
+	uint32_t toWrite;
+	int erase;
+
+	// Find the range that differs
+	for (first = off; first < (off + len) && img[first] == cart[first];
+			first++);
+	if (first == (off + len)) {
+		d->skipped += len;
+		return 0;
+	}
+	for (last = off + len; img[last - 1] == cart[last - 1]; last--);
+	// Erase is needed if any bit has to go from 0 to 1
+	for (i = first, erase = FALSE; !erase && i < last; i++) {
+		erase = (img[i] & ~cart[i]) != 0;
+	}
+	if (erase) {
+		if (WfFlashErase(wf, sect, sectLen)) {
+			PrintErr("Erase failed!\n");
+			return 1;
+		}
+		d->erased++;
+		// Whole sector must be written, but erased bytes can be skipped at
+		// both ends.
+		for (first = 0; first < sectLen && img[first] == 0xFF; first++);
+		for (last = sectLen; last > first && img[last - 1] == 0xFF; last--);
+	}
+	// Flash is programmed in 16-bit words
+	first &= ~1;
+	last = (last + 1) & ~1;
+	for (i = first; i < last; i += toWrite) {
+		toWrite = MIN(progChunk.len, last - i);
+		if (WfFlashPipe(wf, sect + i, toWrite, img + i)) {
+			PrintErr("Couldn't write to cart!\n");
+			return 1;
+		}
+	}
+	d->changed++;
+	d->written += last - first;
+	// Image bytes not sent
+	d->skipped += len - (MIN(last, off + len) - MIN(MAX(first, off),
+				MIN(last, off + len)));
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Flashes the file pointed by the memory image argument, only erasing and
+ * programming the sectors that differ from the current cart contents.
+ * Sector layout is taken from the flash chip geometry, if known.
+ * If the bootloader computes CRCs, the CRC of each sector is compared
+ * with the image, and only the sectors that differ are read back.
+ * Otherwise every sector is read back. Sectors that match are skipped.
+ * When the changes only clear bits, the differing range is programmed
+ * without erasing. Otherwise the sector is erased and reprogrammed,
+ * preserving the cart data not covered by the image.
+ *
+ * \param[in] fWr      Memory image to flash.
+ * \param[in] noPatch  If nonzero, ROM must be written 1:1 (i.e. it will
+ * 			  be neither patched nor trimmed).
+ * \param[in] window   Number of read commands in flight.
+ * \param[in] columns  Number of columns of the console, used to display
+ *            the progress bar while flashing.
+ *
+ * \return 0 if OK, nonzero if error.
+ *
+ * \note fWr.len is updated if not specified.
+ ****************************************************************************/
+int DeltaFlash(MemImage *fWr, int noPatch, unsigned int window,
+		int columns) {
+	uint32_t crc[CRC_SECTS];
+	FILE *rom;
+	uint8_t *img, *cart, *chunk;
+	uint32_t sect, sectLen, start, end, off, len, nextLen;
+	uint32_t addr, runLen, blockLen, n, i;
+	DeltaStats d;
+	int useCrc;
+	int err = 0;
+	ProgBar *bar;
+
+	// Sectors are erased and rewritten as a whole, so partial headers are
+	// not a problem.
+	if (FlashImageCheck(fWr, TRUE)) return 1;
+	if (!(rom = fopen(fWr->file, "rb"))) {
+		perror(fWr->file);
+		return 1;
+	}
+	img = malloc(FlashGeomMaxSect(chip));
+	cart = malloc(FlashGeomMaxSect(chip));
+	chunk = malloc(readChunk.max);
+	if (!img || !cart || !chunk) {
+		perror("Allocating sector buffers");
+		fclose(rom);
+		free(img);
+		free(cart);
+		free(chunk);
+		return 1;
+	}
+	memset(&d, 0, sizeof(DeltaStats));
+	useCrc = WfCrc32Supported(wf);
+
+   	printf("Delta flashing ROM %s starting at 0x%06X...\n", fWr->file,
+			fWr->addr);
+
+	bar = ProgBarStart(fWr->addr, fWr->len, columns);
+	end = fWr->addr + fWr->len;
+	for (addr = fWr->addr; !err && addr < end; addr += runLen) {
+		// Sector run: the first (maybe partial) sector, plus the following
+		// ones with the same length, whose CRCs are obtained with a single
+		// command. Without CRCs, sectors are handled one by one.
+		if (FlashGeomSect(chip, addr, &sect, &sectLen)) {
+			PrintErr("Address 0x%06X is beyond the %s capacity!\n", addr,
+					chip->name);
+			err = 1;
+			break;
+		}
+		blockLen = sect + sectLen - addr;
+		runLen = MIN(blockLen, end - addr);
+		for (n = 1; useCrc && blockLen == sectLen && n < CRC_SECTS &&
+				addr + runLen < end; n++) {
+			if (FlashGeomSect(chip, addr + runLen, &start, &nextLen) ||
+					nextLen != sectLen) break;
+			runLen += MIN(sectLen, end - addr - runLen);
+		}
+		if (useCrc && WfCrc32(wf, addr, runLen, blockLen, crc)) {
+			PrintErr("Couldn't read from cart!\n");
+			err = 1;
+			break;
+		}
+		for (i = 0, start = addr; i < n; i++, start += len) {
+			// Part of the sector covered by the image
+			if (i) sect = start;
+			len = MIN(blockLen, addr + runLen - start);
+			off = start - sect;
+			if (FileRead(rom, img + off, len, start - fWr->addr)) {
+				perror(fWr->file);
+				err = 1;
+				break;
+			}
+			if (!start && !noPatch && len >= ROM_HEAD_LEN) RomHeadPatch(img);
+			// Sectors matching the image are neither read back nor written
+			if (useCrc && Crc32(0, img + off, len) == crc[i]) {
+				d.skipped += len;
+				ProgBarSet(bar, start + len - fWr->addr);
+				continue;
+			}
+			if (CartRead(sect, sectLen, window, cart, chunk)) {
+				PrintErr("Couldn't read from cart!\n");
+				err = 1;
+				break;
+			}
+			d.readBack += sectLen;
+			// Overlay image data on current sector contents
+			memcpy(img, cart, off);
+			memcpy(img + off + len, cart + off + len, sectLen - off - len);
+			if ((err = DeltaSect(sect, sectLen, off, len, img, cart, &d))) {
+				break;
+			}
+			ProgBarSet(bar, start + len - fWr->addr);
+		}
+	}
+	ProgBarEnd(bar);
+	fclose(rom);
+	free(img);
+	free(cart);
+	free(chunk);
+	// Wait for the chunks still in flight
+	if (!err && WfPipeFlush(wf)) {
+		PrintErr("Couldn't write to cart!\n");
+		err = 1;
+	}
+	if (!err) {
+		printf("Delta: %u sector%s changed (%u erased), %u bytes written, "
+				"%u bytes skipped, %u bytes read back.\n", d.changed,
+				d.changed == 1?"":"s", d.erased, d.written, d.skipped,
+				d.readBack);
+	}
+
+	return err;
+}
+
+// Handles a chunk read by StreamRead(): writes it to the dump file and
+// compares it with the flashed image. Returns the next chunk length.
+static uint32_t StreamReadChunk(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx) {
+	ReadSink *s = (ReadSink*)ctx;
+
+	AdaptDone(&readChunk, len, 0);
+	if (s->dump && FileWrite(s->dump, data, len, addr - s->start)) {
+		perror(s->dumpName);
+		return 0;
+	}
+	// After the first difference, keep reading only to complete the dump
+	if (s->ref && !s->bad) {
+		if (FileRead(s->ref, s->refBuf, len, addr - s->start)) {
+			perror(s->refName);
+			return 0;
+		}
+		// The header was patched when flashing
+		if (addr == s->start && s->patch) RomHeadPatch(s->refBuf);
+		VerifyCheck(s, addr, data, s->refBuf, len);
+	}
+	ProgBarSet(s->bar, addr + len - s->start);
+
+	return readChunk.len;
+}
+
+/************************************************************************//**
+ * Reads a memory range from the cart, keeping several read commands in
+ * flight. Data is written to the dump file as it arrives, and compared
+ * with the flashed file when verifying, so memory usage does not depend
+ * on the range length.
+ *
+ * \param[in] fRd     Memory image to read. Data is not saved if the file
+ *                    is NULL.
+ * \param[in] fWr     Memory image flashed, to verify against. NULL to
+ *                    skip verification.
+ * \param[in] noPatch If nonzero, the ROM was written 1:1 (not patched).
+ * \param[in] window  Number of read commands in flight.
+ * \param[in] columns Number of columns of the console, used to display
+ *                    the progress bar while reading.
+ *
+ * \return 0 if OK, nonzero if error or verification failed.
+ ****************************************************************************/
+int StreamRead(MemImage *fRd, MemImage *fWr, int noPatch,
+		unsigned int window, int columns) {
+	ReadSink s;
+	uint8_t *chunk;
+	int err = 0;
+
+	memset(&s, 0, sizeof(ReadSink));
+	s.start = fRd->addr;
+	s.len = fRd->len;
+	if (!(chunk = malloc(readChunk.max))) {
+		perror("Allocating read buffer RAM");
+		return 1;
+	}
+	if (fRd->file && !(s.dump = fopen(s.dumpName = fRd->file, "wb"))) {
+		perror(fRd->file);
+		err = 1;
+	}
+	if (!err && fWr) {
+		s.patch = !fWr->addr && !noPatch;
+		s.refBuf = malloc(readChunk.max);
+		if (!(s.ref = fopen(s.refName = fWr->file, "rb"))) {
+			perror(fWr->file);
+			err = 1;
+		} else if (!s.refBuf) {
+			perror("Allocating verify buffer RAM");
+			err = 1;
+		}
+	}
+
+	if (!err) {
+#ifdef WF_URING
+		// Each chunk is written to and compared from the same buffers
+		if (fileRing) {
+			UringBufRegister(fileRing, chunk, readChunk.max);
+			if (s.refBuf) UringBufRegister(fileRing, s.refBuf, readChunk.max);
+		}
+#endif
+		printf("Reading cart starting at 0x%06X...\n", fRd->addr);
+		s.bar = ProgBarStart(fRd->addr, fRd->len, columns);
+		AdaptStart(&readChunk);
+		err = WfReadPipe(wf, fRd->addr, fRd->len, readChunk.len, window,
+				chunk, readChunk.max, StreamReadChunk, &s) != WF_OK;
+		ProgBarEnd(s.bar);
+		if (err) PrintErr("Couldn't read from cart!\n");
+#ifdef WF_URING
+		if (fileRing) {
+			UringBufUnregister(fileRing, chunk);
+			if (s.refBuf) UringBufUnregister(fileRing, s.refBuf);
+		}
+#endif
+	}
+	if (s.dump && fclose(s.dump) && !err) {
+		perror(fRd->file);
+		err = 1;
+	}
+	if (s.ref) fclose(s.ref);
+	free(s.refBuf);
+	free(chunk);
+	if (err) return 1;
+
+	if (fWr) err = VerifyReport(&s);
+	if (fRd->file) printf("Wrote file %s.\n", fRd->file);
+
+	return err;
+}
+
+/************************************************************************//**
+ * Verifies a flashed memory image, comparing the CRC of each sector
+ * computed by the bootloader with the CRC of the image, so data does not
+ * have to be read back. Consecutive sectors of the same length are checked
+ * with a single command. Sectors that differ are reported.
+ *
+ * \param[in] fWr     Memory image flashed.
+ * \param[in] data    Image data, as flashed. If NULL, data is read from
+ *                    the memory image file.
+ * \param[in] noPatch If nonzero, the ROM was written 1:1 (not patched).
+ *
+ * \return 0 if OK, nonzero if error or verification failed.
+ ****************************************************************************/
+int CrcVerify(MemImage *fWr, const uint8_t *data, int noPatch) {
+	uint32_t crc[CRC_SECTS];
+	uint32_t sect, sectLen, start, len, nextLen;
+	uint32_t addr, end, runLen, blockLen;
+	uint32_t n, i, bad = 0, total = 0;
+	uint8_t *img = NULL;
+	const uint8_t *blk;
+	FILE *rom = NULL;
+	int err = 0;
+
+	if (!data && !(rom = fopen(fWr->file, "rb"))) {
+		perror(fWr->file);
+		return 1;
+	}
+	if (!data && !(img = malloc(FlashGeomMaxSect(chip)))) {
+		perror("Allocating verify buffer RAM");
+		fclose(rom);
+		return 1;
+	}
+	printf("Verifying 0x%06X:%06X by CRC...\n", fWr->addr, fWr->len);
+
+	end = fWr->addr + fWr->len;
+	for (addr = fWr->addr; !err && addr < end; addr += runLen) {
+		// Sector run: the first (maybe partial) sector, plus the following
+		// ones with the same length. The last one can be partial too.
+		if (FlashGeomSect(chip, addr, &sect, &sectLen)) {
+			PrintErr("Address 0x%06X is beyond the %s capacity!\n", addr,
+					chip->name);
+			err = 1;
+			break;
+		}
+		blockLen = sect + sectLen - addr;
+		runLen = MIN(blockLen, end - addr);
+		for (n = 1; blockLen == sectLen && n < CRC_SECTS &&
+				addr + runLen < end; n++) {
+			if (FlashGeomSect(chip, addr + runLen, &start, &nextLen) ||
+					nextLen != sectLen) break;
+			runLen += MIN(sectLen, end - addr - runLen);
+		}
+		if (WfCrc32(wf, addr, runLen, blockLen, crc)) {
+			err = 1;
+			break;
+		}
+		for (i = 0, start = addr; i < n; i++, start += len) {
+			len = MIN(blockLen, addr + runLen - start);
+			if (data) {
+				blk = data + start - fWr->addr;
+			} else if (fread(img, len, 1, rom) != 1) {
+				perror(fWr->file);
+				err = 1;
+				break;
+			} else {
+				blk = img;
+				// The header was patched when flashing
+				if (!start && !noPatch && len >= ROM_HEAD_LEN) {
+					RomHeadPatch(img);
+				}
+			}
+			total++;
+			if (Crc32(0, blk, len) != crc[i]) {
+				printf("Sector 0x%06X:%X differs!\n", start, len);
+				bad++;
+			}
+		}
+	}
+	if (rom) fclose(rom);
+	free(img);
+	if (err) {
+		PrintErr("Couldn't verify cart!\n");
+		return 1;
+	}
+
+	if (bad) {
+		printf("Verify failed: %u of %u sector%s differ!\n", bad, total,
+				total == 1?"":"s");
+		return 1;
+	}
+	printf("Verify OK! (%u sector%s)\n", total, total == 1?"":"s");
+	return 0;
+}
+
+/************************************************************************//**
+ * Erases a memory range. If the flash chip geometry is known, only the
+ * sectors covering the range are erased.
+ *
+ * \param[in] addr Start address of the range.
+ * \param[in] len  Length of the range.
+ *
+ * \return 0 if OK, nonzero if error.
+ ****************************************************************************/
+int RangeErase(uint32_t addr, uint32_t len) {
+	FlashErase op;
+
+	if (chip) {
+		if (FlashGeomPlan(chip, addr, len, 0, &op, 1) != 1) {
+			PrintErr("Erase range is beyond the %s capacity!\n",
+					chip->name);
+			return 1;
+		}
+		addr = op.addr;
+		len = op.len;
+	}
+	printf("Erasing cart range 0x%06X:%06X", addr, len);
+	if (chip) printf(" (%u sectors, ~%u ms)", op.sects, op.ms);
+	printf("...\n");
+	if (WfFlashErase(wf, addr, len)) {
+		printf("Erase failed!\n");
+		return 1;
+	}
+	else printf("OK!\n");
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Runs the erase, flash, verify and read operations of a manifest in a
+ * single session. Erases run first. Then the images, coalesced into
+ * segments, are flashed as a single program stream with a single erase
+ * plan, and verified. Reads run last.
+ *
+ * \param[in] m          Manifest.
+ * \param[in] f          Command line flags.
+ * \param[in] readWindow Number of read commands in flight.
+ *
+ * \return 0 if OK, nonzero if error or verification failed.
+ ****************************************************************************/
+int ManifestRun(Manifest *m, const Flags *f, unsigned int readWindow) {
+	ErasePlan plan = {NULL, 0, 0};
+	ReadSink verify;
+	MemImage img;
+	ManEntry *e;
+	ManSeg *s;
+	uint8_t *back = NULL;
+	int readback, i;
+	int bad = FALSE;
+	int err = 0;
+
+	for (i = 0; i < m->n; i++) {
+		e = &m->entry[i];
+		if (e->op == MAN_ERASE && RangeErase(e->addr, e->len)) return 1;
+	}
+
+	// Images sharing a sector would have it erased once for each
+	if (ManifestCoalesce(m, chip, f->erase, f->noPatch)) return 1;
+	if (m->nseg && !f->erase && !m->seg[0].addr &&
+			m->seg[0].len < ROM_HEAD_LEN) {
+		PrintErr("ROM header must be completely covered by the range!\n");
+		return 1;
+	}
+	if (m->nseg && f->erase && ErasePlanSegs(&plan, m->seg, m->nseg,
+				progChunk.min)) return 1;
+	// Verify by CRC if supported, otherwise read back while flashing
+	readback = m->verify && (f->readback || !WfCrc32Supported(wf));
+	if (readback && !(back = malloc(progChunk.max))) {
+		perror("Allocating read back buffer RAM");
+		free(plan.op);
+		return 1;
+	}
+
+	WfBatchBegin(wf);
+	for (i = 0; !err && i < m->nseg; i++) {
+		s = &m->seg[i];
+		printf("Flashing %d image%s to 0x%06X:%06X%s...\n", s->images,
+				s->images == 1?"":"s", s->addr, s->len,
+				readback?" and verifying":"");
+		if (readback) {
+			memset(&verify, 0, sizeof(ReadSink));
+			verify.img = s->data;
+			verify.start = s->addr;
+			verify.len = s->len;
+		}
+		err = ProgramImage(s->data, s->addr, s->len, &plan, f->cols,
+				readback?&verify:NULL, back);
+		// Read back data must be checked against its own segment
+		if (!err && readback) {
+			err = WfBatchEnd(wf) || WfPipeFlush(wf);
+			WfBatchBegin(wf);
+			if (!err && VerifyReport(&verify)) bad = TRUE;
+		}
+	}
+	if ((WfBatchEnd(wf) || WfPipeFlush(wf)) && !err) err = 1;
+	free(plan.op);
+	free(back);
+	if (err) {
+		PrintErr("Couldn't write to cart!\n");
+		return 1;
+	}
+	if (bad) return 1;
+
+	for (i = 0; m->verify && !readback && i < m->nseg; i++) {
+		img.file = NULL;
+		img.addr = m->seg[i].addr;
+		img.len = m->seg[i].len;
+		if (CrcVerify(&img, m->seg[i].data, f->noPatch)) return 1;
+	}
+
+	for (i = 0; i < m->n; i++) {
+		e = &m->entry[i];
+		img.file = e->file;
+		img.addr = e->addr;
+		img.len = e->len;
+		if (e->op == MAN_READ &&
+				StreamRead(&img, NULL, f->noPatch, readWindow, f->cols)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/************************************************************************//**
+ * Prints the transport statistics gathered since the last reset.
+ ****************************************************************************/
+void PrintIoStats(void) {
+	const WfIoStats *io = WfIoStatsGet(wf);
+	uint32_t calls = io->sendCalls + io->recvCalls;
+
+	printf("I/O: %u commands, %u send and %u receive syscalls, "
+			"~%u segments sent.\n", io->cmds, io->sendCalls,
+			io->recvCalls, io->segments);
+	if (io->cmds) {
+		printf("     %.2f syscalls and %.2f segments per command, "
+				"%.3f syscalls per KiB sent.\n", (double)calls / io->cmds,
+				(double)io->segments / io->cmds, io->bytesSent?
+				1024.0 * calls / io->bytesSent:0);
+	}
+	StatsTcpPrint(WfTcpStatsGet(wf), stdout);
+}
+
+/************************************************************************//**
+ * Prints the chunk length chosen by a controller, and the throughput
+ * observed with it.
+ *
+ * \param[in] name Name of the transfer type.
+ * \param[in] a    Chunk length controller.
+ ****************************************************************************/
+void PrintChunkStats(const char *name, const Adapt *a) {
+	if (!a->bestRate) return;
+	printf("%s chunks: %u bytes, best %u bytes at %.1f KiB/s", name, a->len,
+			a->bestLen, a->bestRate / 1024);
+	if (a->minAckUs) printf(", RTT %.2f ms", a->minAckUs / 1000.0);
+	printf(".\n");
+}
+
+/************************************************************************//**
+ * Obtains the daemon connection to a cart: the one already used for it, or
+ * the least recently used one, which is closed and assigned to the cart.
+ *
+ * \param[in] sess Daemon session.
+ * \param[in] host Host of the cart.
+ * \param[in] port Port of the cart.
+ *
+ * \return The connection to use for the cart.
+ ****************************************************************************/
+static SessCart *SessCartGet(Session *sess, const char *host, uint16_t port) {
+	SessCart *c = NULL, *lru = sess->cart;
+	int i;
+
+	for (i = 0; i < SESS_CARTS && !c; i++) {
+		if ((sess->cart[i].port == port) && !strcmp(sess->cart[i].host, host)) {
+			c = &sess->cart[i];
+		} else if (sess->cart[i].lastJob < lru->lastJob) lru = &sess->cart[i];
+	}
+	if (!c) {
+		c = lru;
+		WfClose(c->wf);
+		snprintf(c->host, sizeof(c->host), "%s", host);
+		c->port = port;
+	}
+	c->lastJob = ++sess->jobs;
+	return c;
+}
+
+/************************************************************************//**
+ * Parses command line and executes requested actions. Runs once from
+ * main(), or for each job submitted to a daemon.
  *
  * \param[in] argc Number of input parameters.
  * \param[in] argv List of input parameters.
+ * \param[in] ctx  Session of the daemon running the job, NULL otherwise.
  *
  * \return 0 if completed successfully, non-zero if error.
  ****************************************************************************/
-int main( int argc, char **argv )
+static int Job(int argc, char **argv, void *ctx)
 {
+	// Daemon session, NULL if not running as a daemon job
+	Session *sess = (Session*)ctx;
+	// Session kept when running as daemon
+	Session daemonSess;
 	// Command-line flags
 	Flags f;
 	// Rom file to write to flash
 	MemImage fWr = {NULL, 0, 0};
 	// Rom file to read from flash (default read length: 4 MiB)
-	MemImage fRd = {NULL, 0, 4*1024*1024};
+	MemImage fRd = {NULL, 0, READ_DEF_LEN};
 	// Error code for function calls
 	int errCode;
 	// Buffer pointer for writing data to cart
     uint16_t *write_buffer = NULL;
-	// Buffer pointer for reading cart data
-	uint16_t *read_buffer = NULL;
 	// Server address string
 	char *srvAddr = (char*)defIp;
 	// Server IP port
 	long srvPort = defPort;
 	// For strtol
 	char *endPtr;
+	long tmpLong;
 	// Erase address
 	uint32_t eraseAddr = 0;
 	// Erase length
 	uint32_t eraseLen = 0;
 	// Boot address
 	uint32_t bootAddr = 0;
+	// Program commands in flight
+	long window = DEF_WINDOW;
+	// Read commands in flight
+	unsigned int readWindow;
+	// Verify methods: by CRC, or reading back while flashing
+	int crcVerify = FALSE, overlapVerify = FALSE;
+	// Result of the verification while flashing
+	ReadSink verify;
+	// Bootloader readiness probes, and time when they started
+	int probes;
+	uint64_t readyUs;
+	// Initial program and read chunk lengths
+	uint32_t progLen = FLASH_CHUNK_LEN, readLen = READ_CHUNK_LEN;
+	// Program chunk length is adapted while flashing
+	int adaptProg;
+	// Pipeline statistics
+	const WfPipeStats *pipeStats;
 	// Temporary uint16_t pointer
 	uint8_t *tmp;
+	// UNIX socket to serve jobs on, or to submit the job to
+	char *daemonPath = NULL, *sessPath = NULL;
+	// Manifest file, and the loaded manifest
+	char *manPath = NULL;
+	Manifest *man = NULL;
+	ManEntry *e;
+	// Statistics destination
+	char *statsDest = NULL;
+	// Trace file
+	char *traceFile = NULL;
+	// Session recording file
+	char *recFile = NULL;
+	// Socket tuning, 0 for the system defaults
+	uint32_t sndBuf = 0, notsentLowat = 0;
+	// Fleet cart list, and the parsed cart addresses
+	char *fleetList = NULL;
+	char *fleetHosts[FLEET_MAX_CARTS];
+	int fleetN = 0;
+	FleetJob fleet;
 
 	// Loop iteration
 	int i;
 
-	// Set all flags to FALSE
+	// Set all flags to FALSE. Jobs run by a daemon start from scratch.
 	f.all = 0;
+	chip = NULL;
+	optind = 0;
     // Reads console arguments
     if( argc > 1 ) {
         // Option index, for command line options parsing
@@ -452,7 +1702,7 @@ int main( int argc, char **argv )
         // Character returned by getopt_long()
         int c;
 
-        while ((c = getopt_long(argc, argv, "a:p:f:r:es:VnB:AiPbdRvh", opt, &opIdx)) != -1) {
+        while ((c = getopt_long(argc, argv, "a:p:f:r:M:F:ew:cSzZDs:VknB:AiPbT:t:C:U:L:dY:j:Rvh", opt, &opIdx)) != -1) {
 			// Parse command-line options
             switch (c) {
 				case 'a': // Set server address
@@ -461,7 +1711,7 @@ int main( int argc, char **argv )
 					
 				case 'p': // Set server port number
 					srvPort = strtol(optarg, &endPtr, 0);
-					if ((srvPort < 0) || (srvPort > 65535) || (*endPtr == '\0')) {
+					if ((srvPort <= 0) || (srvPort > 65535) || (*endPtr != '\0')) {
 						PrintErr("Invalid port %s!\n", optarg);
 						return 1;
 					}
@@ -483,12 +1733,51 @@ int main( int argc, char **argv )
 						PrintMemError(errCode);
 						return 1;
 					}
+					if (!fRd.len) fRd.len = READ_DEF_LEN;
                 	break;
 
+				case 'M': // Manifest
+					manPath = optarg;
+					break;
+
+				case 'F': // Fleet
+					fleetList = optarg;
+					break;
+
                 case 'e': // Auto erase
 					f.erase = TRUE;
                 	break;
 
+				case 'w': // Program window
+					window = strtol(optarg, &endPtr, 0);
+					if ((*endPtr != '\0') || (window < 1) ||
+							(window > WF_PIPE_MAX)) {
+						PrintErr("Invalid window %s, must be 1 to %d.\n",
+								optarg, WF_PIPE_MAX);
+						return 1;
+					}
+					break;
+
+				case 'c': // Adaptive chunk length
+					f.adaptive = TRUE;
+					break;
+
+				case 'S': // Stream flash
+					f.stream = TRUE;
+					break;
+
+				case 'z': // Zero-copy flash
+					f.zeroCopy = TRUE;
+					break;
+
+				case 'Z': // Compressed stream flash
+					f.compress = f.stream = TRUE;
+					break;
+
+				case 'D': // Delta flash
+					f.delta = TRUE;
+					break;
+
 				case 's': // Sector range erase
 					if ((errCode = ParseMemRange(optarg, &eraseAddr, &eraseLen)) ||
 							(0 == eraseLen)) {
@@ -501,6 +1790,10 @@ int main( int argc, char **argv )
 					f.verify = TRUE;
                 	break;
 
+				case 'k': // Verify by reading back
+					f.verify = f.readback = TRUE;
+					break;
+
                 case 'n': // Do not patch ROM
 					f.noPatch = TRUE;
                 	break;
@@ -529,10 +1822,42 @@ int main( int argc, char **argv )
 					f.boot = TRUE;
 					break;
 
+				case 'T': // Statistics
+					statsDest = optarg;
+					break;
+
+				case 't': // Trace
+					traceFile = optarg;
+					break;
+
+				case 'C': // Record
+					recFile = optarg;
+					break;
+
+				case 'U': // Send buffer
+				case 'L': // Not sent low water mark
+					tmpLong = strtol(optarg, &endPtr, 0);
+					if ((*endPtr != '\0') || (tmpLong < 1) ||
+							(tmpLong > INT32_MAX)) {
+						PrintErr("Invalid length %s!\n", optarg);
+						return 1;
+					}
+					if (c == 'U') sndBuf = tmpLong;
+					else notsentLowat = tmpLong;
+					break;
+
 				case 'd': // Dry run
 					f.dry = TRUE;
 					break;
 
+				case 'Y': // Run as daemon
+					daemonPath = optarg;
+					break;
+
+				case 'j': // Submit job to daemon
+					sessPath = optarg;
+					break;
+
                 case 'R': // Version
 					PrintVersion(argv[0]);
                 	return 0;
@@ -572,18 +1897,83 @@ int main( int argc, char **argv )
 			PrintErr("Sector erase and auto erase options cannot be used simultaneously!\n");
 			return 1;
 		}
-		if (!fWr.file) {
+		if (!fWr.file && !manPath) {
 			PrintErr("Auto erase option can only be used when performing writes!\n");
 			return 1;
 		}
 	}
+	if (f.delta && (f.erase || f.stream || f.zeroCopy)) {
+		PrintErr("Delta option cannot be used with auto erase, stream or "
+				"zero-copy options!\n");
+		return 1;
+	}
+	if (f.stream && f.zeroCopy) {
+		PrintErr("Stream and zero-copy options cannot be used simultaneously!\n");
+		return 1;
+	}
+	if (manPath && (fWr.file || fRd.file || eraseLen || bootAddr ||
+				f.autoRun || f.stream || f.zeroCopy || f.delta)) {
+		PrintErr("Manifest option can only be used with auto erase, "
+				"verify and transfer tuning options!\n");
+		return 1;
+	}
+	if (fleetList && (!fWr.file || fRd.file || eraseLen || manPath ||
+				f.flashId || f.pushbutton || f.boot || f.stream ||
+				f.zeroCopy || f.delta || f.adaptive || f.readback ||
+				statsDest || recFile)) {
+		PrintErr("Fleet option requires a flash file, and can only be used "
+				"with auto erase, verify, boot and window options!\n");
+		return 1;
+	}
+	if (f.verify && !fWr.file && !manPath) {
+		PrintErr("Verify option can only be used when performing writes!\n");
+		return 1;
+	}
 	if (f.autoRun && bootAddr) {
 		PrintErr("Using run (from address) and auto-run options at the same time is not supported!\n");
 		return 1;
 	}
 
+	// Serve jobs, keeping the cart connection open between them
+	if (daemonPath) {
+		if (sess || sessPath || fWr.file || fRd.file || eraseLen ||
+				bootAddr || f.autoRun || f.flashId || f.boot) {
+			PrintErr("Daemon option cannot be used with other actions!\n");
+			return 1;
+		}
+		memset(&daemonSess, 0, sizeof(Session));
+		for (i = 0; i < SESS_CARTS; i++) {
+			if (!(daemonSess.cart[i].wf = WfCtxNew())) break;
+		}
+		errCode = i < SESS_CARTS?1:DaemonServe(daemonPath, Job, &daemonSess);
+		while (i--) WfCtxFree(daemonSess.cart[i].wf);
+		return errCode;
+	}
+	// Let the daemon run the job. It parses the options again, ignoring
+	// this one.
+	if (sessPath && !sess) return DaemonSubmit(sessPath, argc, cmdArgv);
+	// The daemon keeps a connection per cart
+	if (sess) wf = SessCartGet(sess, srvAddr, srvPort)->wf;
+
+	// Manifest boot and verify are run like the command line ones
+	if (manPath) {
+		if (!(man = ManifestLoad(manPath))) return 1;
+		bootAddr = man->bootAddr;
+		f.autoRun = man->autoRun;
+		man->verify |= f.verify;
+		f.verify = FALSE;
+	}
+
+	if (fleetList && ((fleetN = FleetHostsParse(fleetList, fleetHosts)) < 0 ||
+				FlashImageCheck(&fWr, f.erase))) {
+		if (fleetN > 0) FleetHostsFree(fleetHosts, fleetN);
+		return 1;
+	}
+
 	if (f.verbose) {
-		printf("Server address: %s:%d\n", srvAddr, (uint16_t)srvPort);
+		if (fleetN) printf("Fleet of %d cart%s, default port %d\n", fleetN,
+				fleetN == 1?"":"s", (uint16_t)srvPort);
+		else printf("Server address: %s:%d\n", srvAddr, (uint16_t)srvPort);
 		printf("\nThe following actions will%s be performed (in order):\n",
 				f.dry?" NOT":"");
 		printf("==================================================%s\n\n",
@@ -594,13 +1984,31 @@ int main( int argc, char **argv )
 		else if (eraseLen)
 			printf(" - Erase range %06X:%X.\n", eraseAddr, eraseLen);
 		if (fWr.file) {
-		   printf(" - Flash %s", f.verify?"and verify ":"");
-		   PrintMemImage(&fWr); putchar('\n');
+		   printf(" - %slash %s", f.compress?"Compressed stream f":
+				   f.stream?"Stream f":f.zeroCopy?
+				   "Zero-copy f":f.delta?"Delta f":"F",
+				   f.verify?"and verify ":"");
+		   PrintMemImage(&fWr);
+		   printf(", %ld command%s in flight%s.\n", window, window > 1?"s":"",
+				   f.adaptive?", adaptive chunk length":"");
 		}
 		if (fRd.file) {
 			printf(" - Read ROM/Flash to ");
 			PrintMemImage(&fRd); putchar('\n');
 		}
+		for (i = 0; man && i < man->n; i++) {
+			e = &man->entry[i];
+			if (e->op == MAN_ERASE) {
+				printf(" - Erase range %06X:%X.\n", e->addr, e->len);
+			} else {
+				printf(" - %s %s", e->op == MAN_FLASH?"Flash":
+						"Read ROM/Flash to", e->file);
+				if (e->addr) printf(" at address 0x%06X", e->addr);
+				if (e->len) printf(" (%d bytes)", e->len);
+				putchar('\n');
+			}
+		}
+		if (man && man->verify) printf(" - Verify flashed images.\n");
 		if (bootAddr) {
 			printf(" - Boot ROM from 0x%06X.\n", bootAddr);
 		}
@@ -613,7 +2021,11 @@ int main( int argc, char **argv )
 		printf("\n");
 	}
 
-	if (f.dry) return 0;
+	if (f.dry) {
+		ManifestFree(man);
+		FleetHostsFree(fleetHosts, fleetN);
+		return 0;
+	}
 
 	// Detect number of columns (for progress bar drawing).
 #ifdef __OS_WIN
@@ -623,26 +2035,95 @@ int main( int argc, char **argv )
     f.cols = csbi.srWindow.Right - csbi.srWindow.Left;
 #else
     struct winsize max;
-    ioctl(0, TIOCGWINSZ , &max);
-	f.cols = max.ws_col;
+	// Fall back to a typical width if output is not a terminal
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ , &max) || !max.ws_col) f.cols = 80;
+	else f.cols = max.ws_col;
 
 	// Also set transparent cursor
 	printf("\e[?25l");
 #endif
 
-	// Connect to server
-	if (WfConnect(srvAddr, srvPort)) {
-		PrintErr("Error: couldn't connect to server at %s:%d.\n",
-				srvAddr, (uint16_t)srvPort);
+	if (traceFile && TraceStart(traceFile)) {
+		errCode = 1;
+		goto dealloc_exit;
+	}
+	// Each cart of the fleet gets its own connection
+	if (fleetN) {
+		memset(&fleet, 0, sizeof(FleetJob));
+		fleet.file = fWr.file;
+		fleet.addr = fWr.addr;
+		fleet.len = fWr.len;
+		fleet.chunkLen = FLASH_CHUNK_LEN;
+		fleet.readLen = READ_CHUNK_LEN;
+		fleet.window = window;
+		fleet.bootAddr = bootAddr;
+		fleet.port = srvPort;
+		fleet.autoRun = f.autoRun;
+		fleet.erase = f.erase;
+		fleet.verify = f.verify;
+		fleet.noPatch = f.noPatch;
+		errCode = FleetFlash(&fleet, fleetHosts, fleetN, f.cols) != 0;
 		goto dealloc_exit;
 	}
 
-	// TODO WARNING: Does not work if this is not here!!!
-#ifdef __WIN32__
-	Sleep(1000);
-#else
-    sleep(1);
-#endif
+	// Statistics cover this job only
+	WfStatsReset(wf);
+	if (recFile && WfRecordStart(wf, recFile)) {
+		errCode = 1;
+		goto dealloc_exit;
+	}
+	// A daemon reuses the connection of a previous job to the same cart,
+	// unless the cart closed it (e.g. it rebooted).
+	if (sess && WfAlive(wf)) {
+		if (f.verbose) {
+			printf("Reusing connection to %s:%d.\n", srvAddr,
+					(uint16_t)srvPort);
+		}
+	} else {
+		// Connect to server
+		WfPhaseStart(wf, "connect");
+		WfClose(wf);
+		if (WfSockTune(wf, sndBuf, notsentLowat)) {
+			PrintErr("Socket tuning not supported!\n");
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		if (WfConnect(wf, srvAddr, srvPort)) {
+			PrintErr("Error: couldn't connect to server at %s:%d.\n",
+					srvAddr, (uint16_t)srvPort);
+			errCode = 1;
+			goto dealloc_exit;
+		}
+
+		// Commands sent while the bootloader is starting are lost, so wait
+		// until it answers.
+		readyUs = TimeUs();
+		if ((probes = WfReady(wf, READY_TIMEOUT_MS)) < 0) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		if (f.verbose) {
+			printf("Bootloader ready in %.2f ms (%d probe%s).\n",
+					(TimeUs() - readyUs) / 1000.0, probes,
+					probes == 1?"":"s");
+		}
+		WfPhaseEnd(wf);
+	}
+
+	// When adapting, start from the chunk lengths remembered for the host.
+	// Stream and delta flash use a fixed program chunk length.
+	if (f.adaptive) {
+		AdaptLoad(srvAddr, &progLen, &readLen);
+		progLen = MIN(MAX(progLen, CHUNK_MIN_LEN), CHUNK_MAX_LEN);
+		readLen = MIN(MAX(readLen, CHUNK_MIN_LEN), CHUNK_MAX_LEN);
+	}
+	adaptProg = f.adaptive && !f.stream && !f.delta;
+	AdaptInit(&progChunk, progLen, adaptProg?CHUNK_MIN_LEN:progLen,
+			adaptProg?CHUNK_MAX_LEN:progLen, CHUNK_STEP, window);
+	// Reads do not change the flash, so they are always pipelined
+	readWindow = MAX(window, READ_WINDOW);
+	AdaptInit(&readChunk, readLen, f.adaptive?CHUNK_MIN_LEN:readLen,
+			f.adaptive?CHUNK_MAX_LEN:readLen, CHUNK_STEP, readWindow);
 
 	/****************** ↓↓↓↓↓↓ DO THE MAGIC HERE ↓↓↓↓↓↓ *******************/
 
@@ -651,40 +2132,126 @@ int main( int argc, char **argv )
 
 	// Get bootloader version
 	if (f.boot) {
-		if (!(tmp = WfBootVerGet())) return -1;
+		if (!(tmp = WfBootVerGet(wf))) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
 		printf("WFlash version %d.%d\n", tmp[0], tmp[1]);
 	}
-	// GET IDs	
-	if (f.flashId) {
-		if ((tmp = WfFlashIdsGet()) == NULL) return -1;
-		printf("Manufacturer ID: 0x%02X\n", tmp[0]);
-		printf("Device IDs: 0x%02X:%02X:%02X\n", tmp[1],
-			tmp[2], tmp[3]);
+	// GET IDs. Also needed to know the sector layout when erasing
+	if (f.flashId || f.erase || eraseLen || f.delta || f.verify || man) {
+		if ((tmp = WfFlashIdsGet(wf)) == NULL) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		chip = FlashGeomFind(tmp);
+		if (f.flashId) {
+			printf("Manufacturer ID: 0x%02X\n", tmp[0]);
+			printf("Device IDs: 0x%02X:%02X:%02X\n", tmp[1],
+				tmp[2], tmp[3]);
+		}
+		if (f.flashId || f.verbose) {
+			printf("Flash chip: %s\n", chip?chip->name:"unknown");
+		}
 	}
 	// Erase
-	// Support sector erase!
 	if (eraseLen) {
-		printf("Erasing cart range 0x%06X:%06X...\n", eraseAddr, eraseLen);
-		if (WfFlashErase(eraseAddr, eraseLen)) {
-			printf("Erase failed!\n");
-			return 1;
+		WfPhaseStart(wf, "erase");
+		if (RangeErase(eraseAddr, eraseLen)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+	}
+	// Verify by CRC after flashing if supported, unless data is also read
+	// back to a file. Otherwise read back, while flashing if the image is
+	// flashed from memory.
+	if (f.verify && !fRd.file) {
+		crcVerify = !f.readback && WfCrc32Supported(wf);
+		overlapVerify = !crcVerify && !f.stream && !f.zeroCopy && !f.delta;
+	}
+	// Manifest operations, in a single session
+	if (man) {
+		WfPipeWindowSet(wf, window);
+		WfIoStatsReset(wf);
+		WfPhaseStart(wf, "manifest");
+		if (ManifestRun(man, &f, readWindow)) {
+			errCode = 1;
+			goto dealloc_exit;
 		}
-		else printf("OK!\n");
 	}
 	// Flash
 	if (fWr.file) {
-		write_buffer = AllocAndFlash(&fWr, f.erase, f.noPatch, f.cols);
-		if (!write_buffer) {
+		WfPipeWindowSet(wf, window);
+		WfIoStatsReset(wf);
+		WfPhaseStart(wf, "flash");
+		if (f.stream) {
+			errCode = StreamFlash(&fWr, f.erase, f.noPatch, f.compress,
+					f.cols);
+		} else if (f.zeroCopy) {
+			errCode = ZeroCopyFlash(&fWr, f.erase, f.noPatch, f.cols);
+		} else if (f.delta) {
+			errCode = DeltaFlash(&fWr, f.noPatch, readWindow, f.cols);
+		} else {
+			write_buffer = AllocAndFlash(&fWr, f.erase, f.noPatch, f.cols,
+					overlapVerify?&verify:NULL);
+			errCode = !write_buffer;
+		}
+		if (errCode) {
 			PrintErr("Flash ROM error!\n");
 			errCode = 1;
 			goto dealloc_exit;
 		}
+		if (f.verbose) {
+			pipeStats = WfPipeStatsGet(wf);
+			printf("Average chunks in flight: %.2f (window %ld, %u chunks)\n",
+					pipeStats->chunks?(double)pipeStats->inFlight /
+					pipeStats->chunks:0, window, pipeStats->chunks);
+			PrintIoStats();
+		}
+	}
+	if (overlapVerify) {
+		if (VerifyReport(&verify)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+	} else if (crcVerify) {
+		WfPhaseStart(wf, "verify");
+		if (CrcVerify(&fWr, NULL, f.noPatch)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+	} else if (fRd.file || f.verify) {
+		// Read back. If verify is set, ignore addr and length set in
+		// command line.
+		if (f.verify) {
+			fRd.addr = fWr.addr;
+			fRd.len  = fWr.len;
+		}
+		WfIoStatsReset(wf);
+		WfPhaseStart(wf, f.verify?"verify":"read");
+		if (StreamRead(&fRd, f.verify?&fWr:NULL, f.noPatch, readWindow,
+					f.cols)) {
+			errCode = 1;
+			goto dealloc_exit;
+		}
+		if (f.verbose) PrintIoStats();
+	}
+	// Remember the chunk lengths that performed best
+	if (f.adaptive) {
+		if (f.verbose) {
+			PrintChunkStats("Program", &progChunk);
+			PrintChunkStats("Read", &readChunk);
+		}
+		AdaptSave(srvAddr, progChunk.bestRate?progChunk.bestLen:0,
+				readChunk.bestRate?readChunk.bestLen:0);
 	}
 
+	WfPhaseEnd(wf);
+
 	// Boot ROM from address
 	if (bootAddr) {
 		printf("Booting ROM at address 0x%06X...\n", bootAddr);
-		if (WfBoot(bootAddr) != WF_OK) {
+		if (WfBoot(wf, bootAddr) != WF_OK) {
 			PrintErr("Boot ROM error!\n");
 			errCode = 1;
 			goto dealloc_exit;
@@ -694,58 +2261,13 @@ int main( int argc, char **argv )
 	// Auto boot from header entry point
 	if (f.autoRun) {
 		printf("Auto-booting ROM...\n");
-		if (WfAutoRun() != WF_OK) {
+		if (WfAutoRun(wf) != WF_OK) {
 			PrintErr("Boot ROM error!\n");
 			errCode = 1;
 			goto dealloc_exit;
 		}
 	}
 
-//	if (fRd.file || f.verify) {
-//		// If verify is set, ignore addr and length set in command line.
-//		if (f.verify) {
-//			fRd.addr = fWr.addr;
-//			fRd.len  = fWr.len;
-//		}
-//		read_buffer = AllocAndRead(&fRd, f.cols);
-//		if (!read_buffer) {
-//			errCode = 1;
-//			goto dealloc_exit;
-//		}
-//		// Verify
-//		if (f.verify) {
-//			for (i = 0; i < fWr.len; i++) {
-//				if (write_buffer[i] != read_buffer[i]) {
-//					break;
-//				}
-//			}
-//			if (i == fWr.len)
-//				printf("Verify OK!\n");
-//			else {
-//				printf("Verify failed at addr 0x%07X!\n", i + fWr.addr);
-//				printf("Wrote: 0x%04X; Read: 0x%04X\n", write_buffer[i],
-//						read_buffer[i]);
-//				// Set error, but we do not exit yet, because user might want
-//				// to write readed data to a file!
-//				errCode = 1;
-//			}
-//		}
-//		// Write file
-//		if (fRd.file) {
-//			// Do byte swaps
-//			for (i = 0; i < fRd.len; i++) ByteSwapWord(read_buffer[i]);
-//        	FILE *dump = fopen(fRd.file, "wb");
-//			if (!dump) {
-//				perror(fRd.file);
-//				errCode = 1;
-//				goto dealloc_exit;
-//			}
-//	        fwrite(read_buffer, fRd.len<<1, 1, dump);
-//	        fclose(dump);
-//			printf("Wrote file %s.\n", fRd.file);
-//		}
-//	}
-//
 //	if (f.pushbutton) {
 //		u16 retVal;
 //		u8 butStat;
@@ -777,9 +2299,16 @@ int main( int argc, char **argv )
 //	}
 
 dealloc_exit:
-	WfClose();
+	WfPhaseEnd(wf);
+	if (statsDest && StatsWrite(WfStatsGet(wf), statsDest)) errCode = 1;
+	if (TraceStop()) errCode = 1;
+	if (recFile && WfRecordStop(wf)) errCode = 1;
+	// Keep the daemon connection, unless the cart left the bootloader or
+	// something failed
+	if (!sess || errCode || bootAddr || f.autoRun) WfClose(wf);
 	if (write_buffer) free(write_buffer);
-	if (read_buffer)  free(read_buffer);
+	ManifestFree(man);
+	FleetHostsFree(fleetHosts, fleetN);
 
 #ifndef __OS_WIN
 	// Restore cursor
@@ -791,5 +2320,61 @@ dealloc_exit:
     return errCode;
 }
 
+// Copies an argument vector, strings included, in a single allocation.
+// Returns NULL if out of memory.
+static char **ArgvDup(int argc, char **argv) {
+	size_t len = (argc + 1) * sizeof(char*);
+	char **dup;
+	char *str;
+	int i;
+
+	for (i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+	if (!(dup = malloc(len))) return NULL;
+	str = (char*)(dup + argc + 1);
+	for (i = 0; i < argc; i++) {
+		dup[i] = strcpy(str, argv[i]);
+		str += strlen(str) + 1;
+	}
+	dup[argc] = NULL;
+
+	return dup;
+}
+
+/************************************************************************//**
+ * Entry point. Parses command line and executes requested actions.
+ *
+ * \param[in] argc Number of input parameters.
+ * \param[in] argv List of input parameters.
+ *
+ * \return 0 if completed successfully, non-zero if error.
+ ****************************************************************************/
+int main(int argc, char **argv) {
+	// Daemon jobs switch to the context of their cart
+	WfCtx *ctx;
+	int errCode;
+
+	if (!(cmdArgv = ArgvDup(argc, argv))) {
+		perror("Allocating command line");
+		return 1;
+	}
+	if (!(wf = ctx = WfCtxNew())) {
+		perror("Allocating connection context");
+		free(cmdArgv);
+		return 1;
+	}
+#ifdef WF_URING
+	// stdio is used if io_uring is not available
+	fileRing = UringNew(2);
+#endif
+	errCode = Job(argc, argv, NULL);
+#ifdef WF_URING
+	UringFree(fileRing);
+#endif
+	WfCtxFree(ctx);
+	free(cmdArgv);
+
+	return errCode;
+}
+
 /** \} */
 
@@ -0,0 +1,293 @@
+/************************************************************************//**
+ * manifest: Loads job manifests, and coalesces the images to flash into
+ * segments.
+ ****************************************************************************/
+#include "manifest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "rom_head.h"
+#include "util.h"
+
+/// Maximum length of a manifest line
+#define MAN_LINE_MAX	1024
+/// Default read length
+#define MAN_READ_LEN	(4*1024*1024)
+
+// Parses a number filling the whole string. Returns nonzero on error.
+static int ManNum(const char *str, uint32_t *val) {
+	char *endPtr;
+	unsigned long n;
+
+	if (!*str) return 1;
+	n = strtoul(str, &endPtr, 0);
+	if (*endPtr != '\0' || n > UINT32_MAX) return 1;
+	*val = n;
+	return 0;
+}
+
+// Parses a "file[:addr[:len]]" argument. Empty fields keep their value.
+// Relative file names are made relative to dir. Returns nonzero on error.
+static int ManFileArg(char *arg, const char *dir, ManEntry *e) {
+	char *addr, *len = NULL;
+
+	if ((addr = strchr(arg, ':'))) {
+		*addr++ = '\0';
+		if ((len = strchr(addr, ':'))) *len++ = '\0';
+	}
+	if (!*arg || (addr && *addr && ManNum(addr, &e->addr)) ||
+			(len && *len && ManNum(len, &e->len))) return 1;
+	if (!(e->file = malloc(strlen(dir) + strlen(arg) + 1))) return 1;
+	strcpy(e->file, arg[0] == '/'?"":dir);
+	strcat(e->file, arg);
+	return 0;
+}
+
+// Parses an "addr:len" argument. Returns nonzero on error.
+static int ManRangeArg(char *arg, ManEntry *e) {
+	char *len;
+
+	if (!(len = strchr(arg, ':'))) return 1;
+	*len++ = '\0';
+	return ManNum(arg, &e->addr) || ManNum(len, &e->len) || !e->len;
+}
+
+/************************************************************************//**
+ * Parses a manifest line, adding its entry to the manifest.
+ *
+ * \param[in] m    Manifest.
+ * \param[in] line Line to parse. It is modified.
+ * \param[in] dir  Manifest directory, prepended to relative file names.
+ *
+ * \return 0 if OK, nonzero on error.
+ ****************************************************************************/
+static int ManLineParse(Manifest *m, char *line, const char *dir) {
+	char *op, *arg, *extra;
+	ManEntry e, *tmp;
+
+	op = strtok(line, " \t\r\n");
+	if (!op || op[0] == '#') return 0;
+	arg = strtok(NULL, " \t\r\n");
+	extra = strtok(NULL, " \t\r\n");
+	if (extra) return 1;
+
+	memset(&e, 0, sizeof(ManEntry));
+	if (!strcmp(op, "verify") || !strcmp(op, "autoboot")) {
+		if (arg) return 1;
+		if (op[0] == 'v') m->verify = TRUE;
+		else m->autoRun = TRUE;
+		return 0;
+	}
+	if (!arg) return 1;
+	if (!strcmp(op, "boot")) {
+		return ManNum(arg, &m->bootAddr) || m->bootAddr < 0x200;
+	} else if (!strcmp(op, "flash")) {
+		e.op = MAN_FLASH;
+		if (ManFileArg(arg, dir, &e)) return 1;
+	} else if (!strcmp(op, "read")) {
+		e.op = MAN_READ;
+		e.len = MAN_READ_LEN;
+		if (ManFileArg(arg, dir, &e)) return 1;
+	} else if (!strcmp(op, "erase")) {
+		e.op = MAN_ERASE;
+		if (ManRangeArg(arg, &e)) return 1;
+	} else return 1;
+
+	if (!(tmp = realloc(m->entry, (m->n + 1) * sizeof(ManEntry)))) {
+		free(e.file);
+		return 1;
+	}
+	m->entry = tmp;
+	m->entry[m->n++] = e;
+	return 0;
+}
+
+/************************************************************************//**
+ * Loads and parses a manifest file.
+ *
+ * \param[in] file Name of the manifest file.
+ *
+ * \return The loaded manifest, or NULL if it could not be loaded or has
+ * errors. Errors are printed.
+ ****************************************************************************/
+Manifest *ManifestLoad(const char *file) {
+	char line[MAN_LINE_MAX];
+	char *dir, *slash;
+	Manifest *m;
+	FILE *f;
+	int num, err = 0;
+
+	if (!(f = fopen(file, "r"))) {
+		perror(file);
+		return NULL;
+	}
+	m = calloc(1, sizeof(Manifest));
+	dir = malloc(strlen(file) + 1);
+	if (!m || !dir) {
+		perror("Allocating manifest");
+		fclose(f);
+		free(dir);
+		free(m);
+		return NULL;
+	}
+	// Directory, including the trailing slash
+	strcpy(dir, file);
+	slash = strrchr(dir, '/');
+	if (slash) slash[1] = '\0';
+	else dir[0] = '\0';
+
+	for (num = 1; !err && fgets(line, MAN_LINE_MAX, f); num++) {
+		if ((err = ManLineParse(m, line, dir))) {
+			PrintErr("%s:%d: invalid manifest line!\n", file, num);
+		}
+	}
+	fclose(f);
+	free(dir);
+	if (!err && m->bootAddr && m->autoRun) {
+		PrintErr("%s: boot and autoboot cannot be used together!\n", file);
+		err = 1;
+	}
+	if (err) {
+		ManifestFree(m);
+		return NULL;
+	}
+	return m;
+}
+
+// Sorts flash entries by address.
+static int ManEntryCmp(const void *a, const void *b) {
+	const ManEntry *x = *(const ManEntry**)a, *y = *(const ManEntry**)b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// Obtains the length of a flash entry from its file, if not set.
+static int ManImageLen(ManEntry *e) {
+	FILE *f;
+	long len = e->len;
+
+	if (!len) {
+		if (!(f = fopen(e->file, "rb"))) {
+			perror(e->file);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		fclose(f);
+	}
+	if (len <= 0 || (uint64_t)e->addr + len > UINT32_MAX) {
+		PrintErr("Invalid image %s!\n", e->file);
+		return 1;
+	}
+	e->len = len;
+	return 0;
+}
+
+// Loads the image of a flash entry into its segment.
+static int ManImageLoad(const Manifest *m, const ManEntry *e) {
+	const ManSeg *s = m->seg;
+	FILE *f;
+	int err;
+
+	while (e->addr >= s->addr + s->len) s++;
+	if (!(f = fopen(e->file, "rb"))) {
+		perror(e->file);
+		return 1;
+	}
+	if ((err = fread(s->data + e->addr - s->addr, e->len, 1, f) != 1)) {
+		PrintErr("Error reading %u bytes from %s!\n", e->len, e->file);
+	}
+	fclose(f);
+	return err;
+}
+
+/************************************************************************//**
+ * Loads the images to flash, and coalesces them into segments.
+ * Overlapping and adjacent images are merged. When erasing, images sharing
+ * a sector are merged too, filling the gap with 0xFF, so the sector is
+ * erased only once.
+ *
+ * \param[in] m         Manifest.
+ * \param[in] chip      Flash chip geometry, NULL if unknown.
+ * \param[in] sectMerge Merge images sharing a sector.
+ * \param[in] noPatch   If zero, the ROM header of a segment starting at
+ *                      address 0 is patched.
+ *
+ * \return 0 if OK, nonzero on error.
+ ****************************************************************************/
+int ManifestCoalesce(Manifest *m, const FlashGeom *chip, int sectMerge,
+		int noPatch) {
+	ManEntry **img;
+	ManSeg *s;
+	uint32_t end, sect, sectLen;
+	int i, n = 0;
+
+	if (!(img = malloc((m->n + 1) * sizeof(ManEntry*)))) {
+		perror("Allocating manifest");
+		return 1;
+	}
+	for (i = 0; i < m->n; i++) {
+		if (m->entry[i].op != MAN_FLASH) continue;
+		if (ManImageLen(&m->entry[i])) goto err;
+		img[n++] = &m->entry[i];
+	}
+	qsort(img, n, sizeof(ManEntry*), ManEntryCmp);
+
+	// Each segment ends where the next image does not touch it
+	if (n && !(m->seg = calloc(n, sizeof(ManSeg)))) {
+		perror("Allocating manifest");
+		goto err;
+	}
+	for (i = 0; i < n; i++) {
+		s = m->nseg?&m->seg[m->nseg - 1]:NULL;
+		end = s?s->addr + s->len:0;
+		if (s && ((img[i]->addr <= end) || (sectMerge &&
+				!FlashGeomSect(chip, end - 1, &sect, &sectLen) &&
+				img[i]->addr < sect + sectLen))) {
+			s->len = MAX(end, img[i]->addr + img[i]->len) - s->addr;
+		} else {
+			s = &m->seg[m->nseg++];
+			s->addr = img[i]->addr;
+			s->len = img[i]->len;
+		}
+		s->images++;
+	}
+	free(img);
+
+	for (i = 0; i < m->nseg; i++) {
+		if (!(m->seg[i].data = malloc(m->seg[i].len))) {
+			perror("Allocating image RAM");
+			return 1;
+		}
+		// Gaps are left erased
+		memset(m->seg[i].data, 0xFF, m->seg[i].len);
+	}
+	// Images are loaded in order, so later ones win where they overlap
+	for (i = 0; i < m->n; i++) {
+		if (m->entry[i].op == MAN_FLASH &&
+				ManImageLoad(m, &m->entry[i])) return 1;
+	}
+	if (m->nseg && !m->seg[0].addr && !noPatch &&
+			m->seg[0].len >= ROM_HEAD_LEN) RomHeadPatch(m->seg[0].data);
+
+	return 0;
+
+err:
+	free(img);
+	return 1;
+}
+
+/************************************************************************//**
+ * Frees a manifest.
+ *
+ * \param[in] m Manifest to free. Can be NULL.
+ ****************************************************************************/
+void ManifestFree(Manifest *m) {
+	int i;
+
+	if (!m) return;
+	for (i = 0; i < m->n; i++) free(m->entry[i].file);
+	for (i = 0; i < m->nseg; i++) free(m->seg[i].data);
+	free(m->entry);
+	free(m->seg);
+	free(m);
+}
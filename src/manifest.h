@@ -0,0 +1,102 @@
+/************************************************************************//**
+ * \brief Job manifest: a list of operations run in a single session.
+ *
+ * A manifest is a text file with an operation per line. Empty lines and
+ * lines starting with '#' are ignored. Supported operations are:
+ *
+ *     flash    file[:addr[:len]]   Flash an image (whole file by default)
+ *     erase    addr:len            Erase a range (sector granularity)
+ *     read     file[:addr[:len]]   Read a range to a file (4 MiB default)
+ *     verify                       Verify the flashed images
+ *     boot     addr                Run from address when done
+ *     autoboot                     Run from header entry point when done
+ *
+ * Relative file names are relative to the manifest directory. Images are
+ * coalesced: overlapping and adjacent images are merged into a single
+ * segment, later images overwriting earlier ones, so the whole job can be
+ * flashed as a single program stream.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Manifest manifest
+ * \{
+ ****************************************************************************/
+
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stdint.h>
+#include "flash_geom.h"
+
+/// Manifest operation
+typedef enum {
+	MAN_FLASH = 0,		///< Flash an image
+	MAN_ERASE,			///< Erase a range
+	MAN_READ			///< Read a range to a file
+} ManOp;
+
+/// Manifest entry
+typedef struct {
+	ManOp op;			///< Operation
+	char *file;			///< File name, NULL for erase
+	uint32_t addr;		///< Start address
+	uint32_t len;		///< Length, 0 for the whole file when flashing
+} ManEntry;
+
+/// Segment of coalesced images
+typedef struct {
+	uint32_t addr;		///< Start address
+	uint32_t len;		///< Length
+	uint8_t *data;		///< Segment data
+	uint16_t images;	///< Number of images in the segment
+} ManSeg;
+
+/// Loaded manifest
+typedef struct {
+	ManEntry *entry;	///< Flash, erase and read operations, in order
+	int n;				///< Number of entries
+	ManSeg *seg;		///< Coalesced segments, sorted by address
+	int nseg;			///< Number of segments
+	uint32_t bootAddr;	///< Boot address, 0 if not booting from address
+	uint8_t autoRun;	///< Boot from header entry point when done
+	uint8_t verify;		///< Verify the flashed images
+} Manifest;
+
+/************************************************************************//**
+ * Loads and parses a manifest file.
+ *
+ * \param[in] file Name of the manifest file.
+ *
+ * \return The loaded manifest, or NULL if it could not be loaded or has
+ * errors. Errors are printed.
+ ****************************************************************************/
+Manifest *ManifestLoad(const char *file);
+
+/************************************************************************//**
+ * Loads the images to flash, and coalesces them into segments.
+ * Overlapping and adjacent images are merged. When erasing, images sharing
+ * a sector are merged too, filling the gap with 0xFF, so the sector is
+ * erased only once.
+ *
+ * \param[in] m         Manifest.
+ * \param[in] chip      Flash chip geometry, NULL if unknown.
+ * \param[in] sectMerge Merge images sharing a sector.
+ * \param[in] noPatch   If zero, the ROM header of a segment starting at
+ *                      address 0 is patched.
+ *
+ * \return 0 if OK, nonzero on error.
+ ****************************************************************************/
+int ManifestCoalesce(Manifest *m, const FlashGeom *chip, int sectMerge,
+		int noPatch);
+
+/************************************************************************//**
+ * Frees a manifest.
+ *
+ * \param[in] m Manifest to free. Can be NULL.
+ ****************************************************************************/
+void ManifestFree(Manifest *m);
+
+#endif /*_MANIFEST_H_*/
+
+/** \} */
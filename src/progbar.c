@@ -2,81 +2,171 @@
  * ProgBar: Draw progress bars for command line applications.
  *
  * Drawn progress bar has the following appearance:
- * <Some text> [========>        ] 50%
- * Initial text is optional. The bar is auto adjusted to the specified line
- * width. This function must be called for each bar iteration.
+ * <Address> [========>        ] 50%   1.23 MB/s ETA  0:12
+ * The bar is auto adjusted to the specified line width. A thread draws it
+ * PROGBAR_HZ times per second, so the bar never slows down the I/O.
  *
  * \note It is recommended to hide the cursor (e.g. calling curs_set(0) if
  *       using ncurses) when using this module.
- * 
+ *
  * \author Jesus Alonso (doragasu)
  * \date   2015
  ****************************************************************************/
 #include "progbar.h"
+#include "util.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
-/************************************************************************//**
- * Draws the progress bar.
- *
- * \param[in] pos Position (relative to max).
- * \param[in] max Maximum position (pos) value.
- * \param[in] width Line width. Drawn bar will fill a complete line.
- * \param[in] text  Text drawn at the beginning of the line (NULL for none).
- ****************************************************************************/
-void ProgBarDraw(unsigned int pos, unsigned int max, unsigned int width,
-		char text[]) {
+/// Maximum length of a line
+#define PROGBAR_LINE_MAX	512
+/// Length of the address, brackets and percentage, e.g.: "0x123456 []100%"
+#define PROGBAR_FIXED_LEN	15
+/// Length of the throughput and ETA text, e.g.: "    1.23 MB/s ETA  0:12"
+#define PROGBAR_STATS_LEN	23
+/// Minimum length of the bar
+#define PROGBAR_MIN_BAR		10
 
-	size_t textLen = 0;
-	unsigned int progChars = 0;
-	unsigned int barWidth;
-	unsigned char progPercent = 0;
-	char *t = text;
-	unsigned int i = 0;
+/// Progress bar being rendered
+struct ProgBar {
+	pthread_t thread;		///< Rendering thread
+	pthread_mutex_t lock;	///< Protects pos and done
+	pthread_cond_t stop;	///< Signalled when rendering must stop
+	uint32_t addr;			///< Address of position 0
+	uint32_t max;			///< Maximum position
+	uint32_t pos;			///< Current position
+	unsigned int width;		///< Line width
+	int done;				///< Rendering must stop
+	int started;			///< Rendering thread is running
+	uint64_t start;			///< Start time, in us
+	/// Positions in the last second, for the throughput
+	uint32_t histPos[PROGBAR_HZ];
+	/// Times of histPos samples, in us
+	uint64_t histUs[PROGBAR_HZ];
+	unsigned int hist;		///< Next history sample
+};
 
-	// Minimum drawable bar takes 8 characters plus text length ([==]100%).
-	// Text length is the length of the text string plus 1 (a space). Also
-	// a space if left at the end of the bar to avoid cursor jumping to the
-	// next line.
-	// Obtain text length. Cut if necessary
-	if (text) {
-		textLen = strlen(text);
-		// If cutting, copy text to avoid modifying the original parameter
-		if (textLen >= (width - 9)) {
-			t = (char*) malloc(textLen + 1);
-			memcpy(t, text, textLen);
-			t[textLen] = '\0';
-		}
+// Builds the line for the current position, and writes it at once.
+static void ProgBarDraw(ProgBar *p, uint32_t pos, int final) {
+	char line[PROGBAR_LINE_MAX];
+	uint64_t now = TimeUs();
+	unsigned int old = p->hist % PROGBAR_HZ;
+	int barWidth, progChars, i, n;
+	double secs, rate;
+	uint32_t eta;
+	int stats;
+
+	// Throughput over the last second, or the average once done
+	if (final || p->hist < PROGBAR_HZ) {
+		secs = (now - p->start) / 1e6;
+		rate = secs > 0?pos / secs:0;
+	} else {
+		secs = (now - p->histUs[old]) / 1e6;
+		rate = secs > 0?(pos - p->histPos[old]) / secs:0;
 	}
+	p->histPos[old] = pos;
+	p->histUs[old] = now;
+	p->hist++;
 
-	// Obtain progress in percent and chars forms
-	barWidth = width - 6;
-	barWidth = textLen?barWidth - textLen - 1:barWidth;
-	pos = pos > max?max:pos;	// Ensure pos <= max.
-	progChars = barWidth * pos / max;
-	progPercent = 100 * pos / max;
+	// Throughput and ETA are only drawn if the line is wide enough. A
+	// column is left at the end of the line, to avoid the cursor jumping
+	// to the next one.
+	barWidth = (int)MIN(p->width, PROGBAR_LINE_MAX / 2) - 1 -
+		PROGBAR_FIXED_LEN;
+	if ((stats = barWidth - PROGBAR_STATS_LEN >= PROGBAR_MIN_BAR)) {
+		barWidth -= PROGBAR_STATS_LEN;
+	}
+	barWidth = MAX(barWidth, PROGBAR_MIN_BAR);
+	pos = MIN(pos, p->max);
+	progChars = p->max?(uint64_t)barWidth * pos / p->max:barWidth;
 
-	// Jump to the beginning of the line
-	printf("\r");
-	// Draw text (if any)
-	if (textLen) printf("%s ", t);
-	// Draw start of the bar
-	putchar('[');
-	// Draw progress
-	if (progChars) {
-		for (; i < (progChars - 1); i++) putchar('=');
-		// Unless progress is 100%, print '>' head
-		if (progChars < barWidth) putchar('>');
-		else putchar('=');
-		i++;
+	n = sprintf(line, "\r0x%06X [", p->addr + pos);
+	for (i = 0; i < barWidth; i++) {
+		line[n++] = i + 1 < progChars?'=':i + 1 == progChars?
+			(progChars < barWidth?'>':'='):' ';
+	}
+	n += sprintf(line + n, "]%3u%%", p->max?
+			(unsigned int)((uint64_t)100 * pos / p->max):100);
+	if (stats) {
+		if (final) eta = (now - p->start) / 1000000;
+		else eta = rate > 0?(p->max - pos) / rate:0;
+		if (!final && !(rate > 0)) {
+			n += sprintf(line + n, " %7.2f MB/s ETA --:--", rate / 1e6);
+		} else {
+			n += sprintf(line + n, " %7.2f MB/s %s %2u:%02u", rate / 1e6,
+					final?"in ":"ETA", MIN(eta / 60, 99), eta % 60);
+		}
 	}
-	// Fill line with blanks
-	for (; i < barWidth; i++) putchar(' ');
-	// Print tail with completion percent
-	printf("]%3d%%", progPercent);
+	if (final) line[n++] = '\n';
+	fwrite(line, n, 1, stdout);
 	fflush(stdout);
+}
+
+// Draws the bar PROGBAR_HZ times per second, until stopped.
+static void *ProgBarThread(void *arg) {
+	ProgBar *p = (ProgBar*)arg;
+	struct timespec ts;
+	uint64_t startUs;
+	uint32_t pos;
+
+	TraceThreadName("progress");
+	pthread_mutex_lock(&p->lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	while (!p->done) {
+		ts.tv_nsec += 1000000000L / PROGBAR_HZ;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&p->stop, &p->lock, &ts);
+		if (p->done) break;
+		pos = p->pos;
+		// Console is written without holding the lock
+		pthread_mutex_unlock(&p->lock);
+		startUs = TimeUs();
+		ProgBarDraw(p, pos, FALSE);
+		TraceSpan("ui", "progress", startUs, 0, 0);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+ProgBar *ProgBarStart(uint32_t addr, uint32_t max, unsigned int width) {
+	ProgBar *p;
+
+	if (!(p = calloc(1, sizeof(ProgBar)))) return NULL;
+	p->addr = addr;
+	p->max = max;
+	p->width = width;
+	p->start = TimeUs();
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->stop, NULL);
+	// Without the thread, only the final bar is drawn
+	p->started = !pthread_create(&p->thread, NULL, ProgBarThread, p);
+
+	return p;
+}
+
+void ProgBarSet(ProgBar *p, uint32_t pos) {
+	if (!p) return;
+	pthread_mutex_lock(&p->lock);
+	p->pos = pos;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void ProgBarEnd(ProgBar *p) {
+	if (!p) return;
+	pthread_mutex_lock(&p->lock);
+	p->done = TRUE;
+	pthread_cond_signal(&p->stop);
+	pthread_mutex_unlock(&p->lock);
+	if (p->started) pthread_join(p->thread, NULL);
 
-	// If we copied the text, free memory
-	if (text && (t != text)) free(t);
+	ProgBarDraw(p, p->pos, TRUE);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->stop);
+	free(p);
 }
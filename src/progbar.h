@@ -2,13 +2,17 @@
  * \brief Draw progress bars for command line applications.
  *
  * Drawn progress bar has the following appearance:
- * <Some text> [========>        ] 50%
- * Initial text is optional. The bar is auto adjusted to the specified line
- * width. This function must be called for each bar iteration.
+ * <Address> [========>        ] 50%   1.23 MB/s ETA  0:12
+ * The bar is auto adjusted to the specified line width. Progress is
+ * rendered by a separate thread, at most PROGBAR_HZ times per second, so
+ * the code doing the I/O only has to store the position after each step,
+ * and never waits for the console. Each line is built in a single buffer
+ * and written at once. Throughput and ETA are computed over the last
+ * second.
  *
  * \note It is recommended to hide the cursor (e.g. calling curs_set(0) if
  *       using ncurses) when using this module.
- * 
+ *
  * \author Jesus Alonso (doragasu)
  * \date   2015
  *
@@ -19,18 +23,44 @@
 #ifndef _PROGBAR_H_
 #define _PROGBAR_H_
 
+#include <stdint.h>
+
+/// Maximum number of times the bar is drawn per second
+#define PROGBAR_HZ		10
+
+/// Progress bar being rendered
+typedef struct ProgBar ProgBar;
+
 /************************************************************************//**
- * Draws the progress bar.
+ * Starts rendering a progress bar.
  *
- * \param[in] pos Position (relative to max).
- * \param[in] max Maximum position (pos) value.
+ * \param[in] addr  Address of position 0, displayed at the start of the
+ *                  line along with the current position.
+ * \param[in] max   Maximum position value.
  * \param[in] width Line width. Drawn bar will fill a complete line.
- * \param[in] text  Text drawn at the beginning of the line (NULL for none).
+ *
+ * \return The progress bar, or NULL if it could not be allocated. Other
+ * functions accept NULL, drawing nothing.
+ ****************************************************************************/
+ProgBar *ProgBarStart(uint32_t addr, uint32_t max, unsigned int width);
+
+/************************************************************************//**
+ * Sets the current position. Just stores it, the bar is drawn later.
+ *
+ * \param[in] p   Progress bar.
+ * \param[in] pos Position (relative to max).
+ ****************************************************************************/
+void ProgBarSet(ProgBar *p, uint32_t pos);
+
+/************************************************************************//**
+ * Stops rendering the progress bar. The bar is drawn a last time, with the
+ * average throughput and elapsed time, followed by a new line. The bar is
+ * freed.
+ *
+ * \param[in] p Progress bar.
  ****************************************************************************/
-void ProgBarDraw(unsigned int pos, unsigned int max, unsigned int width,
-		char text[]);
+void ProgBarEnd(ProgBar *p);
 
 #endif /*_PROGBAR_H_*/
 
 /** \} */
-
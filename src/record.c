@@ -0,0 +1,102 @@
+/************************************************************************//**
+ * record: Protocol session recordings.
+ ****************************************************************************/
+#include "record.h"
+#include "crc32.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/// Size of the stdio buffer of recordings
+#define REC_BUF_LEN		65536
+
+struct Rec {
+	FILE *f;			///< Recording file
+	const char *file;	///< Recording file name
+	uint64_t startUs;	///< Time the recording started, in us
+	char buf[REC_BUF_LEN];	///< File buffer
+};
+
+Rec *RecCreate(const char *file) {
+	RecHead head;
+	Rec *r;
+
+	if (!(r = calloc(1, sizeof(Rec)))) return NULL;
+	if (!(r->f = fopen(file, "wb"))) {
+		perror(file);
+		free(r);
+		return NULL;
+	}
+	// Frames are only written to disk once the buffer fills
+	setvbuf(r->f, r->buf, _IOFBF, REC_BUF_LEN);
+	r->file = file;
+	r->startUs = TimeUs();
+	head.magic = REC_MAGIC;
+	head.startSec = time(NULL);
+	fwrite(&head, sizeof(RecHead), 1, r->f);
+	Crc32Init();
+
+	return r;
+}
+
+void RecFrame(Rec *r, uint8_t dir, uint16_t cmd, const void *args,
+		uint32_t argLen, const void *data, uint32_t len) {
+	RecEntry e;
+
+	e.us = TimeUs() - r->startUs;
+	e.cmd = cmd;
+	e.dir = dir;
+	e.argLen = MIN(argLen, REC_ARGS_MAX);
+	e.len = len;
+	e.crc = data?Crc32(0, data, len):0;
+	fwrite(&e, sizeof(RecEntry), 1, r->f);
+	if (e.argLen) fwrite(args, e.argLen, 1, r->f);
+}
+
+Rec *RecOpen(const char *file) {
+	RecHead head;
+	Rec *r;
+
+	if (!(r = calloc(1, sizeof(Rec)))) return NULL;
+	if (!(r->f = fopen(file, "rb"))) {
+		perror(file);
+		free(r);
+		return NULL;
+	}
+	setvbuf(r->f, r->buf, _IOFBF, REC_BUF_LEN);
+	r->file = file;
+	if ((fread(&head, sizeof(RecHead), 1, r->f) != 1) ||
+			(head.magic != REC_MAGIC)) {
+		PrintErr("%s is not a wflash recording!\n", file);
+		fclose(r->f);
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+int RecNext(Rec *r, RecEntry *e, uint8_t args[]) {
+	if (fread(e, sizeof(RecEntry), 1, r->f) != 1) return feof(r->f)?0:-1;
+	if ((e->argLen > REC_ARGS_MAX) || (e->dir > REC_RX) || (e->argLen &&
+				(fread(args, e->argLen, 1, r->f) != 1))) {
+		PrintErr("%s is truncated or corrupt!\n", r->file);
+		return -1;
+	}
+	memset(args + e->argLen, 0, REC_ARGS_MAX - e->argLen);
+	return 1;
+}
+
+int RecClose(Rec *r) {
+	int err;
+
+	if (!r) return 0;
+	err = ferror(r->f);
+	if (fclose(r->f) || err) {
+		PrintErr("Could not write recording to %s!\n", r->file);
+		err = 1;
+	}
+	free(r);
+	return err;
+}
@@ -0,0 +1,116 @@
+/************************************************************************//**
+ * \brief Protocol session recordings.
+ *
+ * A recording holds every command frame sent to the bootloader and every
+ * reply received, with its time stamp. Arguments of the commands are kept,
+ * but payloads (program data) and reply data (read data, CRCs...) are only
+ * kept as their length and CRC-32, so recordings are compact: a 16 byte
+ * entry plus the arguments per frame. wfreplay plays a recording against a
+ * cart or a wfsim stand-in, keeping the original timing between commands.
+ *
+ * File format: a RecHead, followed by the entries. Each entry is a RecEntry
+ * followed by argLen bytes of command arguments. All fields are in host
+ * byte order, like the protocol itself.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Record record
+ * \{
+ ****************************************************************************/
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+
+/// Magic number at the start of recordings: "WFR1"
+#define REC_MAGIC		0x31524657
+/// Maximum length of the command arguments recorded
+#define REC_ARGS_MAX	16
+
+/// Direction of the recorded frame
+enum {
+	REC_TX = 0,		///< Command sent, including any payload sent with it
+	REC_DATA,		///< Payload sent after the command was acknowledged
+	REC_RX			///< Reply received, including any data following it
+};
+
+/// Recording header
+typedef struct {
+	uint32_t magic;		///< REC_MAGIC
+	uint32_t startSec;	///< Wall clock time the recording started at
+} RecHead;
+
+/// Recorded frame
+typedef struct {
+	uint32_t us;		///< Time since the recording started, in us
+	uint16_t cmd;		///< Command code, of the command replied for REC_RX
+	uint8_t dir;		///< Direction, REC_TX, REC_DATA or REC_RX
+	uint8_t argLen;		///< Length of the arguments following the entry
+	uint32_t len;		///< Length of the payload or reply data
+	uint32_t crc;		///< CRC-32 of the payload or reply data, 0 if unknown
+} RecEntry;
+
+/// Recording being written or read
+typedef struct Rec Rec;
+
+/************************************************************************//**
+ * Creates a recording.
+ *
+ * \param[in] file Name of the file to write the recording to.
+ *
+ * \return The recording, or NULL if the file could not be created.
+ ****************************************************************************/
+Rec *RecCreate(const char *file);
+
+/************************************************************************//**
+ * Records a frame. Entries are buffered, and written in blocks.
+ *
+ * \param[in] r      Recording.
+ * \param[in] dir    Direction, REC_TX, REC_DATA or REC_RX.
+ * \param[in] cmd    Command code.
+ * \param[in] args   Command arguments. Only the first REC_ARGS_MAX bytes
+ *                   are recorded.
+ * \param[in] argLen Length of the arguments.
+ * \param[in] data   Payload or reply data, to compute its CRC. Can be NULL
+ *                   if not available (the CRC is recorded as 0).
+ * \param[in] len    Length of the payload or reply data.
+ ****************************************************************************/
+void RecFrame(Rec *r, uint8_t dir, uint16_t cmd, const void *args,
+		uint32_t argLen, const void *data, uint32_t len);
+
+/************************************************************************//**
+ * Opens a recording for reading.
+ *
+ * \param[in] file Name of the recording file.
+ *
+ * \return The recording, or NULL if it could not be opened or is not a
+ * recording.
+ ****************************************************************************/
+Rec *RecOpen(const char *file);
+
+/************************************************************************//**
+ * Reads the next recorded frame.
+ *
+ * \param[in]  r    Recording opened with RecOpen().
+ * \param[out] e    Recorded frame.
+ * \param[out] args Arguments of the frame, REC_ARGS_MAX bytes long.
+ *
+ * \return 1 if a frame was read, 0 at the end of the recording, or -1 if
+ * the recording is truncated.
+ ****************************************************************************/
+int RecNext(Rec *r, RecEntry *e, uint8_t args[]);
+
+/************************************************************************//**
+ * Closes a recording, writing any buffered entry.
+ *
+ * \param[in] r Recording. Can be NULL.
+ *
+ * \return 0 if OK, nonzero if the recording could not be written.
+ ****************************************************************************/
+int RecClose(Rec *r);
+
+#endif /*_RECORD_H_*/
+
+/** \} */
@@ -0,0 +1,414 @@
+/************************************************************************//**
+ * \brief wfreplay: plays a wflash session recording.
+ *
+ * Plays a session recorded with wflash --record against a cartridge or a
+ * wfsim stand-in, using the wflash module. Each command is issued at the
+ * same time since the start of the session it was issued in the recording,
+ * unless the previous commands take longer to complete, and the commands
+ * the recorded client waited for are waited for too. Commands are pipelined
+ * like in the recording. Program payloads are not recorded, pseudo-random
+ * data of the same length is sent instead. Compressed payloads are built
+ * from pseudo-random data followed by zeros, to get about the recorded
+ * compressed length.
+ *
+ * Since the replayed session uses the current wflash module, replaying the
+ * same recording before and after a client change compares both on the
+ * same real-world workload, without hardware. Session statistics are
+ * reported as wflash --stats does, along with the recorded duration and
+ * the number of replies that match the recorded ones (only expected when
+ * the stand-in holds the same flash contents as the recorded cart).
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup WfReplay wfreplay
+ * \{
+ ****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "../wflash.h"
+#include "../cmds.h"
+#include "../record.h"
+#include "../stats.h"
+#include "../crc32.h"
+#include "../lz.h"
+#include "../util.h"
+
+/// Version major number
+#define VERSION_MAJOR	0x00
+/// Version minor number
+#define VERSION_MINOR	0x01
+
+/// Default server port
+#define REPLAY_DEF_PORT		1989
+/// Maximum time to wait for the bootloader, in milliseconds
+#define REPLAY_READY_MS		5000
+/// Longest payload of a program command
+#define REPLAY_PAYLOAD_MAX	65536
+
+/// Recorded frame, with its arguments
+typedef struct {
+	RecEntry e;					///< Frame
+	uint8_t args[REC_ARGS_MAX];	///< Command arguments
+	int reply;					///< Index of the reply to a command, or -1
+	int sync;					///< Recorded client waited for all replies
+} ReplayFrame;
+
+/// Session being replayed
+typedef struct {
+	ReplayFrame *fr;	///< Recorded frames
+	int n;				///< Number of frames
+	unsigned int window;///< Commands in flight in the recording
+	uint32_t cmds;		///< Commands replayed
+	uint32_t checked;	///< Replies with recorded digest
+	uint32_t matched;	///< Replies matching the recorded digest
+	uint8_t *lz;		///< Buffers to build compressed payloads
+} Replay;
+
+/// Read command in flight
+typedef struct {
+	Replay *r;			///< Session
+	uint32_t crc;		///< Recorded digest of the data
+	uint8_t buf[];		///< Data buffer
+} ReplayReadBuf;
+
+/// Long command-line options
+static const struct option opt[] = {
+	{"wflash-addr",	required_argument,	NULL,	'a'},
+	{"wflash-port",	required_argument,	NULL,	'p'},
+	{"window",		required_argument,	NULL,	'w'},
+	{"fast",		no_argument,		NULL,	'F'},
+	{"stats",		required_argument,	NULL,	's'},
+	{"version",		no_argument,		NULL,	'V'},
+	{"help",		no_argument,		NULL,	'h'},
+	{NULL,			0,					NULL,	0}
+};
+
+/// Descriptions of the command-line options
+static const char *description[] = {
+	"wflash server address (default 127.0.0.1)",
+	"wflash server port (default 1989)",
+	"Commands in flight (default as in the recording)",
+	"Issue commands as fast as possible, instead of with the recorded "
+		"timing",
+	"Statistics report: 'text' (default), 'json', or a file to write "
+		"them to as JSON",
+	"Show program version",
+	"Print help screen and exit"
+};
+
+static void PrintVersion(char prgName[]) {
+	printf("%s version %d.%d, doragasu 2017.\n", prgName,
+			VERSION_MAJOR, VERSION_MINOR);
+}
+
+static void PrintHelp(char *prgName) {
+	int i;
+
+	PrintVersion(prgName);
+	printf("Usage: %s [OPTIONS [OPTION_ARG]] RECORDING\nSupported "
+			"options:\n\n", prgName);
+	for (i = 0; opt[i].name; i++) {
+		printf(" -%c, --%s%s: %s.\n", opt[i].val, opt[i].name,
+				opt[i].has_arg == required_argument?" <arg>":"",
+				description[i]);
+	}
+}
+
+// Loads the recording, pairs commands with their replies and finds the
+// points where the recorded client waited for all of them. Readiness
+// probes are left out.
+static int ReplayLoad(Replay *r, const char *file) {
+	ReplayFrame *fr;
+	Rec *rec;
+	int max = 0, next = 0, cmds = 0, replies = 0;
+	int i, err;
+
+	if (!(rec = RecOpen(file))) return 1;
+	memset(r, 0, sizeof(Replay));
+	do {
+		if (r->n == max) {
+			max = max?2 * max:4096;
+			if (!(fr = realloc(r->fr, max * sizeof(ReplayFrame)))) {
+				perror("Loading recording");
+				RecClose(rec);
+				return 1;
+			}
+			r->fr = fr;
+		}
+		fr = r->fr + r->n;
+		if ((err = RecNext(rec, &fr->e, fr->args)) > 0 &&
+				(fr->e.cmd != WF_CMD_ECHO)) r->n++;
+	} while (err > 0);
+	RecClose(rec);
+	if (err) return 1;
+
+	// Replies come in the order commands were sent. Commands issued with
+	// all the previous ones replied were issued synchronously.
+	for (i = 0, r->window = 1; i < r->n; i++) {
+		fr = r->fr + i;
+		fr->reply = -1;
+		if (fr->e.dir == REC_TX) {
+			fr->sync = cmds++ == replies;
+			r->window = MAX(r->window, (unsigned int)(cmds - replies));
+		} else if (fr->e.dir == REC_RX) {
+			replies++;
+			while ((next < i) && (r->fr[next].e.dir != REC_TX)) next++;
+			if (next < i) r->fr[next++].reply = i;
+		}
+	}
+	r->window = MIN(r->window, WF_PIPE_MAX);
+
+	return 0;
+}
+
+// Compares reply data with the recorded digest.
+static void ReplayCheck(Replay *r, const ReplayFrame *fr, const void *data,
+		uint32_t len) {
+	const RecEntry *rx;
+
+	if (fr->reply < 0) return;
+	rx = &r->fr[fr->reply].e;
+	if (!rx->len || !rx->crc) return;
+	r->checked++;
+	if (data && (len == rx->len) && (Crc32(0, data, len) == rx->crc)) {
+		r->matched++;
+	}
+}
+
+// Checks the data of a read command, and frees its buffer.
+static uint32_t ReplayReadDone(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx) {
+	ReplayReadBuf *rd = (ReplayReadBuf*)ctx;
+
+	rd->r->checked++;
+	if (Crc32(0, data, len) == rd->crc) rd->r->matched++;
+	free(rd);
+	return len;
+}
+
+// Queues a read command, checking its data once received.
+static int ReplayRead(WfCtx *wf, Replay *r, const ReplayFrame *fr,
+		uint32_t addr, uint32_t len) {
+	ReplayReadBuf *rd;
+
+	if (!(rd = malloc(sizeof(ReplayReadBuf) + len))) return WF_ERROR;
+	rd->r = r;
+	rd->crc = fr->reply < 0?0:r->fr[fr->reply].e.crc;
+	if (WfReadQueue(wf, addr, len, rd->buf, ReplayReadDone, rd) == WF_OK) {
+		return WF_OK;
+	}
+	// Too long to be queued, or failed: read it synchronously
+	if ((WfPipeFlush(wf) != WF_OK) ||
+			(WfRead(wf, addr, len, rd->buf) != WF_OK)) {
+		free(rd);
+		return WF_ERROR;
+	}
+	ReplayReadDone(addr, rd->buf, len, rd);
+	return WF_OK;
+}
+
+// Builds a compressed payload decompressing to len bytes, about zLen bytes
+// long, in the second half of r->lz. Returns its length, 0 if too long.
+static uint32_t ReplayLzBuild(Replay *r, const uint8_t *payload, uint32_t len,
+		uint32_t zLen) {
+	// Literals take a byte each, and runs of zeros about a byte per 255
+	uint32_t over = 16 + (len > zLen?(len - zLen) / 255:0);
+	uint32_t lit = MIN(len, zLen > over?zLen - over:0);
+
+	memcpy(r->lz, payload, lit);
+	memset(r->lz + lit, 0, len - lit);
+	return LzCompress(r->lz, len, r->lz + REPLAY_PAYLOAD_MAX,
+			REPLAY_PAYLOAD_MAX);
+}
+
+// Issues a recorded command.
+static int ReplayCmd(WfCtx *wf, Replay *r, const ReplayFrame *fr,
+		const uint8_t *payload) {
+	uint32_t arg[REC_ARGS_MAX / 4];
+	uint32_t crc[WF_CRC32_MAX];
+	uint8_t *data;
+	uint32_t n;
+
+	memcpy(arg, fr->args, REC_ARGS_MAX);
+	switch (fr->e.cmd) {
+		case WF_CMD_VERSION_GET:
+			if (WfPipeFlush(wf) || !(data = WfBootVerGet(wf))) break;
+			ReplayCheck(r, fr, data, 2);
+			return WF_OK;
+
+		case WF_CMD_ID_GET:
+			if (WfPipeFlush(wf) || !(data = WfFlashIdsGet(wf))) break;
+			ReplayCheck(r, fr, data, 4);
+			return WF_OK;
+
+		case WF_CMD_ERASE:
+			return WfErasePipe(wf, arg[0], arg[1]);
+
+		case WF_CMD_PROGRAM:
+			if (arg[1] > REPLAY_PAYLOAD_MAX) break;
+			return WfFlashPipe(wf, arg[0], arg[1], (uint8_t*)payload);
+
+		case WF_CMD_PROGRAM_LZ:
+			if ((arg[1] > REPLAY_PAYLOAD_MAX) ||
+					!(n = ReplayLzBuild(r, payload, arg[1], arg[2]))) break;
+			return WfFlashLzPipe(wf, arg[0], arg[1],
+					r->lz + REPLAY_PAYLOAD_MAX, n);
+
+		case WF_CMD_READ:
+			return ReplayRead(wf, r, fr, arg[0], arg[1]);
+
+		case WF_CMD_CRC32:
+			if (!arg[2] || (n = (arg[1] + arg[2] - 1) / arg[2]) >
+					WF_CRC32_MAX || WfPipeFlush(wf) ||
+					WfCrc32(wf, arg[0], arg[1], arg[2], crc)) break;
+			ReplayCheck(r, fr, crc, n * 4);
+			return WF_OK;
+
+		case WF_CMD_RUN:
+			return WfPipeFlush(wf) || WfBoot(wf, arg[0])?WF_ERROR:WF_OK;
+
+		case WF_CMD_AUTORUN:
+			return WfPipeFlush(wf) || WfAutoRun(wf)?WF_ERROR:WF_OK;
+
+		default:
+			PrintErr("Skipping unknown command %u.\n", fr->e.cmd);
+			return WF_OK;
+	}
+	PrintErr("Command %s at 0x%06X failed!\n", WfCmdName(fr->e.cmd),
+			arg[0]);
+	return WF_ERROR;
+}
+
+// Replays the session, obtaining the recorded duration, in us. Returns 0
+// if OK.
+static int ReplayRun(WfCtx *wf, Replay *r, int fast, const uint8_t *payload,
+		uint64_t *recUs) {
+	const ReplayFrame *fr;
+	uint64_t base = 0, start = 0, now, at;
+	int i, first = TRUE;
+
+	for (i = 0; i < r->n; i++) {
+		fr = r->fr + i;
+		if (fr->e.dir != REC_TX) continue;
+		if (first) {
+			base = fr->e.us;
+			start = TimeUs();
+			first = FALSE;
+		}
+		// Wait where the recorded client waited for replies
+		if (fr->sync && (WfPipeFlush(wf) != WF_OK)) return 1;
+		at = start + fr->e.us - base;
+		if (!fast && (now = TimeUs()) < at) usleep(at - now);
+		if (ReplayCmd(wf, r, fr, payload) != WF_OK) return 1;
+		r->cmds++;
+	}
+	*recUs = r->n?r->fr[r->n - 1].e.us - base:0;
+	return WfPipeFlush(wf) != WF_OK;
+}
+
+int main(int argc, char *argv[]) {
+	char *host = "127.0.0.1";
+	const char *statsDest = "text";
+	long port = REPLAY_DEF_PORT;
+	long window = 0;
+	int fast = FALSE;
+	uint8_t *payload;
+	uint64_t recUs = 0;
+	const WfStats *s;
+	uint32_t i, seed;
+	char *endPtr;
+	Replay r;
+	WfCtx *wf;
+	int c, err;
+
+	while ((c = getopt_long(argc, argv, "a:p:w:Fs:Vh", opt, NULL)) != -1) {
+		switch (c) {
+			case 'a':
+				host = optarg;
+				break;
+
+			case 'p':
+				port = strtol(optarg, &endPtr, 0);
+				if (*endPtr != '\0' || port <= 0 || port > 65535) {
+					PrintErr("Invalid port %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'w':
+				window = strtol(optarg, &endPtr, 0);
+				if (*endPtr != '\0' || window <= 0 || window > WF_PIPE_MAX) {
+					PrintErr("Invalid window %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'F':
+				fast = TRUE;
+				break;
+
+			case 's':
+				statsDest = optarg;
+				break;
+
+			case 'V':
+				PrintVersion(argv[0]);
+				return 0;
+
+			case 'h':
+				PrintHelp(argv[0]);
+				return 0;
+
+			default:
+				return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		PrintErr("A recording must be specified!\n");
+		return 1;
+	}
+	if (ReplayLoad(&r, argv[optind])) return 1;
+	if (!(payload = malloc(REPLAY_PAYLOAD_MAX)) ||
+			!(r.lz = malloc(2 * REPLAY_PAYLOAD_MAX))) {
+		perror("Allocating payload");
+		return 1;
+	}
+	// Pseudo-random payload, so nothing can be skipped or compressed
+	for (i = 0, seed = 1; i < REPLAY_PAYLOAD_MAX; i++) {
+		seed = seed * 1103515245 + 12345;
+		payload[i] = seed >> 16;
+	}
+	Crc32Init();
+
+	if (!(wf = WfCtxNew()) || (WfConnect(wf, host, port) != WF_OK) ||
+			(WfReady(wf, REPLAY_READY_MS) < 0)) return 1;
+	WfPipeWindowSet(wf, window?window:r.window);
+	WfStatsReset(wf);
+	WfPhaseStart(wf, "replay");
+	err = ReplayRun(wf, &r, fast, payload, &recUs);
+	WfPhaseEnd(wf);
+	WfClose(wf);
+
+	s = WfStatsGet(wf);
+	if (!strcmp(statsDest, "text")) {
+		printf("Replayed %u commands in %.3f s (recorded %.3f s), window "
+				"%ld, %u/%u replies match the recording.\n", r.cmds,
+				s->phase[0].us / 1e6, recUs / 1e6, window?window:
+				(long)r.window, r.matched, r.checked);
+	}
+	if (StatsWrite(s, statsDest)) err = 1;
+	if (err) PrintErr("Replay failed!\n");
+
+	WfCtxFree(wf);
+	free(r.lz);
+	free(payload);
+	free(r.fr);
+
+	return err;
+}
+
+/** \} */
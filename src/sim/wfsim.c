@@ -0,0 +1,931 @@
+/************************************************************************//**
+ * \brief wfsim: MegaWiFi cartridge stand-in. Emulates the wflash bootloader
+ * protocol defined in cmds.h, so wflash can be run and benchmarked without
+ * a Genesis/Megadrive console.
+ *
+ * The emulated cartridge has an in-memory NOR flash chip (programming can
+ * only clear bits, erasing sets whole sectors to 0xFF), with the sector map
+ * and typical erase and program times of the selected chip. The WiFi link
+ * is modelled in both directions as a delay line with configurable RTT,
+ * bandwidth and packet pacing, and a receive window limiting the data the
+ * cartridge buffers before processing it. Commands are processed
+ * sequentially, as the real bootloader does.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup WfSim wfsim
+ * \{
+ ****************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../cmds.h"
+#include "../flash_geom.h"
+#include "../crc32.h"
+#include "../lz.h"
+#include "../util.h"
+
+/// Version major number
+#define VERSION_MAJOR	0x00
+/// Version minor number
+#define VERSION_MINOR	0x02
+
+/// Default listen port (same as the bootloader)
+#define SIM_DEF_PORT	1989
+/// Default link segment size
+#define SIM_DEF_MSS		1460
+/// Default receive window (4 segments, as the ESP8266 lwIP stack)
+#define SIM_DEF_WINDOW	(4 * SIM_DEF_MSS)
+/// Maximum number of segments in flight on each link direction
+#define SIM_LINK_SEGS	1024
+/// Maximum number of bytes the cartridge pushes to the link at once
+#define SIM_READ_CHUNK	4096
+/// Time value meaning "never"
+#define SIM_NEVER		UINT64_MAX
+/// Nanoseconds per second
+#define SIM_NS			1000000000ULL
+/// Time to decompress a byte, in ns (68000 LZ4 decoders do about 2 MB/s)
+#define SIM_LZ_NS		500
+
+/// Default flash chip IDs (S29GL032N, bottom boot)
+static const uint8_t defIds[4] = {0x01, 0x7E, 0x1A, 0x00};
+
+/// Link parameters, shared by both directions
+typedef struct {
+	uint64_t halfRtt;		///< One way delay, in ns
+	uint64_t byteNs;		///< Time to serialize a byte, in ns (0: no cap)
+	uint64_t gapNs;			///< Minimum gap between packets, in ns
+	uint32_t mss;			///< Packet (segment) size
+	uint32_t window;		///< Bytes the receiver buffers
+} SimLinkCfg;
+
+/// Segment travelling through a link
+typedef struct {
+	uint32_t len;			///< Segment length
+	uint64_t due;			///< Time at which the segment is delivered
+} SimSeg;
+
+/// One direction of the link. Data is a byte FIFO, the first ready bytes
+/// have been delivered and the rest are still travelling in segments.
+typedef struct {
+	const SimLinkCfg *cfg;	///< Link parameters
+	uint8_t *buf;			///< Data FIFO
+	uint32_t head;			///< Index of the first byte in the FIFO
+	uint32_t len;			///< Bytes in the FIFO
+	uint32_t ready;			///< Delivered bytes in the FIFO
+	SimSeg seg[SIM_LINK_SEGS];	///< Segments in flight
+	uint16_t segHead;		///< Index of the oldest segment in flight
+	uint16_t segCount;		///< Number of segments in flight
+	uint64_t txFree;		///< Time the link finishes serializing its data
+} SimLink;
+
+/// Cartridge processing state
+typedef enum {
+	CART_CMD = 0,			///< Receiving command
+	CART_PROGRAM,			///< Receiving program payload
+	CART_PROGRAM_LZ,		///< Receiving compressed program payload
+	CART_READ,				///< Sending read data
+	CART_RUN				///< Boot requested, session ends
+} CartState;
+
+/// Session statistics
+typedef struct {
+	uint32_t cmds;			///< Commands processed
+	uint32_t erases;		///< Sectors erased
+	uint64_t progBytes;		///< Bytes programmed
+	uint64_t lzBytes;		///< Compressed bytes received
+	uint64_t unlzBytes;		///< Bytes decompressed from them
+	uint64_t readBytes;		///< Bytes read
+	uint64_t bytesIn;		///< Bytes received from the client
+	uint64_t bytesOut;		///< Bytes sent to the client
+	uint64_t busyNs;		///< Time spent erasing and programming
+} SimStats;
+
+/// Emulated cartridge
+typedef struct {
+	const FlashGeom *chip;	///< Flash chip geometry
+	uint8_t *flash;			///< Flash contents
+	uint32_t timeScale;		///< Flash timing scale, in percent
+	uint8_t minor;			///< Reported bootloader minor version
+	uint64_t startNs;		///< Startup time after accepting a connection
+	CartState st;			///< Processing state
+	WfBuf cmd;				///< Command being received
+	uint16_t got;			///< Command bytes received
+	uint32_t addr;			///< Address of the running program/read
+	uint32_t remain;		///< Bytes left of the running program/read
+	uint32_t lzLen;			///< Decompressed length of the compressed payload
+	uint32_t zLen;			///< Length of the compressed payload
+	uint32_t zGot;			///< Compressed payload bytes received
+	LzDec lz;				///< Decompression progress
+	uint8_t *z;				///< Compressed payload
+	uint8_t *unlz;			///< Decompressed payload
+	uint8_t reply[WF_HEADLEN + WF_MAX_DATALEN];	///< Pending reply
+	uint16_t replyLen;		///< Length of the pending reply
+	uint64_t busy;			///< Flash busy until this time
+	uint64_t progNs;		///< Program time not yet accounted (fractions)
+	SimStats stats;			///< Session statistics
+	int verbose;			///< Log every command
+} SimCart;
+
+/// Command names, for logging
+static const char * const cmdName[WF_CMD_MAX] = {
+	"VERSION_GET", "ECHO", "ID_GET", "ERASE", "PROGRAM", "READ", "RUN",
+	"AUTORUN", "CRC32", "PROGRAM_LZ"
+};
+
+/// Set when a termination signal is received
+static volatile sig_atomic_t quit = FALSE;
+/// Signal mask while waiting. Termination signals are blocked otherwise, so
+/// they cannot be lost between checking quit and waiting.
+static sigset_t waitMask;
+
+/// Long command-line options
+static const struct option opt[] = {
+	{"port",		required_argument,	NULL,	'p'},
+	{"chip",		required_argument,	NULL,	'c'},
+	{"rtt",			required_argument,	NULL,	'r'},
+	{"bandwidth",	required_argument,	NULL,	'b'},
+	{"mss",			required_argument,	NULL,	'm'},
+	{"gap",			required_argument,	NULL,	'g'},
+	{"window",		required_argument,	NULL,	'W'},
+	{"time-scale",	required_argument,	NULL,	't'},
+	{"image",		required_argument,	NULL,	'i'},
+	{"output",		required_argument,	NULL,	'o'},
+	{"once",		no_argument,		NULL,	'1'},
+	{"legacy",		no_argument,		NULL,	'l'},
+	{"startup",		required_argument,	NULL,	's'},
+	{"verbose",		no_argument,		NULL,	'v'},
+	{"version",		no_argument,		NULL,	'V'},
+	{"help",		no_argument,		NULL,	'h'},
+	{NULL,			0,					NULL,	0}
+};
+
+/// Descriptions of the command-line options
+static const char *description[] = {
+	"Listen port (default 1989)",
+	"Flash chip IDs, e.g. 01:7E:1A:00 (default S29GL032N bottom boot)",
+	"Round trip time in ms (default 0)",
+	"Bandwidth cap in KiB/s (default 0, no cap)",
+	"Packet size in bytes (default 1460)",
+	"Minimum gap between packets in us (default 0)",
+	"Receive window in bytes, at least 1444 (default 5840)",
+	"Flash timing scale in percent, 0 disables (default 100)",
+	"Load flash contents from file",
+	"Save flash contents to file when each session ends",
+	"Serve a single session and exit",
+	"Emulate a version 0.1 bootloader, without the CRC32 and PROGRAM_LZ "
+		"commands",
+	"Startup time in ms: data received during it is lost (default 0)",
+	"Log every command",
+	"Show program version",
+	"Print help screen and exit"
+};
+
+// Returns the monotonic time in ns.
+static uint64_t Now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * SIM_NS + ts.tv_nsec;
+}
+
+static void SigHandler(int sig) {
+	quit = TRUE;
+}
+
+static void PrintVersion(char prgName[]) {
+	printf("%s version %d.%d, doragasu 2017.\n", prgName,
+			VERSION_MAJOR, VERSION_MINOR);
+}
+
+static void PrintHelp(char *prgName) {
+	int i;
+
+	PrintVersion(prgName);
+	printf("Usage: %s [OPTIONS [OPTION_ARG]]\nSupported options:\n\n",
+			prgName);
+	for (i = 0; opt[i].name; i++) {
+		printf(" -%c, --%s%s: %s.\n", opt[i].val, opt[i].name,
+				opt[i].has_arg == required_argument?" <arg>":"",
+				description[i]);
+	}
+	printf("\nRun wflash with -a 127.0.0.1 to connect to the emulated "
+			"cartridge.\n");
+}
+
+/************************************************************************//**
+ * Initializes a link direction.
+ *
+ * \param[out] l   Link to initialize.
+ * \param[in]  cfg Link parameters.
+ *
+ * \return 0 if OK, nonzero if the link buffer could not be allocated.
+ ****************************************************************************/
+static int LinkInit(SimLink *l, const SimLinkCfg *cfg) {
+	memset(l, 0, sizeof(SimLink));
+	l->cfg = cfg;
+	return !(l->buf = malloc(cfg->window));
+}
+
+static void LinkFree(SimLink *l) {
+	free(l->buf);
+	l->buf = NULL;
+}
+
+// Free space in the link, in bytes.
+static inline uint32_t LinkSpace(const SimLink *l) {
+	uint32_t segs = (SIM_LINK_SEGS - l->segCount) * l->cfg->mss;
+
+	return MIN(l->cfg->window - l->len, segs);
+}
+
+/************************************************************************//**
+ * Puts data in the link. Data is split in packets that are serialized at
+ * the link bandwidth and delivered half a RTT later.
+ *
+ * \param[in] l    Link.
+ * \param[in] data Data to put.
+ * \param[in] len  Length of the data.
+ * \param[in] now  Current time.
+ *
+ * \return Number of bytes accepted, limited by the free link space.
+ ****************************************************************************/
+static uint32_t LinkPut(SimLink *l, const uint8_t *data, uint32_t len,
+		uint64_t now) {
+	const SimLinkCfg *c = l->cfg;
+	uint32_t tail, pos, toCopy, pkt;
+	SimSeg *s;
+
+	len = MIN(len, LinkSpace(l));
+	// Copy to the FIFO, wrapping around the end
+	tail = (l->head + l->len) % c->window;
+	for (pos = 0; pos < len; pos += toCopy) {
+		toCopy = MIN(len - pos, c->window - tail);
+		memcpy(l->buf + tail, data + pos, toCopy);
+		tail = (tail + toCopy) % c->window;
+	}
+	l->len += len;
+	// Split in packets
+	for (pos = 0; pos < len; pos += pkt) {
+		pkt = MIN(len - pos, c->mss);
+		l->txFree = MAX(now, l->txFree) + pkt * c->byteNs;
+		s = &l->seg[(l->segHead + l->segCount) % SIM_LINK_SEGS];
+		s->len = pkt;
+		s->due = l->txFree + c->halfRtt;
+		l->segCount++;
+		l->txFree += c->gapNs;
+	}
+
+	return len;
+}
+
+// Delivers the segments due by now.
+static void LinkUpdate(SimLink *l, uint64_t now) {
+	SimSeg *s;
+
+	while (l->segCount && (s = &l->seg[l->segHead])->due <= now) {
+		l->ready += s->len;
+		l->segHead = (l->segHead + 1) % SIM_LINK_SEGS;
+		l->segCount--;
+	}
+}
+
+// Time at which the next segment is delivered.
+static inline uint64_t LinkDue(const SimLink *l) {
+	return l->segCount?l->seg[l->segHead].due:SIM_NEVER;
+}
+
+// Obtains the contiguous delivered data at the head of the link.
+static inline uint32_t LinkPeek(const SimLink *l, uint8_t **data) {
+	*data = l->buf + l->head;
+	return MIN(l->ready, l->cfg->window - l->head);
+}
+
+// Removes delivered data from the head of the link.
+static inline void LinkDrop(SimLink *l, uint32_t len) {
+	l->head = (l->head + len) % l->cfg->window;
+	l->len -= len;
+	l->ready -= len;
+}
+
+// Adds flash busy time, scaled by the configured factor.
+static void CartBusy(SimCart *c, uint64_t ns, uint64_t now) {
+	ns = ns * c->timeScale / 100;
+	c->busy = MAX(c->busy, now) + ns;
+	c->stats.busyNs += ns;
+}
+
+// Queues a reply. Replies are sent once the flash is not busy.
+static void CartReply(SimCart *c, uint16_t code, const void *data,
+		uint16_t len) {
+	uint16_t head[2] = {code, len};
+
+	memcpy(c->reply, head, WF_HEADLEN);
+	if (len) memcpy(c->reply + WF_HEADLEN, data, len);
+	c->replyLen = WF_HEADLEN + len;
+}
+
+// Checks a memory range is inside the flash chip.
+static int CartRangeOk(const SimCart *c, uint32_t addr, uint32_t len) {
+	return (addr < c->chip->capacity) && (len <= c->chip->capacity - addr);
+}
+
+// Erases the sectors covering a memory range.
+static void CartErase(SimCart *c, uint32_t addr, uint32_t len, uint64_t now) {
+	FlashErase op;
+
+	if (FlashGeomPlan(c->chip, addr, len, 0, &op, 1) != 1) return;
+	memset(c->flash + op.addr, 0xFF, op.len);
+	c->stats.erases += op.sects;
+	CartBusy(c, (uint64_t)op.ms * 1000000, now);
+}
+
+// Computes the CRCs of the blocks of a range, and queues them as reply.
+// Returns FALSE if the arguments are not valid.
+static int CartCrc(SimCart *c, const WfCrcRange *r, uint16_t argLen) {
+	uint32_t crc[WF_CRC32_MAX];
+	uint32_t n, off, len;
+
+	if ((argLen < sizeof(WfCrcRange)) || !r->blockLen ||
+			!CartRangeOk(c, r->addr, r->len)) return FALSE;
+	n = (r->len + r->blockLen - 1) / r->blockLen;
+	if (n > WF_CRC32_MAX) return FALSE;
+	for (off = 0, n = 0; off < r->len; off += len) {
+		len = MIN(r->blockLen, r->len - off);
+		crc[n++] = Crc32(0, c->flash + r->addr + off, len);
+	}
+	CartReply(c, WF_CMD_OK, crc, n * sizeof(uint32_t));
+
+	return TRUE;
+}
+
+// Executes a completely received command.
+static void CartExec(SimCart *c, uint64_t now) {
+	const WfCmd *cmd = &c->cmd.cmd;
+	const int hasRange = cmd->len >= sizeof(WfMemRange);
+	const uint32_t addr = cmd->mem.addr;
+	const uint32_t len = cmd->mem.len;
+
+	c->stats.cmds++;
+	if (c->verbose) {
+		if (cmd->cmd < WF_CMD_MAX) {
+			printf("%s", cmdName[cmd->cmd]);
+		} else printf("UNKNOWN (%d)", cmd->cmd);
+		if (hasRange) printf(" 0x%06X:%X", addr, len);
+		putchar('\n');
+	}
+	switch (cmd->cmd) {
+		case WF_CMD_VERSION_GET:
+			CartReply(c, WF_CMD_OK, (uint8_t[2]){WF_VERSION_MAJOR,
+					c->minor}, 2);
+			break;
+
+		case WF_CMD_ECHO:
+			CartReply(c, WF_CMD_OK, cmd->data, cmd->len);
+			break;
+
+		case WF_CMD_ID_GET:
+			CartReply(c, WF_CMD_OK, c->chip->ids, 4);
+			break;
+
+		case WF_CMD_ERASE:
+			if (!hasRange || !CartRangeOk(c, addr, len)) goto err;
+			CartErase(c, addr, len, now);
+			CartReply(c, WF_CMD_OK, NULL, 0);
+			break;
+
+		case WF_CMD_PROGRAM:
+		case WF_CMD_READ:
+			if (!hasRange || !CartRangeOk(c, addr, len)) goto err;
+			c->addr = addr;
+			c->remain = len;
+			if (len) c->st = cmd->cmd == WF_CMD_PROGRAM?
+				CART_PROGRAM:CART_READ;
+			CartReply(c, WF_CMD_OK, NULL, 0);
+			break;
+
+		case WF_CMD_PROGRAM_LZ:
+			if (c->minor < WF_LZ_MINOR || cmd->len < sizeof(WfLzRange) ||
+					!len || len > WF_LZ_CHUNK_MAX || !cmd->lz.zLen ||
+					cmd->lz.zLen > WF_LZ_CHUNK_MAX ||
+					!CartRangeOk(c, addr, len)) goto err;
+			c->addr = addr;
+			c->lzLen = len;
+			c->zLen = cmd->lz.zLen;
+			c->zGot = 0;
+			memset(&c->lz, 0, sizeof(LzDec));
+			c->st = CART_PROGRAM_LZ;
+			CartReply(c, WF_CMD_OK, NULL, 0);
+			break;
+
+		case WF_CMD_CRC32:
+			if (c->minor < WF_CRC32_MINOR ||
+					!CartCrc(c, &cmd->crc, cmd->len)) goto err;
+			break;
+
+		case WF_CMD_RUN:
+			if (cmd->len < sizeof(uint32_t)) goto err;
+			// fallthrough
+		case WF_CMD_AUTORUN:
+			c->st = CART_RUN;
+			CartReply(c, WF_CMD_OK, NULL, 0);
+			break;
+
+		default:
+			goto err;
+	}
+	return;
+
+err:
+	if (c->verbose) printf("  -> ERROR\n");
+	CartReply(c, WF_CMD_ERROR, NULL, 0);
+}
+
+// Writes data to the flash at the running program address. Flash can only
+// clear bits.
+static void CartWrite(SimCart *c, const uint8_t *data, uint32_t len,
+		uint64_t now) {
+	uint8_t *dst = c->flash + c->addr;
+	uint64_t ns;
+	uint32_t i;
+
+	for (i = 0; i < len; i++) dst[i] &= data[i];
+	c->addr += len;
+	c->stats.progBytes += len;
+	// Flash is programmed in 16-bit words, keep fractions for later
+	ns = c->progNs + (uint64_t)len * c->chip->progUs * 1000 / 2;
+	c->progNs = ns % 1000;
+	CartBusy(c, ns - c->progNs, now);
+}
+
+// Programs received payload.
+static void CartProgram(SimCart *c, const uint8_t *data, uint32_t len,
+		uint64_t now) {
+	CartWrite(c, data, len, now);
+	c->remain -= len;
+	if (!c->remain) c->st = CART_CMD;
+}
+
+// Receives compressed payload, decompressing and programming the complete
+// sequences as they arrive, like the bootloader does. Returns TRUE if the
+// payload is corrupt.
+static int CartProgramLz(SimCart *c, const uint8_t *data, uint32_t len,
+		uint64_t now) {
+	uint32_t done = c->lz.out;
+	int st;
+
+	memcpy(c->z + c->zGot, data, len);
+	c->zGot += len;
+	st = LzDecode(&c->lz, c->z, c->zGot, c->zLen, c->unlz, c->lzLen);
+	if ((st < 0) || ((st == 1) && (c->lz.out != c->lzLen))) {
+		PrintErr("Corrupt compressed data at 0x%06X, dropping session.\n",
+				c->addr);
+		return TRUE;
+	}
+	if (c->lz.out > done) {
+		CartBusy(c, (uint64_t)(c->lz.out - done) * SIM_LZ_NS, now);
+		CartWrite(c, c->unlz + done, c->lz.out - done, now);
+	}
+	c->stats.lzBytes += len;
+	if (st) {
+		c->stats.unlzBytes += c->lzLen;
+		c->st = CART_CMD;
+	}
+	return FALSE;
+}
+
+/************************************************************************//**
+ * Runs the cartridge until it has to wait for data, link space or the
+ * flash to be ready.
+ *
+ * \param[in] c    Cartridge.
+ * \param[in] up   Link from the client.
+ * \param[in] down Link to the client.
+ * \param[in] now  Current time.
+ *
+ * \return TRUE when the session has to be dropped because of a protocol
+ * error, FALSE otherwise.
+ ****************************************************************************/
+static int CartStep(SimCart *c, SimLink *up, SimLink *down, uint64_t now) {
+	uint8_t *data;
+	uint32_t avail, n;
+	uint16_t need;
+
+	while (now >= c->busy) {
+		if (c->replyLen) {
+			if (LinkSpace(down) < c->replyLen) break;
+			LinkPut(down, c->reply, c->replyLen, now);
+			c->replyLen = 0;
+		}
+		switch (c->st) {
+			case CART_CMD:
+				if (!(avail = LinkPeek(up, &data))) return FALSE;
+				need = c->got < WF_HEADLEN?WF_HEADLEN:
+					WF_HEADLEN + c->cmd.cmd.len;
+				n = MIN(avail, need - c->got);
+				memcpy(c->cmd.data + c->got, data, n);
+				LinkDrop(up, n);
+				c->got += n;
+				if (c->got == WF_HEADLEN && c->cmd.cmd.len >
+						(WF_MAX_DATALEN - WF_HEADLEN)) {
+					PrintErr("Command too long (%d bytes), dropping "
+							"session.\n", c->cmd.cmd.len);
+					return TRUE;
+				}
+				if (c->got >= WF_HEADLEN &&
+						c->got == WF_HEADLEN + c->cmd.cmd.len) {
+					CartExec(c, now);
+					c->got = 0;
+				}
+				break;
+
+			case CART_PROGRAM:
+				if (!(avail = LinkPeek(up, &data))) return FALSE;
+				n = MIN(avail, c->remain);
+				CartProgram(c, data, n, now);
+				LinkDrop(up, n);
+				break;
+
+			case CART_PROGRAM_LZ:
+				if (!(avail = LinkPeek(up, &data))) return FALSE;
+				n = MIN(avail, c->zLen - c->zGot);
+				if (CartProgramLz(c, data, n, now)) return TRUE;
+				LinkDrop(up, n);
+				break;
+
+			case CART_READ:
+				n = MIN(MIN(c->remain, SIM_READ_CHUNK), LinkSpace(down));
+				if (!n) return FALSE;
+				LinkPut(down, c->flash + c->addr, n, now);
+				c->addr += n;
+				c->remain -= n;
+				c->stats.readBytes += n;
+				if (!c->remain) c->st = CART_CMD;
+				break;
+
+			case CART_RUN:
+				return FALSE;
+		}
+	}
+
+	return FALSE;
+}
+
+/************************************************************************//**
+ * Serves a client connection until it is closed or a boot is requested.
+ * When the client closes the connection, data already sent by the client
+ * is still processed before ending the session, as the cartridge would.
+ *
+ * \param[in] c   Cartridge.
+ * \param[in] cfg Link parameters.
+ * \param[in] s   Client socket.
+ ****************************************************************************/
+static void Session(SimCart *c, const SimLinkCfg *cfg, int s) {
+	SimLink up = {0}, down = {0};
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t now, start, next;
+	uint8_t *data;
+	uint8_t *rx = NULL;
+	ssize_t n;
+	uint32_t avail, sent;
+	int eof = FALSE;
+
+	if (LinkInit(&up, cfg) || LinkInit(&down, cfg) ||
+			!(rx = malloc(cfg->window))) {
+		perror("Allocating link buffers");
+		free(rx);
+		LinkFree(&up);
+		LinkFree(&down);
+		return;
+	}
+	memset(&c->stats, 0, sizeof(SimStats));
+	c->st = CART_CMD;
+	c->got = c->replyLen = 0;
+	c->busy = c->progNs = 0;
+	start = Now();
+
+	while (!quit) {
+		now = Now();
+		LinkUpdate(&up, now);
+		LinkUpdate(&down, now);
+		if (CartStep(c, &up, &down, now)) break;
+		// Send delivered data to the client
+		sent = 0;
+		while ((avail = LinkPeek(&down, &data))) {
+			if ((n = send(s, data, avail, MSG_DONTWAIT | MSG_NOSIGNAL)) <= 0) {
+				if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+					goto out;
+				}
+				break;
+			}
+			LinkDrop(&down, n);
+			c->stats.bytesOut += n;
+			sent += n;
+		}
+		// Bootloader shuts down once the boot reply reaches the client
+		if (c->st == CART_RUN && !c->replyLen && !down.len) break;
+		// Client is gone and everything it sent has been processed
+		if (eof && !up.len && now >= c->busy) break;
+		// Sending frees link space the cartridge could be waiting for
+		if (sent) continue;
+
+		// Wait for data, socket space, a segment or the flash
+		pfd.fd = s;
+		pfd.events = (!eof && LinkSpace(&up)?POLLIN:0) |
+			(down.ready?POLLOUT:0);
+		pfd.revents = 0;
+		next = MIN(LinkDue(&up), LinkDue(&down));
+		if (c->busy > now) next = MIN(next, c->busy);
+		if (next != SIM_NEVER) {
+			next = next > now?next - now:0;
+			ts.tv_sec = next / SIM_NS;
+			ts.tv_nsec = next % SIM_NS;
+		}
+		if (ppoll(&pfd, 1, next == SIM_NEVER?NULL:&ts, &waitMask) < 0) {
+			if (errno != EINTR) perror("poll");
+			continue;
+		}
+		if (pfd.revents & (POLLERR | POLLNVAL)) break;
+		if (!eof && (pfd.revents & (POLLIN | POLLHUP))) {
+			n = recv(s, rx, LinkSpace(&up), MSG_DONTWAIT);
+			if (!n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+				eof = TRUE;
+			} else if (n > 0 && (now = Now()) - start >= c->startNs) {
+				LinkPut(&up, rx, n, now);
+				c->stats.bytesIn += n;
+			} else if (n > 0 && c->verbose) {
+				printf("Starting, %zd bytes lost\n", n);
+			}
+		}
+	}
+
+out:
+	now = Now() - start;
+	printf("Session ended: %u commands, %u sectors erased, %llu bytes "
+			"programmed, %llu bytes read.\n", c->stats.cmds,
+			c->stats.erases, (unsigned long long)c->stats.progBytes,
+			(unsigned long long)c->stats.readBytes);
+	printf("Link: %llu bytes in, %llu bytes out in %.3f s, flash busy "
+			"%.3f s.\n", (unsigned long long)c->stats.bytesIn,
+			(unsigned long long)c->stats.bytesOut, (double)now / SIM_NS,
+			(double)c->stats.busyNs / SIM_NS);
+	if (c->stats.lzBytes) {
+		printf("Compressed: %llu bytes received, %llu decompressed "
+				"(%.2f:1).\n", (unsigned long long)c->stats.lzBytes,
+				(unsigned long long)c->stats.unlzBytes,
+				(double)c->stats.unlzBytes / c->stats.lzBytes);
+	}
+	free(rx);
+	LinkFree(&up);
+	LinkFree(&down);
+}
+
+// Parses chip IDs in "XX:XX[:XX[:XX]]" format.
+static int ParseIds(const char *str, uint8_t ids[4]) {
+	unsigned int val[4] = {0};
+	int n;
+
+	n = sscanf(str, "%x:%x:%x:%x", &val[0], &val[1], &val[2], &val[3]);
+	if (n < 2) return 1;
+	for (n = 0; n < 4; n++) {
+		if (val[n] > 0xFF) return 1;
+		ids[n] = val[n];
+	}
+	return 0;
+}
+
+// Saves the flash contents to a file.
+static int FlashSave(const SimCart *c, const char *file) {
+	FILE *f;
+	int err;
+
+	if (!(f = fopen(file, "wb"))) {
+		perror(file);
+		return 1;
+	}
+	err = fwrite(c->flash, c->chip->capacity, 1, f) != 1;
+	if (err) perror(file);
+	fclose(f);
+	return err;
+}
+
+// Loads a file to the start of the flash.
+static int FlashLoad(SimCart *c, const char *file) {
+	FILE *f;
+	size_t len;
+
+	if (!(f = fopen(file, "rb"))) {
+		perror(file);
+		return 1;
+	}
+	len = fread(c->flash, 1, c->chip->capacity, f);
+	fclose(f);
+	printf("Loaded %zu bytes from %s.\n", len, file);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	SimLinkCfg cfg = {0, 0, 0, SIM_DEF_MSS, SIM_DEF_WINDOW};
+	SimCart cart;
+	uint8_t ids[4];
+	long port = SIM_DEF_PORT;
+	long val;
+	double fval;
+	const char *image = NULL;
+	const char *output = NULL;
+	int once = FALSE;
+	struct sockaddr_in addr;
+	struct sigaction sa;
+	struct pollfd pfd;
+	sigset_t sigs;
+	int ls, s, c;
+	int flag = 1;
+	int rcvBuf;
+	char *endPtr;
+
+	memset(&cart, 0, sizeof(SimCart));
+	memcpy(ids, defIds, sizeof(ids));
+	cart.timeScale = 100;
+	cart.minor = WF_VERSION_MINOR;
+
+	while ((c = getopt_long(argc, argv, "p:c:r:b:m:g:W:t:i:o:1ls:vVh", opt,
+					NULL)) != -1) {
+		switch (c) {
+			case 'p':
+				port = strtol(optarg, &endPtr, 0);
+				if (*endPtr != '\0' || port <= 0 || port > 65535) {
+					PrintErr("Invalid port %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'c':
+				if (ParseIds(optarg, ids)) {
+					PrintErr("Invalid chip IDs %s!\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'r':
+			case 'g':
+			case 's':
+				fval = strtod(optarg, &endPtr);
+				if (*endPtr != '\0' || fval < 0) {
+					PrintErr("Invalid time %s!\n", optarg);
+					return 1;
+				}
+				if (c == 'r') cfg.halfRtt = fval * 1000000 / 2;
+				else if (c == 'g') cfg.gapNs = fval * 1000;
+				else cart.startNs = fval * 1000000;
+				break;
+
+			case 'b':
+				fval = strtod(optarg, &endPtr);
+				if (*endPtr != '\0' || fval < 0) {
+					PrintErr("Invalid bandwidth %s!\n", optarg);
+					return 1;
+				}
+				cfg.byteNs = fval?SIM_NS / (fval * 1024):0;
+				break;
+
+			case 'm':
+			case 'W':
+			case 't':
+				val = strtol(optarg, &endPtr, 0);
+				// The window must hold a full command or reply
+				if (*endPtr != '\0' || val < 0 || val > 16 * 1024 * 1024 ||
+						(c == 'm' && val < WF_HEADLEN) ||
+						(c == 'W' && val < WF_HEADLEN + WF_MAX_DATALEN)) {
+					PrintErr("Invalid value %s!\n", optarg);
+					return 1;
+				}
+				if (c == 'm') cfg.mss = val;
+				else if (c == 'W') cfg.window = val;
+				else cart.timeScale = val;
+				break;
+
+			case 'i':
+				image = optarg;
+				break;
+
+			case 'o':
+				output = optarg;
+				break;
+
+			case '1':
+				once = TRUE;
+				break;
+
+			case 'l':
+				cart.minor = 0x01;
+				break;
+
+			case 'v':
+				cart.verbose = TRUE;
+				break;
+
+			case 'V':
+				PrintVersion(argv[0]);
+				return 0;
+
+			case 'h':
+				PrintHelp(argv[0]);
+				return 0;
+
+			default:
+				return 1;
+		}
+	}
+	if (optind < argc) {
+		PrintErr("Unsupported parameter: %s\n", argv[optind]);
+		return 1;
+	}
+
+	if (!(cart.chip = FlashGeomFind(ids))) {
+		PrintErr("Unknown flash chip %02X:%02X:%02X:%02X!\n", ids[0], ids[1],
+				ids[2], ids[3]);
+		return 1;
+	}
+	if (!(cart.flash = malloc(cart.chip->capacity)) ||
+			!(cart.z = malloc(WF_LZ_CHUNK_MAX)) ||
+			!(cart.unlz = malloc(WF_LZ_CHUNK_MAX))) {
+		perror("Allocating flash");
+		return 1;
+	}
+	memset(cart.flash, 0xFF, cart.chip->capacity);
+	if (image && FlashLoad(&cart, image)) return 1;
+
+	if ((ls = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(int));
+	// Keep the kernel from buffering much more than the cart would
+	rcvBuf = cfg.window;
+	setsockopt(ls, SOL_SOCKET, SO_RCVBUF, &rcvBuf, sizeof(int));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(ls, (struct sockaddr*)&addr, sizeof(addr)) || listen(ls, 1)) {
+		perror("Listening");
+		close(ls);
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SigHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, &waitMask);
+	printf("Emulating %s on port %ld, RTT %.3f ms, %s.\n", cart.chip->name,
+			port, (double)cfg.halfRtt * 2 / 1000000, cfg.byteNs?
+			"bandwidth capped":"unlimited bandwidth");
+	fflush(stdout);
+
+	// The bootloader restarts after each RUN, so keep accepting sessions
+	while (!quit) {
+		pfd.fd = ls;
+		pfd.events = POLLIN;
+		if (ppoll(&pfd, 1, NULL, &waitMask) < 0) {
+			if (errno != EINTR) perror("poll");
+			continue;
+		}
+		if ((s = accept(ls, NULL, NULL)) < 0) {
+			perror("accept");
+			continue;
+		}
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+		Session(&cart, &cfg, s);
+		close(s);
+		if (output) FlashSave(&cart, output);
+		fflush(stdout);
+		if (once) break;
+	}
+
+	close(ls);
+	free(cart.unlz);
+	free(cart.z);
+	free(cart.flash);
+
+	return 0;
+}
+
+/** \} */
@@ -0,0 +1,199 @@
+/************************************************************************//**
+ * stats: Session statistics reports, as a human readable summary or as
+ * JSON.
+ ****************************************************************************/
+#include "stats.h"
+#include "util.h"
+#include <string.h>
+
+// Obtains the upper bound of a latency histogram bucket, in us.
+static inline uint64_t StatsBucketUs(unsigned int b) {
+	return (uint64_t)1 << b;
+}
+
+// Estimates a latency percentile from the histogram, as the upper bound of
+// the bucket holding it, in us.
+static uint64_t StatsPercentile(const WfCmdStats *c, unsigned int pct) {
+	uint64_t want = ((uint64_t)c->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	unsigned int b;
+
+	if (!c->count) return 0;
+	for (b = 0; b < WF_LAT_BUCKETS - 1; b++) {
+		if ((seen += c->hist[b]) >= want) break;
+	}
+	return MIN(StatsBucketUs(b), c->maxUs);
+}
+
+// Obtains a throughput in MB (10^6 bytes) per second.
+static inline double StatsMbps(uint64_t bytes, uint64_t us) {
+	return us?(double)bytes / us:0;
+}
+
+// Obtains the session time, in us.
+static uint64_t StatsSessionUs(const WfStats *s) {
+	return TimeUs() - s->startUs;
+}
+
+void StatsTcpPrint(const WfTcpStats *t, FILE *f) {
+	if (!t->samples) return;
+	fprintf(f, "TCP: rtt %.2f ms (min %.2f, max %.2f, var max %.2f), cwnd "
+			"%u (min %u), %u retransmits, %u segments in flight max, %u "
+			"bytes not sent max, send buffer %u.\n", t->rttSumUs / 1e3 /
+			t->samples, t->rttMinUs / 1e3, t->rttMaxUs / 1e3,
+			t->rttvarMaxUs / 1e3, t->cwnd, t->cwndMin, t->retrans,
+			t->unackedMax, t->notsentMax, t->sndBuf);
+}
+
+void StatsPrint(const WfStats *s, FILE *f) {
+	const WfPhase *p;
+	const WfCmdStats *c;
+	uint64_t us = StatsSessionUs(s);
+	unsigned int i, b;
+	const char *name;
+
+	fprintf(f, "Session: %.3f s, %llu flash bytes, %.3f MB/s, %u commands, "
+			"%u send and %u receive syscalls.\n", us / 1e6,
+			(unsigned long long)s->bytes, StatsMbps(s->bytes, us),
+			s->io.cmds, s->io.sendCalls, s->io.recvCalls);
+	StatsTcpPrint(&s->tcp, f);
+	if (s->prog.lzChunks) {
+		fprintf(f, "Program: %u of %u chunks compressed, %llu bytes sent "
+				"for %llu (%.2f:1).\n", s->prog.lzChunks, s->prog.chunks,
+				(unsigned long long)s->prog.sent,
+				(unsigned long long)s->prog.bytes,
+				(double)s->prog.bytes / s->prog.sent);
+	}
+	if (s->nPhases) {
+		fprintf(f, "%-10s %9s %10s %9s %6s %7s %7s %10s %10s\n", "Phase",
+				"Time (s)", "Bytes", "MB/s", "Cmds", "Sends", "Recvs",
+				"Sent", "Received");
+	}
+	for (i = 0; i < s->nPhases; i++) {
+		p = s->phase + i;
+		fprintf(f, "%-10s %9.3f %10llu %9.3f %6u %7u %7u %10u %10u\n",
+				p->name, p->us / 1e6, (unsigned long long)p->bytes,
+				StatsMbps(p->bytes, p->us), p->io.cmds, p->io.sendCalls,
+				p->io.recvCalls, p->io.bytesSent, p->io.bytesRecv);
+	}
+
+	fprintf(f, "%-10s %8s %10s %9s %9s %9s %9s\n", "Command", "Count",
+			"Bytes", "Avg (ms)", "p50 (ms)", "p99 (ms)", "Max (ms)");
+	for (i = 0; i < WF_STATS_CMDS; i++) {
+		c = s->cmd + i;
+		if (!c->count) continue;
+		name = WfCmdName(i);
+		fprintf(f, "%-10s %8u %10llu %9.3f %9.3f %9.3f %9.3f\n",
+				name?name:"unknown", c->count, (unsigned long long)c->bytes,
+				c->totalUs / 1e3 / c->count, StatsPercentile(c, 50) / 1e3,
+				StatsPercentile(c, 99) / 1e3, c->maxUs / 1e3);
+	}
+	// Histograms, skipping empty buckets
+	for (i = 0; i < WF_STATS_CMDS; i++) {
+		c = s->cmd + i;
+		if (!c->count) continue;
+		name = WfCmdName(i);
+		fprintf(f, "%s latency:", name?name:"unknown");
+		for (b = 0; b < WF_LAT_BUCKETS; b++) {
+			if (!c->hist[b]) continue;
+			if (b == WF_LAT_BUCKETS - 1) fprintf(f, " >=");
+			else fprintf(f, " <");
+			if (StatsBucketUs(b) < 1000) {
+				fprintf(f, "%lluus", (unsigned long long)StatsBucketUs(b));
+			} else fprintf(f, "%.fms", StatsBucketUs(b) / 1e3);
+			fprintf(f, ":%u", c->hist[b]);
+		}
+		fputc('\n', f);
+	}
+}
+
+// Writes transport statistics as a JSON object.
+static void StatsIoJson(const WfIoStats *io, FILE *f) {
+	fprintf(f, "{\"cmds\":%u,\"send_calls\":%u,\"recv_calls\":%u,"
+			"\"segments\":%u,\"bytes_sent\":%u,\"bytes_recv\":%u}", io->cmds,
+			io->sendCalls, io->recvCalls, io->segments, io->bytesSent,
+			io->bytesRecv);
+}
+
+void StatsJson(const WfStats *s, FILE *f) {
+	const WfPhase *p;
+	const WfCmdStats *c;
+	uint64_t us = StatsSessionUs(s);
+	unsigned int i, b;
+	const char *name, *sep;
+	int first;
+
+	fprintf(f, "{\"secs\":%.6f,\"bytes\":%llu,\"mb_per_s\":%.3f,\"io\":",
+			us / 1e6, (unsigned long long)s->bytes, StatsMbps(s->bytes, us));
+	StatsIoJson(&s->io, f);
+	if (s->tcp.samples) {
+		fprintf(f, ",\"tcp\":{\"samples\":%u,\"rtt_avg_us\":%.1f,"
+				"\"rtt_min_us\":%u,\"rtt_max_us\":%u,\"rttvar_max_us\":%u,"
+				"\"cwnd\":%u,\"cwnd_min\":%u,\"retrans\":%u,"
+				"\"unacked_max\":%u,\"notsent_max\":%u,\"sndbuf\":%u}",
+				s->tcp.samples, (double)s->tcp.rttSumUs / s->tcp.samples,
+				s->tcp.rttMinUs, s->tcp.rttMaxUs, s->tcp.rttvarMaxUs,
+				s->tcp.cwnd, s->tcp.cwndMin, s->tcp.retrans,
+				s->tcp.unackedMax, s->tcp.notsentMax, s->tcp.sndBuf);
+	}
+	if (s->prog.chunks) {
+		fprintf(f, ",\"prog\":{\"chunks\":%u,\"lz_chunks\":%u,"
+				"\"bytes\":%llu,\"sent\":%llu,\"ratio\":%.3f}",
+				s->prog.chunks, s->prog.lzChunks,
+				(unsigned long long)s->prog.bytes,
+				(unsigned long long)s->prog.sent, s->prog.sent?
+				(double)s->prog.bytes / s->prog.sent:0);
+	}
+	fprintf(f, ",\"phases\":[");
+	for (i = 0; i < s->nPhases; i++) {
+		p = s->phase + i;
+		fprintf(f, "%s{\"name\":\"%s\",\"secs\":%.6f,\"bytes\":%llu,"
+				"\"mb_per_s\":%.3f,\"io\":", i?",":"", p->name, p->us / 1e6,
+				(unsigned long long)p->bytes, StatsMbps(p->bytes, p->us));
+		StatsIoJson(&p->io, f);
+		fputc('}', f);
+	}
+	// Histogram buckets are given as [upper bound in us, count] pairs
+	fprintf(f, "],\"commands\":[");
+	for (i = 0, first = TRUE; i < WF_STATS_CMDS; i++) {
+		c = s->cmd + i;
+		if (!c->count) continue;
+		name = WfCmdName(i);
+		fprintf(f, "%s{\"cmd\":\"%s\",\"count\":%u,\"bytes\":%llu,"
+				"\"avg_us\":%.1f,\"p50_us\":%llu,\"p99_us\":%llu,"
+				"\"max_us\":%u,\"hist\":[", first?"":",", name?name:"unknown",
+				c->count, (unsigned long long)c->bytes,
+				(double)c->totalUs / c->count,
+				(unsigned long long)StatsPercentile(c, 50),
+				(unsigned long long)StatsPercentile(c, 99), c->maxUs);
+		first = FALSE;
+		for (b = 0, sep = ""; b < WF_LAT_BUCKETS; b++) {
+			if (!c->hist[b]) continue;
+			fprintf(f, "%s[%llu,%u]", sep, (unsigned long long)
+					(b == WF_LAT_BUCKETS - 1?c->maxUs:StatsBucketUs(b)),
+					c->hist[b]);
+			sep = ",";
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "]}\n");
+}
+
+int StatsWrite(const WfStats *s, const char *dest) {
+	FILE *f;
+
+	if (!strcmp(dest, "text")) StatsPrint(s, stdout);
+	else if (!strcmp(dest, "json")) StatsJson(s, stdout);
+	else {
+		if (!(f = fopen(dest, "w"))) {
+			perror(dest);
+			return 1;
+		}
+		StatsJson(s, f);
+		if (fclose(f)) {
+			perror(dest);
+			return 1;
+		}
+	}
+	return 0;
+}
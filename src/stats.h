@@ -0,0 +1,61 @@
+/************************************************************************//**
+ * \brief Session statistics reports.
+ *
+ * Formats the statistics gathered by the wflash module during a session
+ * (WfStatsGet()): the time, throughput and transport costs of each phase,
+ * the latency of each command type, with its histogram, and the TCP
+ * connection state sampled from the kernel. Reports are
+ * either a human readable summary or a JSON object, so runs can be
+ * compared to tell if a chunk length or pipelining change helped.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Stats stats
+ * \{
+ ****************************************************************************/
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include "wflash.h"
+
+/************************************************************************//**
+ * Prints a human readable summary of the session statistics.
+ *
+ * \param[in] s Session statistics.
+ * \param[in] f Output stream.
+ ****************************************************************************/
+void StatsPrint(const WfStats *s, FILE *f);
+
+/************************************************************************//**
+ * Prints a line with the TCP connection statistics, if sampled.
+ *
+ * \param[in] t TCP connection statistics.
+ * \param[in] f Output stream.
+ ****************************************************************************/
+void StatsTcpPrint(const WfTcpStats *t, FILE *f);
+
+/************************************************************************//**
+ * Writes the session statistics as a JSON object, on a single line.
+ *
+ * \param[in] s Session statistics.
+ * \param[in] f Output stream.
+ ****************************************************************************/
+void StatsJson(const WfStats *s, FILE *f);
+
+/************************************************************************//**
+ * Reports the session statistics.
+ *
+ * \param[in] s    Session statistics.
+ * \param[in] dest "text" to print a summary, "json" to print them as
+ *                 JSON, or the name of a file to write them to as JSON.
+ *
+ * \return 0 if OK, nonzero if the file could not be written.
+ ****************************************************************************/
+int StatsWrite(const WfStats *s, const char *dest);
+
+#endif /*_STATS_H_*/
+
+/** \} */
@@ -0,0 +1,229 @@
+/************************************************************************//**
+ * stream: Streams a file in fixed size chunks, using a small ring of chunk
+ * buffers filled by a reader thread.
+ ****************************************************************************/
+#include "stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "rom_head.h"
+#include "lz.h"
+#include "trace.h"
+#include "util.h"
+
+/// Stream data structure.
+struct Stream {
+	FILE *f;						///< Streamed file
+	uint8_t *buf;					///< Chunk buffers (STREAM_SLOTS chunks)
+	uint8_t *zBuf;					///< Compressed chunks, NULL if disabled
+	uint32_t len;					///< Number of bytes to stream
+	uint32_t chunkLen;				///< Length of each chunk
+	uint32_t zMax;					///< Longest compressed chunk worth it
+	uint32_t slotLen[STREAM_SLOTS];	///< Length of the data in each slot
+	uint32_t zLen[STREAM_SLOTS];	///< Length of each compressed chunk
+	uint8_t head;					///< Slot of the next chunk to consume
+	uint8_t filled;					///< Number of slots ready to consume
+	uint8_t patchHead;				///< Patch ROM header in first chunk
+	uint8_t done;					///< Reader finished (end of data or error)
+	uint8_t stop;					///< Consumer requested the reader to stop
+	uint8_t error;					///< Read error
+	pthread_t reader;				///< Reader thread
+	pthread_mutex_t lock;			///< Protects the ring state
+	pthread_cond_t ready;			///< Signalled when a slot is filled
+	pthread_cond_t freed;			///< Signalled when a slot is released
+};
+
+// Reader thread: fills free ring slots with consecutive file chunks, and
+// compresses them if enabled.
+static void *StreamReader(void *arg) {
+	Stream *s = (Stream*)arg;
+	uint32_t pos, toRead;
+	uint8_t tail = 0;
+	uint8_t *slot;
+	uint64_t startUs;
+	int stop;
+
+	TraceThreadName("stream reader");
+	for (pos = 0; pos < s->len; pos += toRead) {
+		pthread_mutex_lock(&s->lock);
+		while (s->filled == STREAM_SLOTS && !s->stop) {
+			pthread_cond_wait(&s->freed, &s->lock);
+		}
+		stop = s->stop;
+		pthread_mutex_unlock(&s->lock);
+		if (stop) break;
+
+		// Slot is not visible to the consumer until filled is incremented
+		toRead = MIN(s->chunkLen, s->len - pos);
+		slot = s->buf + tail * s->chunkLen;
+		if (fread(slot, toRead, 1, s->f) != 1) {
+			s->error = TRUE;
+			break;
+		}
+		if (!pos && s->patchHead) RomHeadPatch(slot);
+		// Chunks not compressing below zMax are sent raw
+		if (s->zBuf) {
+			startUs = TimeUs();
+			s->zLen[tail] = LzCompress(slot, toRead, s->zBuf + tail * s->zMax,
+					toRead - toRead / STREAM_LZ_SAVING);
+			TraceSpan("cpu", "compress", startUs, pos, toRead);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->slotLen[tail] = toRead;
+		s->filled++;
+		pthread_cond_signal(&s->ready);
+		pthread_mutex_unlock(&s->lock);
+		tail = (tail + 1) % STREAM_SLOTS;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	s->done = TRUE;
+	pthread_cond_signal(&s->ready);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/************************************************************************//**
+ * Opens a file for streaming, and starts the reader thread.
+ *
+ * \param[in] file      Name of the file to stream.
+ * \param[in] len       Number of bytes to stream from the file start.
+ * \param[in] chunkLen  Length of each chunk (the last one can be shorter).
+ * \param[in] patchHead If nonzero, the ROM header contained in the first
+ *            chunk is patched using RomHeadPatch(). Requires chunkLen to be
+ *            at least ROM_HEAD_LEN.
+ * \param[in] lz        If nonzero, chunks are also compressed (see lz.h),
+ *            to be obtained with StreamLzGet().
+ *
+ * \return The stream handle, or NULL if the stream could not be opened.
+ ****************************************************************************/
+Stream *StreamOpen(const char *file, uint32_t len, uint32_t chunkLen,
+		int patchHead, int lz) {
+	Stream *s;
+
+	if (!chunkLen || (patchHead && chunkLen < ROM_HEAD_LEN)) return NULL;
+	if (!(s = calloc(1, sizeof(Stream)))) {
+		perror("Allocating stream");
+		return NULL;
+	}
+	s->zMax = chunkLen - chunkLen / STREAM_LZ_SAVING;
+	if (!(s->buf = malloc(STREAM_SLOTS * chunkLen)) ||
+			(lz && !(s->zBuf = malloc(STREAM_SLOTS * s->zMax)))) {
+		perror("Allocating stream buffers");
+		free(s->buf);
+		free(s);
+		return NULL;
+	}
+	if (!(s->f = fopen(file, "rb"))) {
+		perror(file);
+		free(s->zBuf);
+		free(s->buf);
+		free(s);
+		return NULL;
+	}
+	s->len = len;
+	s->chunkLen = chunkLen;
+	s->patchHead = patchHead;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->ready, NULL);
+	pthread_cond_init(&s->freed, NULL);
+	if (pthread_create(&s->reader, NULL, StreamReader, s)) {
+		PrintErr("Could not create stream reader thread!\n");
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->ready);
+		pthread_cond_destroy(&s->freed);
+		fclose(s->f);
+		free(s->zBuf);
+		free(s->buf);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/************************************************************************//**
+ * Obtains the next chunk of the stream, waiting for it to be read if
+ * necessary. The chunk must be returned with StreamRelease() once used.
+ *
+ * \param[in]  s   Stream handle.
+ * \param[out] len Length of the obtained chunk.
+ *
+ * \return Pointer to the chunk data, or NULL if the end of the stream was
+ * reached or there was a read error.
+ ****************************************************************************/
+uint8_t *StreamGet(Stream *s, uint32_t *len) {
+	uint8_t *chunk = NULL;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->filled && !s->done) pthread_cond_wait(&s->ready, &s->lock);
+	if (s->filled) {
+		chunk = s->buf + s->head * s->chunkLen;
+		*len = s->slotLen[s->head];
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return chunk;
+}
+
+/************************************************************************//**
+ * Obtains the compressed form of the chunk obtained with StreamGet(). It is
+ * valid until the chunk is returned with StreamRelease().
+ *
+ * \param[in]  s    Stream handle.
+ * \param[out] zLen Length of the compressed chunk.
+ *
+ * \return Pointer to the compressed chunk, or NULL if the chunk was not
+ * compressed (compression disabled, or not saving enough to be worth it).
+ ****************************************************************************/
+const uint8_t *StreamLzGet(Stream *s, uint32_t *zLen) {
+	if (!s->zBuf || !s->zLen[s->head]) return NULL;
+	*zLen = s->zLen[s->head];
+	return s->zBuf + s->head * s->zMax;
+}
+
+/************************************************************************//**
+ * Returns the chunk obtained with StreamGet() to the ring, for the reader
+ * thread to fill it again.
+ *
+ * \param[in] s Stream handle.
+ ****************************************************************************/
+void StreamRelease(Stream *s) {
+	pthread_mutex_lock(&s->lock);
+	s->head = (s->head + 1) % STREAM_SLOTS;
+	s->filled--;
+	pthread_cond_signal(&s->freed);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/************************************************************************//**
+ * Stops the reader thread, closes the file and frees the stream.
+ *
+ * \param[in] s Stream handle.
+ *
+ * \return 0 if the requested length was completely read, nonzero if there
+ * was a read error.
+ ****************************************************************************/
+int StreamClose(Stream *s) {
+	int err;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = TRUE;
+	pthread_cond_signal(&s->freed);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->reader, NULL);
+
+	err = s->error;
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->ready);
+	pthread_cond_destroy(&s->freed);
+	fclose(s->f);
+	free(s->zBuf);
+	free(s->buf);
+	free(s);
+
+	return err;
+}
+
@@ -0,0 +1,93 @@
+/************************************************************************//**
+ * \brief Streams a file in fixed size chunks, using a small ring of chunk
+ * buffers filled by a reader thread.
+ *
+ * The reader thread reads the file ahead while the consumer (e.g. the
+ * flash sender) processes previous chunks, so disk and network I/O are
+ * overlapped, and memory usage does not depend on the file length. It can
+ * also compress the chunks, so compression overlaps sending too.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Stream stream
+ * \{
+ ****************************************************************************/
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include <stdint.h>
+
+/// Number of chunk buffers in the ring
+#define STREAM_SLOTS	4
+/// Chunks are only compressed if saving at least 1/STREAM_LZ_SAVING of
+/// their length. Less is not worth the decompression time on the cart.
+#define STREAM_LZ_SAVING	8
+
+/// Opaque stream handle
+typedef struct Stream Stream;
+
+/************************************************************************//**
+ * Opens a file for streaming, and starts the reader thread.
+ *
+ * \param[in] file      Name of the file to stream.
+ * \param[in] len       Number of bytes to stream from the file start.
+ * \param[in] chunkLen  Length of each chunk (the last one can be shorter).
+ * \param[in] patchHead If nonzero, the ROM header contained in the first
+ *            chunk is patched using RomHeadPatch(). Requires chunkLen to be
+ *            at least ROM_HEAD_LEN.
+ * \param[in] lz        If nonzero, chunks are also compressed (see lz.h),
+ *            to be obtained with StreamLzGet().
+ *
+ * \return The stream handle, or NULL if the stream could not be opened.
+ ****************************************************************************/
+Stream *StreamOpen(const char *file, uint32_t len, uint32_t chunkLen,
+		int patchHead, int lz);
+
+/************************************************************************//**
+ * Obtains the next chunk of the stream, waiting for it to be read if
+ * necessary. The chunk must be returned with StreamRelease() once used.
+ *
+ * \param[in]  s   Stream handle.
+ * \param[out] len Length of the obtained chunk.
+ *
+ * \return Pointer to the chunk data, or NULL if the end of the stream was
+ * reached or there was a read error.
+ ****************************************************************************/
+uint8_t *StreamGet(Stream *s, uint32_t *len);
+
+/************************************************************************//**
+ * Obtains the compressed form of the chunk obtained with StreamGet(). It is
+ * valid until the chunk is returned with StreamRelease().
+ *
+ * \param[in]  s    Stream handle.
+ * \param[out] zLen Length of the compressed chunk.
+ *
+ * \return Pointer to the compressed chunk, or NULL if the chunk was not
+ * compressed (compression disabled, or not saving enough to be worth it).
+ ****************************************************************************/
+const uint8_t *StreamLzGet(Stream *s, uint32_t *zLen);
+
+/************************************************************************//**
+ * Returns the chunk obtained with StreamGet() to the ring, for the reader
+ * thread to fill it again.
+ *
+ * \param[in] s Stream handle.
+ ****************************************************************************/
+void StreamRelease(Stream *s);
+
+/************************************************************************//**
+ * Stops the reader thread, closes the file and frees the stream.
+ *
+ * \param[in] s Stream handle.
+ *
+ * \return 0 if the requested length was completely read, nonzero if there
+ * was a read error.
+ ****************************************************************************/
+int StreamClose(Stream *s);
+
+#endif /*_STREAM_H_*/
+
+/** \} */
+
@@ -0,0 +1,40 @@
+/************************************************************************//**
+ * tcpinfo: Kernel TCP connection state. The kernel header is used, since
+ * the libc one lacks the newer fields (e.g. tcpi_notsent_bytes), so this
+ * module must not include netinet/tcp.h.
+ ****************************************************************************/
+#include "tcpinfo.h"
+#include <string.h>
+#include <stddef.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+int TcpInfoGet(int sock, TcpInfo *ti) {
+	struct tcp_info info;
+	socklen_t len = sizeof(struct tcp_info);
+
+	memset(&info, 0, sizeof(struct tcp_info));
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len)) return -1;
+	ti->rttUs = info.tcpi_rtt;
+	ti->rttvarUs = info.tcpi_rttvar;
+	ti->cwnd = info.tcpi_snd_cwnd;
+	ti->unacked = info.tcpi_unacked;
+	ti->retrans = info.tcpi_total_retrans;
+	ti->mss = info.tcpi_snd_mss;
+	// Older kernels return a shorter structure
+	ti->notsent = len >= offsetof(struct tcp_info, tcpi_notsent_bytes) +
+		sizeof(info.tcpi_notsent_bytes)?info.tcpi_notsent_bytes:0;
+	return 0;
+}
+
+#else
+
+int TcpInfoGet(int sock, TcpInfo *ti) {
+	memset(ti, 0, sizeof(TcpInfo));
+	return -1;
+}
+
+#endif
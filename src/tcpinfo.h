@@ -0,0 +1,46 @@
+/************************************************************************//**
+ * \brief Kernel TCP connection state.
+ *
+ * Obtains the state the kernel keeps for a TCP connection (TCP_INFO): the
+ * smoothed round trip time, congestion window, retransmits and the data
+ * in flight or waiting to be sent. This tells whether a slow transfer is
+ * limited by the link, by the receiver or by the client itself. Only
+ * available on Linux.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup TcpInfo tcpinfo
+ * \{
+ ****************************************************************************/
+
+#ifndef _TCPINFO_H_
+#define _TCPINFO_H_
+
+#include <stdint.h>
+
+/// TCP connection state
+typedef struct {
+	uint32_t rttUs;		///< Smoothed round trip time, in us
+	uint32_t rttvarUs;	///< Round trip time variation, in us
+	uint32_t cwnd;		///< Congestion window, in segments
+	uint32_t unacked;	///< Segments sent but not acknowledged yet
+	uint32_t retrans;	///< Segments retransmitted since connected
+	uint32_t notsent;	///< Bytes in the send buffer not sent yet
+	uint32_t mss;		///< Send maximum segment size
+} TcpInfo;
+
+/************************************************************************//**
+ * Obtains the state of a TCP connection.
+ *
+ * \param[in]  sock Connected TCP socket.
+ * \param[out] ti   Connection state. Fields the kernel does not report
+ *                  are set to 0.
+ *
+ * \return 0 if OK, -1 if not available.
+ ****************************************************************************/
+int TcpInfoGet(int sock, TcpInfo *ti);
+
+#endif /*_TCPINFO_H_*/
+
+/** \} */
@@ -0,0 +1,62 @@
+#!/bin/bash
+# Regression test for jobs submitted to a wflash daemon (-Y/-j): arguments
+# with address and length parts must reach the daemon untouched. Runs
+# against the wfsim cartridge stand-in, and exits nonzero on failure.
+
+cd "$(dirname "$0")/.."
+
+SIM=${SIM:-sim/wfsim}
+WFLASH=${WFLASH:-./wflash}
+PORT=${PORT:-19891}
+TMP=$(mktemp -d)
+SOCK=$TMP/wflash.sock
+ADDR=0x100000
+LEN=65536
+CART="-a 127.0.0.1 -p $PORT"
+fail=0
+
+cleanup() {
+	kill $daemon $sim 2> /dev/null
+	wait 2> /dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+check() {
+	if [ $? -ne 0 ]; then
+		echo "FAIL: $1" >&2
+		fail=1
+	else
+		echo "ok: $1"
+	fi
+}
+
+"$SIM" -p "$PORT" -t 0 > /dev/null &
+sim=$!
+"$WFLASH" -Y "$SOCK" > /dev/null 2>&1 &
+daemon=$!
+sleep 0.3
+if ! kill -0 $sim 2> /dev/null || ! kill -0 $daemon 2> /dev/null; then
+	echo "Could not start $SIM and the $WFLASH daemon" >&2
+	exit 1
+fi
+
+head -c $LEN /dev/urandom > "$TMP/rom.bin"
+
+"$WFLASH" -j "$SOCK" $CART -f "$TMP/rom.bin:$ADDR" > /dev/null
+check "flash file:addr"
+"$WFLASH" -j "$SOCK" $CART -r "$TMP/out.bin:$ADDR:$LEN" > /dev/null
+check "read file:addr:len"
+cmp -s "$TMP/rom.bin" "$TMP/out.bin"
+check "data flashed at $ADDR"
+"$WFLASH" -j "$SOCK" $CART -r "$TMP/boot.bin::$LEN" > /dev/null
+[ "$(stat -c %s "$TMP/boot.bin")" -eq $LEN ] && \
+	! cmp -s "$TMP/rom.bin" "$TMP/boot.bin"
+check "read file::len, boot area untouched"
+"$WFLASH" -j "$SOCK" $CART -s "$ADDR:$LEN" > /dev/null
+check "erase addr:len"
+"$WFLASH" -j "$SOCK" $CART -r "$TMP/out.bin:$ADDR:$LEN" > /dev/null
+cmp -s "$TMP/out.bin" <(head -c $LEN /dev/zero | tr '\0' '\377')
+check "range erased"
+
+exit $fail
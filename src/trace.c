@@ -0,0 +1,205 @@
+/************************************************************************//**
+ * trace: Session timeline traces, in the Chrome trace event format.
+ ****************************************************************************/
+#include "trace.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/// Number of events allocated at first
+#define TRACE_EVENTS_MIN	4096
+/// Maximum number of events recorded, further ones are dropped
+#define TRACE_EVENTS_MAX	(4 * 1024 * 1024)
+
+/// Recorded event
+typedef struct {
+	const char *cat;	///< Category, NULL for thread names
+	const char *name;	///< Name, owned by the trace for thread names
+	uint64_t ts;		///< Start time, in us
+	uint64_t dur;		///< Duration, in us
+	uint32_t addr;		///< Flash address
+	uint32_t len;		///< Bytes, 0 if the span has no arguments
+	uint32_t id;		///< Async span id, 0 for nested spans
+	int tid;			///< Thread
+} TraceEvent;
+
+/// Trace being recorded
+static struct {
+	pthread_mutex_t lock;	///< Protects the events
+	FILE *f;				///< Output file
+	const char *file;		///< Output file name
+	TraceEvent *ev;			///< Recorded events
+	uint32_t n;				///< Number of recorded events
+	uint32_t max;			///< Number of allocated events
+	uint32_t dropped;		///< Events not recorded for lack of memory
+	uint32_t nextId;		///< Last async span id
+	int nextTid;			///< Last thread id
+	uint64_t startUs;		///< Time recording started
+	volatile int on;		///< Recording
+} trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/// Thread id in the trace, 0 if not assigned yet
+static __thread int traceTid;
+
+// Obtains room for an event, assigning the thread id if needed. Must be
+// called with the lock held. Returns NULL if there is no room.
+static TraceEvent *TraceEventNew(void) {
+	TraceEvent *ev;
+	uint32_t max;
+
+	if (!traceTid) traceTid = ++trace.nextTid;
+	if (trace.n == trace.max) {
+		max = trace.max?2 * trace.max:TRACE_EVENTS_MIN;
+		if ((max > TRACE_EVENTS_MAX) ||
+				!(ev = realloc(trace.ev, max * sizeof(TraceEvent)))) {
+			trace.dropped++;
+			return NULL;
+		}
+		trace.ev = ev;
+		trace.max = max;
+	}
+	ev = trace.ev + trace.n++;
+	ev->tid = traceTid;
+	return ev;
+}
+
+// Records a span, ending now.
+static void TraceAdd(const char *cat, const char *name, uint64_t startUs,
+		uint32_t addr, uint32_t len, int async) {
+	uint64_t now = TimeUs();
+	TraceEvent *ev;
+
+	if (!trace.on) return;
+	pthread_mutex_lock(&trace.lock);
+	if (trace.on && (ev = TraceEventNew())) {
+		ev->cat = cat;
+		ev->name = name;
+		ev->ts = startUs;
+		ev->dur = now - startUs;
+		ev->addr = addr;
+		ev->len = len;
+		ev->id = async?++trace.nextId:0;
+	}
+	pthread_mutex_unlock(&trace.lock);
+}
+
+void TraceSpan(const char *cat, const char *name, uint64_t startUs,
+		uint32_t addr, uint32_t len) {
+	TraceAdd(cat, name, startUs, addr, len, FALSE);
+}
+
+void TraceAsync(const char *cat, const char *name, uint64_t startUs,
+		uint32_t addr, uint32_t len) {
+	TraceAdd(cat, name, startUs, addr, len, TRUE);
+}
+
+void TraceThreadName(const char *name) {
+	TraceEvent *ev;
+	char *copy;
+
+	if (!trace.on || !(copy = strdup(name))) return;
+	pthread_mutex_lock(&trace.lock);
+	if (trace.on && (ev = TraceEventNew())) {
+		memset(ev, 0, sizeof(TraceEvent));
+		ev->name = copy;
+		ev->tid = traceTid;
+		copy = NULL;
+	}
+	pthread_mutex_unlock(&trace.lock);
+	free(copy);
+}
+
+int TraceStart(const char *file) {
+	if (trace.on) return 1;
+	if (!(trace.f = fopen(file, "w"))) {
+		perror(file);
+		return 1;
+	}
+	trace.file = file;
+	trace.n = trace.dropped = trace.nextId = 0;
+	trace.startUs = TimeUs();
+	trace.on = TRUE;
+	TraceThreadName("main");
+
+	return 0;
+}
+
+// Writes a JSON string, escaping what needs it.
+static void TraceStr(FILE *f, const char *str) {
+	fputc('"', f);
+	for (; *str; str++) {
+		if ((*str == '"') || (*str == '\\')) fputc('\\', f);
+		if ((unsigned char)*str >= ' ') fputc(*str, f);
+	}
+	fputc('"', f);
+}
+
+// Writes the common fields of an event, and its arguments.
+static void TraceEventHead(FILE *f, const TraceEvent *ev, char ph,
+		uint64_t ts) {
+	fprintf(f, ",\n{\"name\":");
+	TraceStr(f, ev->name);
+	fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,"
+			"\"tid\":%d", ev->cat, ph, (unsigned long long)ts, ev->tid);
+	if (ev->len) {
+		fprintf(f, ",\"args\":{\"addr\":\"0x%06X\",\"len\":%u}", ev->addr,
+				ev->len);
+	}
+}
+
+// Writes an event. Async spans are written as a begin and end pair.
+static void TraceEventWrite(FILE *f, const TraceEvent *ev, uint64_t base) {
+	uint64_t ts = ev->ts > base?ev->ts - base:0;
+
+	if (!ev->cat) {
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%d,\"args\":{\"name\":", ev->tid);
+		TraceStr(f, ev->name);
+		fprintf(f, "}}");
+	} else if (!ev->id) {
+		TraceEventHead(f, ev, 'X', ts);
+		fprintf(f, ",\"dur\":%llu}", (unsigned long long)ev->dur);
+	} else {
+		TraceEventHead(f, ev, 'b', ts);
+		fprintf(f, ",\"id\":%u}", ev->id);
+		TraceEventHead(f, ev, 'e', ts + ev->dur);
+		fprintf(f, ",\"id\":%u}", ev->id);
+	}
+}
+
+int TraceStop(void) {
+	uint32_t i;
+	int err;
+
+	if (!trace.on) return 0;
+	pthread_mutex_lock(&trace.lock);
+	trace.on = FALSE;
+	pthread_mutex_unlock(&trace.lock);
+
+	fprintf(trace.f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+			"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"args\":{\"name\":\"wflash\"}}");
+	for (i = 0; i < trace.n; i++) {
+		TraceEventWrite(trace.f, trace.ev + i, trace.startUs);
+		if (!trace.ev[i].cat) free((char*)trace.ev[i].name);
+	}
+	fprintf(trace.f, "\n]}\n");
+	if (trace.dropped) {
+		PrintErr("Trace full, %u events dropped.\n", trace.dropped);
+	}
+	err = ferror(trace.f);
+	if (fclose(trace.f) || err) {
+		PrintErr("Could not write trace to %s!\n", trace.file);
+		err = 1;
+	}
+	free(trace.ev);
+	trace.ev = NULL;
+	trace.n = trace.max = 0;
+	trace.f = NULL;
+
+	return err;
+}
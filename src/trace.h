@@ -0,0 +1,81 @@
+/************************************************************************//**
+ * \brief Session timeline traces.
+ *
+ * Records timestamped spans of what the program is doing (name lookup,
+ * connection, bootloader settle, each command from issue to reply, sends,
+ * waits for acknowledges, file I/O, progress rendering...), and writes
+ * them when done in the Chrome trace event format, that can be loaded in
+ * chrome://tracing or https://ui.perfetto.dev. This shows where the time
+ * goes: the host, the link or the flash chip.
+ *
+ * Spans are kept in memory while recording, and are only written when
+ * recording stops, so tracing barely disturbs the timings. All functions
+ * can be called from any thread, and do nothing when not recording.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Trace trace
+ * \{
+ ****************************************************************************/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/************************************************************************//**
+ * Starts recording spans.
+ *
+ * \param[in] file Name of the file the trace is written to when recording
+ *                 stops.
+ *
+ * \return 0 if OK, nonzero if the file cannot be written.
+ ****************************************************************************/
+int TraceStart(const char *file);
+
+/************************************************************************//**
+ * Stops recording, writes the trace to the file and frees the recorded
+ * spans. Does nothing if not recording.
+ *
+ * \return 0 if OK, nonzero if the trace could not be written.
+ ****************************************************************************/
+int TraceStop(void);
+
+/************************************************************************//**
+ * Records a span started at startUs and ending now, on the calling thread.
+ * Spans of a thread must be properly nested.
+ *
+ * \param[in] cat     Category of the span. Must be a string constant.
+ * \param[in] name    Name of the span. Must be a string constant.
+ * \param[in] startUs Start time, as returned by TimeUs().
+ * \param[in] addr    Flash address the span works on, if len is not 0.
+ * \param[in] len     Number of bytes the span works on, 0 if none.
+ ****************************************************************************/
+void TraceSpan(const char *cat, const char *name, uint64_t startUs,
+		uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Records a span started at startUs and ending now, that can overlap other
+ * spans (e.g. pipelined commands). Viewers show these spans on their own
+ * tracks.
+ *
+ * \param[in] cat     Category of the span. Must be a string constant.
+ * \param[in] name    Name of the span. Must be a string constant.
+ * \param[in] startUs Start time, as returned by TimeUs().
+ * \param[in] addr    Flash address the span works on, if len is not 0.
+ * \param[in] len     Number of bytes the span works on, 0 if none.
+ ****************************************************************************/
+void TraceAsync(const char *cat, const char *name, uint64_t startUs,
+		uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Names the calling thread in the trace.
+ *
+ * \param[in] name Name of the thread. It is copied.
+ ****************************************************************************/
+void TraceThreadName(const char *name);
+
+#endif /*_TRACE_H_*/
+
+/** \} */
@@ -0,0 +1,302 @@
+/************************************************************************//**
+ * uring: Minimal io_uring interface. Operations are submitted one at a
+ * time, and their completion is waited for with the same system call that
+ * submits them. This is all the wflash client needs, since it always waits
+ * for the data it sends or receives.
+ ****************************************************************************/
+#include "uring.h"
+
+#ifdef WF_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "util.h"
+
+/// User data of the operation completions
+#define URING_OP		1
+/// User data of the linked timeout completions
+#define URING_TIMEOUT	2
+
+/// Operations that must be supported by the kernel
+static const uint8_t uringOps[] = {
+	IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_LINK_TIMEOUT,
+	IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+	IORING_OP_WRITE_FIXED
+};
+
+/// Mapped ring
+typedef struct {
+	void *mem;					///< Mapped memory
+	size_t len;					///< Length of the mapping
+	unsigned *head;				///< Ring head
+	unsigned *tail;				///< Ring tail
+	unsigned mask;				///< Ring index mask
+} UringRing;
+
+/// io_uring instance
+struct Uring {
+	int fd;						///< io_uring file descriptor
+	UringRing sq;				///< Submission queue ring
+	UringRing cq;				///< Completion queue ring
+	unsigned *sqArray;			///< Submission queue index array
+	struct io_uring_sqe *sqes;	///< Submission queue entries
+	size_t sqesLen;				///< Length of the entries mapping
+	struct io_uring_cqe *cqes;	///< Completion queue entries
+	struct iovec buf[URING_BUFS];	///< Registered buffers
+	unsigned nBufs;				///< Number of registered buffers
+};
+
+static inline int UringEnter(Uring *u, unsigned submit, unsigned wait) {
+	return syscall(__NR_io_uring_enter, u->fd, submit, wait,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static inline int UringRegister(Uring *u, unsigned op, void *arg,
+		unsigned n) {
+	return syscall(__NR_io_uring_register, u->fd, op, arg, n);
+}
+
+// Checks the kernel supports all the operations used.
+static int UringProbe(Uring *u) {
+	struct io_uring_probe *p;
+	size_t len = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	unsigned i;
+	int err = 0;
+
+	if (!(p = calloc(1, len))) return -1;
+	if (UringRegister(u, IORING_REGISTER_PROBE, p, IORING_OP_LAST) < 0) {
+		err = -1;
+	}
+	for (i = 0; !err && i < sizeof(uringOps); i++) {
+		if ((uringOps[i] > p->last_op) ||
+				!(p->ops[uringOps[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = -1;
+		}
+	}
+	free(p);
+	return err;
+}
+
+Uring *UringNew(unsigned int entries) {
+	struct io_uring_params par;
+	Uring *u;
+	uint8_t *sq, *cq;
+
+	if (!(u = calloc(1, sizeof(Uring)))) return NULL;
+	memset(&par, 0, sizeof(struct io_uring_params));
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &par)) < 0) {
+		free(u);
+		return NULL;
+	}
+	u->sq.len = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+	u->cq.len = par.cq_off.cqes +
+		par.cq_entries * sizeof(struct io_uring_cqe);
+	if (par.features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq.len = u->cq.len = MAX(u->sq.len, u->cq.len);
+	}
+	u->sqesLen = par.sq_entries * sizeof(struct io_uring_sqe);
+	u->sq.mem = mmap(NULL, u->sq.len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq.mem == MAP_FAILED) goto err;
+	if (par.features & IORING_FEAT_SINGLE_MMAP) u->cq.mem = u->sq.mem;
+	else {
+		u->cq.mem = mmap(NULL, u->cq.len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq.mem == MAP_FAILED) goto err_sq;
+	}
+	u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto err_cq;
+
+	sq = u->sq.mem;
+	cq = u->cq.mem;
+	u->sq.head = (unsigned*)(sq + par.sq_off.head);
+	u->sq.tail = (unsigned*)(sq + par.sq_off.tail);
+	u->sq.mask = *(unsigned*)(sq + par.sq_off.ring_mask);
+	u->sqArray = (unsigned*)(sq + par.sq_off.array);
+	u->cq.head = (unsigned*)(cq + par.cq_off.head);
+	u->cq.tail = (unsigned*)(cq + par.cq_off.tail);
+	u->cq.mask = *(unsigned*)(cq + par.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + par.cq_off.cqes);
+
+	if (!UringProbe(u)) return u;
+
+	munmap(u->sqes, u->sqesLen);
+err_cq:
+	if (u->cq.mem != u->sq.mem) munmap(u->cq.mem, u->cq.len);
+err_sq:
+	munmap(u->sq.mem, u->sq.len);
+err:
+	close(u->fd);
+	free(u);
+	return NULL;
+}
+
+void UringFree(Uring *u) {
+	if (!u) return;
+	munmap(u->sqes, u->sqesLen);
+	if (u->cq.mem != u->sq.mem) munmap(u->cq.mem, u->cq.len);
+	munmap(u->sq.mem, u->sq.len);
+	close(u->fd);
+	free(u);
+}
+
+// Replaces the registered buffers with the ones in the buf array.
+static int UringBufUpdate(Uring *u, unsigned registered) {
+	if (registered) UringRegister(u, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	if (u->nBufs && UringRegister(u, IORING_REGISTER_BUFFERS, u->buf,
+				u->nBufs) < 0) {
+		u->nBufs = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int UringBufRegister(Uring *u, void *buf, size_t len) {
+	unsigned registered = u->nBufs;
+
+	if (u->nBufs == URING_BUFS) return -1;
+	u->buf[u->nBufs].iov_base = buf;
+	u->buf[u->nBufs++].iov_len = len;
+	// A failure leaves no buffer registered, restore the previous ones
+	if (UringBufUpdate(u, registered)) {
+		u->nBufs = registered;
+		UringBufUpdate(u, 0);
+		return -1;
+	}
+	return 0;
+}
+
+void UringBufUnregister(Uring *u, void *buf) {
+	unsigned registered = u->nBufs;
+	unsigned i;
+
+	for (i = 0; i < u->nBufs && u->buf[i].iov_base != buf; i++);
+	if (i == u->nBufs) return;
+	memmove(u->buf + i, u->buf + i + 1, (--u->nBufs - i) *
+			sizeof(struct iovec));
+	UringBufUpdate(u, registered);
+}
+
+// Obtains a cleared submission queue entry, the n-th of the operation.
+static struct io_uring_sqe *UringSqe(Uring *u, unsigned n) {
+	unsigned idx = (*u->sq.tail + n) & u->sq.mask;
+
+	u->sqArray[idx] = idx;
+	memset(u->sqes + idx, 0, sizeof(struct io_uring_sqe));
+	return u->sqes + idx;
+}
+
+// Submits the n entries of an operation, and waits for all of them to
+// complete. Returns the operation result, as a system call does.
+static ssize_t UringRun(Uring *u, unsigned n) {
+	struct io_uring_cqe *cqe;
+	unsigned head, left = n;
+	int res = -EIO, timedOut = FALSE;
+	int ret;
+
+	__atomic_store_n(u->sq.tail, *u->sq.tail + n, __ATOMIC_RELEASE);
+	while (left) {
+		if ((ret = UringEnter(u, n, left)) >= 0) n -= MIN((unsigned)ret, n);
+		else if (errno != EINTR) return -1;
+		head = *u->cq.head;
+		while (head != __atomic_load_n(u->cq.tail, __ATOMIC_ACQUIRE)) {
+			cqe = u->cqes + (head++ & u->cq.mask);
+			if (cqe->user_data == URING_OP) res = cqe->res;
+			else if (cqe->res == -ETIME) timedOut = TRUE;
+			left--;
+		}
+		__atomic_store_n(u->cq.head, head, __ATOMIC_RELEASE);
+	}
+	// A timed out operation completes as canceled
+	if (timedOut && (res == -ECANCELED)) res = -ETIME;
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+// Runs a socket operation, with a timeout linked to it.
+static ssize_t UringSock(Uring *u, uint8_t op, int fd, const void *addr,
+		unsigned len, int flags, uint64_t deadline) {
+	struct io_uring_sqe *sqe = UringSqe(u, 0);
+	struct __kernel_timespec ts;
+	uint64_t now = TimeUs();
+	uint64_t us = deadline > now?deadline - now:0;
+
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)addr;
+	sqe->len = len;
+	sqe->msg_flags = flags;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = URING_OP;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	sqe = UringSqe(u, 1);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&ts;
+	sqe->len = 1;
+	sqe->user_data = URING_TIMEOUT;
+
+	return UringRun(u, 2);
+}
+
+ssize_t UringRecv(Uring *u, int fd, void *buf, size_t len, int flags,
+		uint64_t deadline) {
+	return UringSock(u, IORING_OP_RECV, fd, buf, len, flags, deadline);
+}
+
+ssize_t UringSendMsg(Uring *u, int fd, const struct msghdr *msg, int flags,
+		uint64_t deadline) {
+	return UringSock(u, IORING_OP_SENDMSG, fd, msg, 1, flags, deadline);
+}
+
+// Runs a file operation, using the fixed variant if the buffer is inside
+// a registered one.
+static ssize_t UringFile(Uring *u, uint8_t op, uint8_t fixedOp, int fd,
+		const void *buf, size_t len, uint64_t off) {
+	struct io_uring_sqe *sqe = UringSqe(u, 0);
+	const uint8_t *p = buf;
+	unsigned i;
+
+	sqe->opcode = op;
+	for (i = 0; i < u->nBufs; i++) {
+		if ((p >= (uint8_t*)u->buf[i].iov_base) && (p + len <=
+					(uint8_t*)u->buf[i].iov_base + u->buf[i].iov_len)) {
+			sqe->opcode = fixedOp;
+			sqe->buf_index = i;
+			break;
+		}
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = URING_OP;
+
+	return UringRun(u, 1);
+}
+
+ssize_t UringRead(Uring *u, int fd, void *buf, size_t len, uint64_t off) {
+	return UringFile(u, IORING_OP_READ, IORING_OP_READ_FIXED, fd, buf, len,
+			off);
+}
+
+ssize_t UringWrite(Uring *u, int fd, const void *buf, size_t len,
+		uint64_t off) {
+	return UringFile(u, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, fd, buf,
+			len, off);
+}
+
+#endif /*WF_URING*/
@@ -0,0 +1,136 @@
+/************************************************************************//**
+ * \brief Minimal io_uring interface, used as an alternative backend for the
+ * wflash transport and for image file I/O on Linux.
+ *
+ * Only what the client needs is implemented, directly on top of the
+ * io_uring system calls, so liburing is not required. Each operation is
+ * submitted and waited for with a single io_uring_enter() call. Socket
+ * operations carry a linked timeout, so waiting with a deadline does not
+ * need extra poll calls. File operations on registered buffers use the
+ * fixed variants, avoiding to map the buffer pages on each call.
+ *
+ * The backend is only built when WF_URING is defined (make URING=1). If the
+ * kernel does not support the needed operations, UringNew() fails, and the
+ * caller must use the classic system calls.
+ *
+ * \author Jesús Alonso (doragasu)
+ * \date   2017
+ *
+ * \defgroup Uring uring
+ * \{
+ ****************************************************************************/
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/// Maximum number of buffers registered at once
+#define URING_BUFS		4
+
+/// io_uring instance
+typedef struct Uring Uring;
+
+struct msghdr;
+
+/************************************************************************//**
+ * Creates an io_uring instance.
+ *
+ * \param[in] entries Submission queue entries. Each operation uses two.
+ *
+ * \return The new instance, or NULL if io_uring is not usable.
+ ****************************************************************************/
+Uring *UringNew(unsigned int entries);
+
+/************************************************************************//**
+ * Frees an io_uring instance.
+ *
+ * \param[in] u Instance to free. Can be NULL.
+ ****************************************************************************/
+void UringFree(Uring *u);
+
+/************************************************************************//**
+ * Registers a buffer, so file operations on it use the fixed variants.
+ *
+ * \param[in] u   io_uring instance.
+ * \param[in] buf Buffer to register.
+ * \param[in] len Length of the buffer.
+ *
+ * \return 0 if registered, -1 otherwise. Operations on unregistered
+ * buffers still work.
+ ****************************************************************************/
+int UringBufRegister(Uring *u, void *buf, size_t len);
+
+/************************************************************************//**
+ * Unregisters a buffer registered with UringBufRegister(). Must be called
+ * before freeing the buffer.
+ *
+ * \param[in] u   io_uring instance.
+ * \param[in] buf Registered buffer.
+ ****************************************************************************/
+void UringBufUnregister(Uring *u, void *buf);
+
+/************************************************************************//**
+ * Receives data from a socket, as recv() does.
+ *
+ * \param[in]  u        io_uring instance.
+ * \param[in]  fd       Socket.
+ * \param[out] buf      Buffer receiving the data.
+ * \param[in]  len      Length of buf.
+ * \param[in]  flags    recv() flags, e.g. MSG_WAITALL.
+ * \param[in]  deadline Monotonic time (TimeUs()) to give up receiving.
+ *
+ * \return Number of bytes received, 0 on end of stream, or -1 with errno
+ * set on error. errno is ETIME if the deadline passed.
+ ****************************************************************************/
+ssize_t UringRecv(Uring *u, int fd, void *buf, size_t len, int flags,
+		uint64_t deadline);
+
+/************************************************************************//**
+ * Sends data to a socket, as sendmsg() does.
+ *
+ * \param[in] u        io_uring instance.
+ * \param[in] fd       Socket.
+ * \param[in] msg      Message to send.
+ * \param[in] flags    sendmsg() flags. With MSG_WAITALL, all the data is
+ *                     sent unless an error happens.
+ * \param[in] deadline Monotonic time (TimeUs()) to give up sending.
+ *
+ * \return Number of bytes sent, or -1 with errno set on error. errno is
+ * ETIME if the deadline passed.
+ ****************************************************************************/
+ssize_t UringSendMsg(Uring *u, int fd, const struct msghdr *msg, int flags,
+		uint64_t deadline);
+
+/************************************************************************//**
+ * Reads data from a file, as pread() does.
+ *
+ * \param[in]  u   io_uring instance.
+ * \param[in]  fd  File descriptor.
+ * \param[out] buf Buffer receiving the data.
+ * \param[in]  len Number of bytes to read.
+ * \param[in]  off File offset to read from.
+ *
+ * \return Number of bytes read, or -1 with errno set on error.
+ ****************************************************************************/
+ssize_t UringRead(Uring *u, int fd, void *buf, size_t len, uint64_t off);
+
+/************************************************************************//**
+ * Writes data to a file, as pwrite() does.
+ *
+ * \param[in] u   io_uring instance.
+ * \param[in] fd  File descriptor.
+ * \param[in] buf Data to write.
+ * \param[in] len Number of bytes to write.
+ * \param[in] off File offset to write to.
+ *
+ * \return Number of bytes written, or -1 with errno set on error.
+ ****************************************************************************/
+ssize_t UringWrite(Uring *u, int fd, const void *buf, size_t len,
+		uint64_t off);
+
+#endif /*_URING_H_*/
+
+/** \} */
@@ -16,7 +16,10 @@
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <time.h>
 #endif
+#include <stdint.h>
+#include <string.h>
 
 #ifndef TRUE
 /// For evaluation to TRUE of statements
@@ -46,6 +49,36 @@
 #define DelayMs(ms) usleep((ms)*1000)
 #endif
 
+/// Obtains a monotonic time stamp in microseconds, for measurements
+static inline uint64_t TimeUs(void) {
+#ifdef __OS_WIN
+	return (uint64_t)GetTickCount64() * 1000;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/// Obtains the offset of the first byte differing between two buffers, or
+/// len if they are equal. Buffers are compared in blocks using memcmp(),
+/// vectorized by the C library, and only a differing block is scanned
+/// byte by byte.
+static inline size_t MemDiff(const void *a, const void *b, size_t len) {
+	const uint8_t *x = (const uint8_t*)a, *y = (const uint8_t*)b;
+	size_t off, blk;
+
+	for (off = 0; off < len; off += blk) {
+		blk = MIN(len - off, 4096);
+		if (memcmp(x + off, y + off, blk)) {
+			while (x[off] == y[off]) off++;
+			return off;
+		}
+	}
+	return len;
+}
+
 #endif //_UTIL_H_
 
 /** \} */
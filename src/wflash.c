@@ -8,22 +8,37 @@
  * \{
  ****************************************************************************/
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #ifdef __WIN32__
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#endif
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include "wflash.h"
 #include "util.h"
 #include "cmds.h"
+#include "trace.h"
+#include "record.h"
+#include "tcpinfo.h"
+#ifdef WF_URING
+#include "uring.h"
+#endif
 
 // Function name mangling for WIN32 compatibility
 #ifdef __WIN32__
@@ -32,37 +47,295 @@
 #define closesck close
 #endif
 
-/// Local module data structure.
+// A non-blocking socket call could not complete without waiting
+#ifdef __WIN32__
+#define WF_WOULDBLOCK()	(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define WF_WOULDBLOCK()	(errno == EAGAIN || errno == EWOULDBLOCK || \
+		errno == EINPROGRESS)
+#endif
+
+// Send flag hinting more data follows (Linux only)
+#ifdef MSG_MORE
+#define WF_MSG_MORE MSG_MORE
+#else
+#define WF_MSG_MORE 0
+#endif
+
+#ifdef __WIN32__
+/// Scatter-gather buffer (struct iovec is not available on Windows)
+struct iovec {
+	void *iov_base;		///< Buffer address
+	size_t iov_len;		///< Buffer length
+};
+#endif
+
+/// Maximum segment size assumed if it cannot be obtained from the socket
+#define WF_DEF_MSS		1460
+/// Maximum argument length of a command that can be batched
+#define WF_BATCH_ARGLEN	sizeof(WfLzRange)
+/// Maximum number of buffers in a batch: each pipelined command can have
+/// its frame and a payload.
+#define WF_BATCH_IOV	(2 * WF_PIPE_MAX)
+/// First wait for the reply to a readiness probe, in ms
+#define WF_PROBE_MIN_MS		50
+/// Maximum wait for the reply to a readiness probe, in ms
+#define WF_PROBE_MAX_MS		250
+/// Maximum time to establish a connection, in ms
+#define WF_CONNECT_MS		5000
+/// Maximum time for a command to complete, or for a transfer to make
+/// progress, in ms
+#define WF_CMD_MS			10000
+/// Additional time for erase commands, per 64 KiB erased, in ms
+#define WF_ERASE_MS_64K		4000
+/// Additional time for CRC commands, per 64 KiB checked, in ms
+#define WF_CRC_MS_64K		1000
+/// Socket can be read
+#define WF_EV_IN			1
+/// Socket can be written
+#define WF_EV_OUT			2
+/// Maximum read data in flight in the pipeline. Data not yet received must
+/// fit the socket receive buffer, or the cart could block sending it while
+/// the client blocks sending program payload.
+#define WF_READ_INFLIGHT	(64 * 1024)
+#ifdef WF_URING
+/// io_uring submission entries: an operation and its timeout
+#define WF_URING_ENTRIES	2
+#endif
+
+/// Command sent to the server, still waiting for its acknowledge.
 typedef struct {
-	WfBuf buf;						///< Data buffer
-	int sock;						///< Client socket
+	uint16_t cmd;					///< Command code
+	uint32_t addr;					///< Address argument of the command
+	uint32_t len;					///< Length argument of the command
+	uint64_t sent;					///< Time the command was sent, in us
+	uint8_t *buf;					///< Buffer for read data
+	WfReadCb cb;					///< Function receiving read data
+	void *ctx;						///< Context for the read callback
+} WfPending;
+
+/// Program pipeline data. Pending commands are kept in a ring buffer, in
+/// the same order they were sent. Because the server processes commands
+/// sequentially, acknowledges arrive in this order too.
+typedef struct {
+	WfPending pend[WF_PIPE_MAX];	///< Commands waiting for acknowledge
+	uint8_t head;					///< Oldest pending command index
+	uint8_t count;					///< Number of pending commands
+	uint8_t window;					///< Maximum number of pending commands
+	uint32_t readBytes;				///< Read data in flight
+	/// Acknowledge of the oldest pending command
+	uint16_t ack[WF_HEADLEN / 2];
+	uint32_t rxDone;				///< Reply bytes of the oldest received
+	uint64_t lastAck;				///< Time of the last acknowledge, in us
+	WfPipeStats stats;				///< Pipeline statistics
+} WfPipe;
+
+/// Commands queued to be sent using a single gather write.
+typedef struct {
+	/// Frames (header and arguments) of the queued commands
+	uint8_t frame[WF_PIPE_MAX][WF_HEADLEN + WF_BATCH_ARGLEN];
+	struct iovec iov[WF_BATCH_IOV];	///< Buffers to send
+	uint8_t niov;					///< Number of queued buffers
+	uint8_t ncmd;					///< Number of queued commands
+	uint8_t active;					///< Batching enabled
+} WfBatch;
+
+/// Connection context. Holds all the state of a connection to a cart, so
+/// several carts can be driven at once, with a context each.
+struct WfCtx {
+	WfBuf tx;						///< Command buffer
+	WfBuf rx;						///< Reply buffer
+	int sock;						///< Client socket (non-blocking)
+#ifdef __linux__
+	int ep;							///< epoll instance watching sock
+	int evMask;						///< Events watched by ep
+#endif
+#ifdef WF_URING
+	Uring *ring;					///< io_uring, NULL for classic calls
+#endif
 	struct in_addr *srvAddr;		///< Server address
+	WfPipe pipe;					///< Program pipeline
+	WfBatch batch;					///< Batched commands
+	WfIoStats io;					///< Transport statistics
+	WfTcpStats tcp;					///< TCP statistics since the io reset
+	WfStats stats;					///< Session statistics
+	uint64_t tcpUs;					///< Time of the last TCP sample, in us
+	uint32_t sndBuf;				///< Send buffer size to set, 0 default
+	uint32_t notsentLowat;			///< Not sent low water mark, 0 default
+	uint32_t sndBufLen;				///< Send buffer size of the socket
+	uint64_t txUs;					///< Time of the last command sent, in us
+	uint64_t phaseUs;				///< Time the running phase started, in us
+	Rec *rec;						///< Session recording, NULL if none
+	int mss;						///< TCP maximum segment size
+	uint32_t nonce;					///< Last readiness probe nonce
 	union {
 		uint16_t flags;				///< Various flags
 		struct {
 			uint16_t connected:1;	///< Connected to server if TRUE
-			uint16_t reserved:15;	///< Unused flags
+			uint16_t verKnown:1;	///< Bootloader version obtained
+			uint16_t crc:1;			///< Bootloader supports WF_CMD_CRC32
+			uint16_t lz:1;			///< Bootloader supports WF_CMD_PROGRAM_LZ
+			uint16_t reserved:12;	///< Unused flags
 		};
 	};
-} WfData;
-
-// Local module data
-static WfData d;
+};
 
 /************************************************************************//**
- * Module initialization. Must be called once before using the module.
+ * Creates a connection context. Each context has its own connection,
+ * buffers and statistics. A context must not be used by several threads
+ * at once, but different contexts can be used concurrently.
+ *
+ * \return The new context, or NULL if it could not be allocated.
  ****************************************************************************/
-void WfInit(void) {
-	memset(&d, 0, sizeof(WfData));
+WfCtx *WfCtxNew(void) {
+	WfCtx *wf;
+
+	if (!(wf = calloc(1, sizeof(WfCtx)))) return NULL;
+	wf->pipe.window = 1;
+	WfStatsReset(wf);
+#ifdef WF_URING
+	// Classic system calls are used if io_uring is not available
+	wf->ring = UringNew(WF_URING_ENTRIES);
+#endif
 #ifdef __WIN32__
     // Stupid winsock stuff
    WORD versionWanted = MAKEWORD(1, 1);
    WSADATA wsaData;
    WSAStartup(versionWanted, &wsaData);
+#endif
+	return wf;
+}
+
+/************************************************************************//**
+ * Closes the connection of a context, if open, and frees the context.
+ *
+ * \param[in] wf Connection context. Can be NULL.
+ ****************************************************************************/
+void WfCtxFree(WfCtx *wf) {
+	if (!wf) return;
+	WfClose(wf);
+#ifdef WF_URING
+	UringFree(wf->ring);
+#endif
+	RecClose(wf->rec);
+	free(wf);
+}
+
+// Closes the socket after a transport error. The context stays usable to
+// connect again.
+static void WfDisconnect(WfCtx *wf) {
+	closesck(wf->sock);
+#ifdef __linux__
+	close(wf->ep);
+#endif
+	wf->connected = FALSE;
+	wf->pipe.count = 0;
+	wf->pipe.readBytes = 0;
+	wf->pipe.rxDone = 0;
+}
+
+/************************************************************************//**
+ * Waits until the socket is ready for any of the requested events, or
+ * until the deadline passes. Uses epoll on Linux, and select() elsewhere.
+ *
+ * \param[in] wf       Connection context.
+ * \param[in] events   WF_EV_IN and/or WF_EV_OUT.
+ * \param[in] deadline Time limit, as returned by TimeUs(). If already
+ *                     passed, readiness is polled without waiting.
+ *
+ * \return Ready events, 0 if the deadline passed, or WF_ERROR on error.
+ * Socket errors and hang-ups are reported as ready, so the next socket
+ * call reports them.
+ ****************************************************************************/
+static int WfIoWait(WfCtx *wf, int events, uint64_t deadline) {
+	uint64_t now = TimeUs();
+	int ms = deadline > now?(deadline - now + 999) / 1000:0;
+	int ready;
+#ifdef __linux__
+	struct epoll_event ev;
+
+	if (events != wf->evMask) {
+		ev.events = (events & WF_EV_IN?EPOLLIN:0) |
+			(events & WF_EV_OUT?EPOLLOUT:0);
+		ev.data.fd = wf->sock;
+		if (epoll_ctl(wf->ep, EPOLL_CTL_MOD, wf->sock, &ev)) return WF_ERROR;
+		wf->evMask = events;
+	}
+	while ((ready = epoll_wait(wf->ep, &ev, 1, ms)) < 0 && errno == EINTR);
+	if (ready <= 0) return ready?WF_ERROR:0;
+	if (ev.events & (EPOLLERR | EPOLLHUP)) return events;
+	ready = (ev.events & EPOLLIN?WF_EV_IN:0) |
+		(ev.events & EPOLLOUT?WF_EV_OUT:0);
+#else
+	fd_set rfds, wfds;
+	struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+	if (events & WF_EV_IN) FD_SET(wf->sock, &rfds);
+	if (events & WF_EV_OUT) FD_SET(wf->sock, &wfds);
+	if ((ready = select(wf->sock + 1, &rfds, &wfds, NULL, &tv)) <= 0) {
+		return ready?WF_ERROR:0;
+	}
+	ready = (FD_ISSET(wf->sock, &rfds)?WF_EV_IN:0) |
+		(FD_ISSET(wf->sock, &wfds)?WF_EV_OUT:0);
+#endif
+	return ready & events;
+}
+
+// Makes the socket non-blocking, so no call can block past a deadline.
+static int WfSockNonBlock(int sock) {
+#ifdef __WIN32__
+	u_long on = 1;
+
+	return ioctlsocket(sock, FIONBIO, &on);
+#else
+	int fl = fcntl(sock, F_GETFL);
+
+	return fl < 0 || fcntl(sock, F_SETFL, fl | O_NONBLOCK);
 #endif
 }
 
-int WfConnect(char host[], uint16_t port) {
+// Connects the non-blocking socket, waiting at most WF_CONNECT_MS.
+static int WfSockConnect(WfCtx *wf, const struct sockaddr *addr,
+		socklen_t addrLen) {
+	int err = 0;
+	socklen_t errLen = sizeof(int);
+
+	if (!connect(wf->sock, addr, addrLen)) return WF_OK;
+	if (!WF_WOULDBLOCK() || (WfIoWait(wf, WF_EV_OUT,
+					TimeUs() + WF_CONNECT_MS * 1000) <= 0)) {
+		return WF_ERROR;
+	}
+	if (getsockopt(wf->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &errLen) ||
+			err) return WF_ERROR;
+	return WF_OK;
+}
+
+// Sets the tuned socket options, if any.
+static int WfSockOptsSet(WfCtx *wf) {
+	int val;
+
+	if ((val = wf->sndBuf) && setsockopt(wf->sock, SOL_SOCKET, SO_SNDBUF,
+				(char*)&val, sizeof(int))) return WF_ERROR;
+#ifdef TCP_NOTSENT_LOWAT
+	if ((val = wf->notsentLowat) && setsockopt(wf->sock, IPPROTO_TCP,
+				TCP_NOTSENT_LOWAT, (char*)&val, sizeof(int))) return WF_ERROR;
+#endif
+	return WF_OK;
+}
+
+int WfSockTune(WfCtx *wf, uint32_t sndBuf, uint32_t notsentLowat) {
+#ifndef TCP_NOTSENT_LOWAT
+	if (notsentLowat) return WF_ERROR;
+#endif
+	if ((sndBuf > INT32_MAX) || (notsentLowat > INT32_MAX)) return WF_ERROR;
+	wf->sndBuf = sndBuf;
+	wf->notsentLowat = notsentLowat;
+	return WF_OK;
+}
+
+int WfConnect(WfCtx *wf, char host[], uint16_t port) {
 	const struct addrinfo hints = {
 	    .ai_family = AF_INET,
 	    .ai_socktype = SOCK_STREAM,
@@ -70,102 +343,625 @@ int WfConnect(char host[], uint16_t port) {
 
 	struct addrinfo *srvInfo;
 	char strPort[6];
-	int flag = 1; 
+	int flag = 1;
+	socklen_t optLen = sizeof(int);
+	uint64_t startUs = TimeUs();
+#ifdef __linux__
+	struct epoll_event ev;
+#endif
 
 	// DNS lookup code
-	snprintf(strPort, 5, "%d", port);
-	strPort[5] = '\0';
+	snprintf(strPort, sizeof(strPort), "%d", port);
 	if ((getaddrinfo(host, strPort, &hints, &srvInfo) != 0) || (!srvInfo)) {
 		PrintErr("DNS error for %s:%s\n", host, strPort);
 		if (srvInfo) freeaddrinfo(srvInfo);
 		return WF_ERROR;
 	}
-	d.srvAddr = &((struct sockaddr_in *)srvInfo->ai_addr)->sin_addr;
+	TraceSpan("net", "getaddrinfo", startUs, 0, 0);
+	wf->srvAddr = &((struct sockaddr_in *)srvInfo->ai_addr)->sin_addr;
 
 	// Create socket ...
-	d.sock = socket(srvInfo->ai_family, srvInfo->ai_socktype, 0);
-	if (d.sock < 0) {
+	wf->sock = socket(srvInfo->ai_family, srvInfo->ai_socktype, 0);
+	if (wf->sock < 0) {
 		freeaddrinfo(srvInfo);
 		PrintErr("Could not create socket!\n");
 		return WF_ERROR;
 	}
-	// Disable Nagle algorithm
-	if (setsockopt(d.sock, IPPROTO_TCP, TCP_NODELAY, (char*)&flag,
-			sizeof(int))) {
+	// Disable Nagle algorithm, and never block on socket calls
+	if (setsockopt(wf->sock, IPPROTO_TCP, TCP_NODELAY, (char*)&flag,
+			sizeof(int)) || WfSockNonBlock(wf->sock) ||
+			WfSockOptsSet(wf)) {
 		freeaddrinfo(srvInfo);
-		closesck(d.sock);
+		closesck(wf->sock);
 		PrintErr("Could not set socket options!\n");
+		return WF_ERROR;
 	}
+#ifdef __linux__
+	// The socket is watched for writing until connected
+	ev.events = EPOLLOUT;
+	ev.data.fd = wf->sock;
+	wf->evMask = WF_EV_OUT;
+	if (((wf->ep = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+			epoll_ctl(wf->ep, EPOLL_CTL_ADD, wf->sock, &ev)) {
+		if (wf->ep >= 0) close(wf->ep);
+		freeaddrinfo(srvInfo);
+		closesck(wf->sock);
+		PrintErr("Could not create epoll instance!\n");
+		return WF_ERROR;
+	}
+#endif
 	// ... and connect!
-	if (connect(d.sock, srvInfo->ai_addr, srvInfo->ai_addrlen) != 0) {
-		closesck(d.sock);
+	startUs = TimeUs();
+	if (WfSockConnect(wf, srvInfo->ai_addr, srvInfo->ai_addrlen)) {
+		WfDisconnect(wf);
 		freeaddrinfo(srvInfo);
 		PrintErr("Could not connect to %s:%s.\n", host, strPort);
 		return WF_ERROR;
 	}
+	TraceSpan("net", "connect", startUs, 0, 0);
 
-	d.connected = TRUE;
+	// Segment size is used to estimate the number of segments sent
+	wf->mss = 0;
+#ifdef TCP_MAXSEG
+	getsockopt(wf->sock, IPPROTO_TCP, TCP_MAXSEG, (char*)&wf->mss, &optLen);
+#endif
+	if (wf->mss <= 0) wf->mss = WF_DEF_MSS;
+	optLen = sizeof(int);
+	if (getsockopt(wf->sock, SOL_SOCKET, SO_SNDBUF, (char*)&flag, &optLen)) {
+		flag = 0;
+	}
+	wf->sndBufLen = flag;
+	wf->tcpUs = 0;
+
+	wf->connected = TRUE;
 	// Connection succesful!
 	freeaddrinfo(srvInfo);
 	return WF_OK;
 }
 
-void WfClose(void) {
-	if (d.connected) closesck(d.sock);
+void WfClose(WfCtx *wf) {
+	if (wf->connected) WfDisconnect(wf);
+	// Commands in flight are lost, and the next host can be another cart
+	wf->pipe.head = wf->pipe.count = 0;
+	wf->pipe.readBytes = 0;
+	wf->batch.niov = wf->batch.ncmd = 0;
+	wf->verKnown = wf->crc = wf->lz = FALSE;
 }
 
-// NOTE: Data must be directly copied to d.buf.cmd.data
-static inline int WfCmdSend(uint16_t cmd, uint16_t dataLen) {
-	d.buf.cmd.cmd = cmd;
-	d.buf.cmd.len = dataLen;
-	if (send(d.sock, (char*)&d.buf, dataLen + WF_HEADLEN, 0) !=
-			(dataLen + WF_HEADLEN)) {
-		closesck(d.sock);
-		d.connected = FALSE;
+static int WfPipeAckRecv(WfCtx *wf);
+
+// Accounts a send system call that sent len bytes, in a set of statistics.
+static inline void WfIoSentAdd(WfIoStats *io, ssize_t len, int mss) {
+	io->sendCalls++;
+	if (len > 0) {
+		io->bytesSent += len;
+		// Each send call pushes at least a segment, since Nagle is disabled
+		io->segments += (len + mss - 1) / mss;
+	}
+}
+
+// Accounts a send system call that sent len bytes.
+static inline void WfIoSent(WfCtx *wf, ssize_t len) {
+	WfIoSentAdd(&wf->io, len, wf->mss);
+	WfIoSentAdd(&wf->stats.io, len, wf->mss);
+}
+
+// Accounts a receive system call that received len bytes.
+static inline void WfIoRecvd(WfCtx *wf, ssize_t len) {
+	wf->io.recvCalls++;
+	wf->stats.io.recvCalls++;
+	if (len > 0) {
+		wf->io.bytesRecv += len;
+		wf->stats.io.bytesRecv += len;
+	}
+}
+
+// Receives data from the socket, accounting the system call.
+static inline ssize_t WfRecv(WfCtx *wf, void *buf, size_t len) {
+	ssize_t recvd;
+
+	recvd = recv(wf->sock, (char*)buf, len, 0);
+	WfIoRecvd(wf, recvd);
+	return recvd;
+}
+
+// Adds a TCP connection state sample to the statistics.
+static void WfTcpStatsAdd(WfTcpStats *t, const TcpInfo *ti, uint32_t sndBuf) {
+	if (!t->samples++) {
+		t->rttMinUs = ti->rttUs;
+		t->cwndMin = ti->cwnd;
+		t->retransBase = ti->retrans;
+	}
+	t->rttUs = ti->rttUs;
+	t->rttMinUs = MIN(t->rttMinUs, ti->rttUs);
+	t->rttMaxUs = MAX(t->rttMaxUs, ti->rttUs);
+	t->rttSumUs += ti->rttUs;
+	t->rttvarMaxUs = MAX(t->rttvarMaxUs, ti->rttvarUs);
+	t->cwnd = ti->cwnd;
+	t->cwndMin = MIN(t->cwndMin, ti->cwnd);
+	t->retrans = ti->retrans - t->retransBase;
+	t->unackedMax = MAX(t->unackedMax, ti->unacked);
+	t->notsentMax = MAX(t->notsentMax, ti->notsent);
+	t->sndBuf = sndBuf;
+}
+
+// Samples the TCP connection state, unless it was sampled less than
+// WF_TCP_SAMPLE_MS ago.
+static void WfTcpSample(WfCtx *wf) {
+	uint64_t now = TimeUs();
+	TcpInfo ti;
+
+	if (!wf->connected || (now - wf->tcpUs < WF_TCP_SAMPLE_MS * 1000) ||
+			TcpInfoGet(wf->sock, &ti)) return;
+	wf->tcpUs = now;
+	WfTcpStatsAdd(&wf->tcp, &ti, wf->sndBufLen);
+	WfTcpStatsAdd(&wf->stats.tcp, &ti, wf->sndBufLen);
+}
+
+// Checks if a command programs data, raw or compressed.
+static inline int WfCmdProgram(uint16_t cmd) {
+	return (cmd == WF_CMD_PROGRAM) || (cmd == WF_CMD_PROGRAM_LZ);
+}
+
+// Obtains the flash bytes covered by a command on a range of len bytes.
+static inline uint32_t WfCmdBytes(uint16_t cmd, uint32_t len) {
+	return (cmd == WF_CMD_ERASE) || WfCmdProgram(cmd) ||
+		(cmd == WF_CMD_READ) || (cmd == WF_CMD_CRC32)?len:0;
+}
+
+// Accounts a program command of len bytes, sending sent bytes of payload.
+static inline void WfProgAdd(WfCtx *wf, uint16_t cmd, uint32_t len,
+		uint32_t sent) {
+	WfProgStats *p = &wf->stats.prog;
+
+	p->chunks++;
+	if (cmd == WF_CMD_PROGRAM_LZ) p->lzChunks++;
+	p->bytes += len;
+	p->sent += sent;
+}
+
+// Accounts a command issued at sentUs, now completed, covering bytes of
+// flash from addr. The reply data (replyLen bytes) is only recorded.
+static void WfCmdDone(WfCtx *wf, uint16_t cmd, uint32_t addr,
+		uint64_t sentUs, uint32_t bytes, const void *reply,
+		uint32_t replyLen) {
+	uint64_t us = TimeUs() - sentUs;
+	const char *name = WfCmdName(cmd);
+	WfCmdStats *c;
+	unsigned int b;
+
+	if (wf->rec) RecFrame(wf->rec, REC_RX, cmd, NULL, 0, reply, replyLen);
+	WfTcpSample(wf);
+	TraceAsync("cmd", name?name:"unknown", sentUs, addr, bytes);
+	wf->stats.bytes += bytes;
+	if (cmd >= WF_STATS_CMDS) return;
+	c = &wf->stats.cmd[cmd];
+	c->count++;
+	c->totalUs += us;
+	c->bytes += bytes;
+	c->maxUs = MAX(c->maxUs, MIN(us, UINT32_MAX));
+	for (b = 0; (b < WF_LAT_BUCKETS - 1) && (us >> b); b++);
+	c->hist[b]++;
+}
+
+#ifdef WF_URING
+// Receives len bytes through io_uring, waiting for all of them with a single
+// system call, unless the deadline passes first.
+static inline ssize_t WfRingRecv(WfCtx *wf, void *buf, size_t len,
+		uint64_t deadline) {
+	ssize_t recvd;
+
+	recvd = UringRecv(wf->ring, wf->sock, buf, len, MSG_WAITALL, deadline);
+	WfIoRecvd(wf, recvd);
+	return recvd;
+}
+
+// Sends a message through io_uring, waiting for all of it to be sent with
+// a single system call. Fails if it cannot be sent in WF_CMD_MS.
+static inline ssize_t WfRingSend(WfCtx *wf, struct msghdr *msg, int flags) {
+	ssize_t sent;
+
+	sent = UringSendMsg(wf->ring, wf->sock, msg, flags | MSG_WAITALL,
+			TimeUs() + WF_CMD_MS * 1000);
+	if ((sent < 0) && (errno == ETIME)) PrintErr("Timeout sending data!\n");
+	return sent;
+}
+#endif
+
+// Obtains the time a command on a range of len bytes can take to complete,
+// in us. Erasing and checking CRCs take time proportional to the range.
+static inline uint64_t WfCmdUs(uint16_t cmd, uint32_t len) {
+	uint64_t blocks = ((uint64_t)len + 0xFFFF) >> 16;
+
+	return (uint64_t)1000 * (WF_CMD_MS + (cmd == WF_CMD_ERASE?
+				blocks * WF_ERASE_MS_64K:cmd == WF_CMD_CRC32?
+				blocks * WF_CRC_MS_64K:0));
+}
+
+/************************************************************************//**
+ * Receives, without blocking, the available part of the reply to the
+ * oldest pending command: its acknowledge, then its data for reads. The
+ * reply can arrive in any number of pieces, and reception resumes where it
+ * stopped. A complete reply retires the command, passing read data to the
+ * callback.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return 1 if the reply was completed, 0 if more data is needed, or
+ * WF_ERROR on error.
+ ****************************************************************************/
+static int WfPipeRxStep(WfCtx *wf) {
+	WfPending *p = &wf->pipe.pend[wf->pipe.head];
+	uint32_t want = WF_HEADLEN + (p->cmd == WF_CMD_READ?p->len:0);
+	uint32_t done = wf->pipe.rxDone;
+	ssize_t recvd;
+
+	while (done < want) {
+		if (done < WF_HEADLEN) {
+			recvd = WfRecv(wf, (uint8_t*)wf->pipe.ack + done,
+					WF_HEADLEN - done);
+		} else recvd = WfRecv(wf, p->buf + done - WF_HEADLEN, want - done);
+		if ((recvd < 0) && WF_WOULDBLOCK()) {
+			wf->pipe.rxDone = done;
+			return 0;
+		}
+		if ((recvd <= 0) || (((done += recvd) == WF_HEADLEN) &&
+				((wf->pipe.ack[0] != WF_CMD_OK) || wf->pipe.ack[1]))) {
+			PrintErr("Error receiving acknowledge of command %d at "
+					"0x%06X!\n", p->cmd, p->addr);
+			WfDisconnect(wf);
+			return WF_ERROR;
+		}
+	}
+
+	wf->pipe.rxDone = 0;
+	WfCmdDone(wf, p->cmd, p->addr, p->sent, WfCmdBytes(p->cmd, p->len),
+			p->cmd == WF_CMD_READ?p->buf:NULL,
+			p->cmd == WF_CMD_READ?p->len:0);
+	wf->pipe.lastAck = TimeUs();
+	if (WfCmdProgram(p->cmd)) {
+		wf->pipe.stats.ackUs = wf->pipe.lastAck - p->sent;
+	}
+	wf->pipe.head = (wf->pipe.head + 1) % WF_PIPE_MAX;
+	wf->pipe.count--;
+	if (p->cmd == WF_CMD_READ) {
+		wf->pipe.readBytes -= p->len;
+		// Replies to the commands still pending would be out of sync
+		if (!p->cb(p->addr, p->buf, p->len, p->ctx)) {
+			WfDisconnect(wf);
+			return WF_ERROR;
+		}
+	}
+	return 1;
+}
+
+// Receives, without blocking, the replies to pending commands that have
+// already arrived.
+static int WfPipeRxPoll(WfCtx *wf) {
+	int done = 1;
+
+	while (wf->pipe.count && (done = WfPipeRxStep(wf)) > 0);
+	return done < 0?WF_ERROR:WF_OK;
+}
+
+// Waits until the socket can be written, or the deadline passes. Replies
+// to pending commands are received meanwhile, so the server never blocks
+// sending them while the client blocks sending to the server.
+static int WfSendWait(WfCtx *wf, uint64_t deadline) {
+	int ready;
+
+	do {
+		ready = WfIoWait(wf, WF_EV_OUT | (wf->pipe.count?WF_EV_IN:0),
+				deadline);
+		if ((ready > 0) && (ready & WF_EV_IN) && WfPipeRxPoll(wf)) {
+			return WF_ERROR;
+		}
+	} while ((ready > 0) && !(ready & WF_EV_OUT));
+	if (!ready) PrintErr("Timeout sending data!\n");
+	return ready > 0?WF_OK:WF_ERROR;
+}
+
+/************************************************************************//**
+ * Checks if the connection to the host is still usable. The connection is
+ * idle between commands, so data or end of stream waiting to be received
+ * means the host closed it, or is not the bootloader anymore.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if connected and no data is waiting, FALSE otherwise.
+ ****************************************************************************/
+int WfAlive(WfCtx *wf) {
+	return wf->connected && !wf->pipe.count && !WfIoWait(wf, WF_EV_IN, 0);
+}
+
+// Receives exactly len bytes from the socket, in as many pieces as they
+// arrive, before the deadline. The connection is closed if they cannot
+// be received.
+static int WfRecvAll(WfCtx *wf, void *buf, uint32_t len, uint64_t deadline) {
+	uint64_t startUs = TimeUs();
+	uint32_t total = len;
+	ssize_t recvd;
+	int ready = 1;
+
+	while (len && (ready > 0)) {
+#ifdef WF_URING
+		if (wf->ring) recvd = WfRingRecv(wf, buf, len, deadline);
+		else
+#endif
+		recvd = WfRecv(wf, buf, len);
+		if (recvd > 0) {
+			len -= recvd;
+			buf = (uint8_t*)buf + recvd;
+		} else if ((recvd < 0) && WF_WOULDBLOCK()) {
+			ready = WfIoWait(wf, WF_EV_IN, deadline);
+#ifdef WF_URING
+		} else if ((recvd < 0) && (errno == ETIME)) {
+			ready = 0;
+#endif
+		} else ready = WF_ERROR;
+	}
+	if (len) {
+		if (!ready) PrintErr("Timeout receiving data!\n");
+		WfDisconnect(wf);
+		return WF_ERROR;
+	}
+	TraceSpan("net", "recv", startUs, 0, total);
+	return WF_OK;
+}
+
+// Sends the buffers in iov using a single gather write if possible. Sends
+// resume where they stopped, and fail if no data can be sent for WF_CMD_MS.
+// The iov array is modified.
+static int WfSendV(WfCtx *wf, struct iovec *iov, int iovcnt, int flags) {
+	uint64_t startUs = TimeUs();
+	uint32_t total = 0;
+	ssize_t sent;
+	int i;
+#ifndef __WIN32__
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+#endif
+	for (i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+	while (iovcnt) {
+#ifdef __WIN32__
+		sent = send(wf->sock, iov->iov_base, iov->iov_len, 0);
+#else
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+#ifdef WF_URING
+		// Blocking in the kernel is only safe when the server does not
+		// need replies to be received to keep reading
+		if (wf->ring && !wf->pipe.readBytes) {
+			sent = WfRingSend(wf, &msg, flags);
+		} else
+#endif
+		sent = sendmsg(wf->sock, &msg, flags);
+#endif
+		WfIoSent(wf, sent);
+		if ((sent < 0) && WF_WOULDBLOCK()) {
+			if (WfSendWait(wf, TimeUs() + WF_CMD_MS * 1000)) return WF_ERROR;
+			continue;
+		}
+		if (sent <= 0) return WF_ERROR;
+		// Skip completely sent buffers, and adjust the partially sent one
+		while (iovcnt && (size_t)sent >= iov->iov_len) {
+			sent -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	TraceSpan("net", "send", startUs, 0, total);
+	// Data waiting in the send buffer is highest right after sending
+	WfTcpSample(wf);
+	return WF_OK;
+}
+
+// Sends all the batched commands with a single gather write.
+static int WfBatchFlush(WfCtx *wf) {
+	int err = WF_OK;
+
+	if (wf->batch.niov) err = WfSendV(wf, wf->batch.iov, wf->batch.niov, 0);
+	wf->batch.niov = wf->batch.ncmd = 0;
+	if (err) {
+		if (wf->connected) WfDisconnect(wf);
+		PrintErr("Error sending data to server!\n");
+	}
+	return err;
+}
+
+// Sends the command framed in wf->tx, followed by an optional payload, as a
+// single gather write. If batching is active and the command does not need
+// to be sent immediately (queue is TRUE), the command is queued instead.
+// NOTE: Data must be directly copied to wf->tx.cmd.data
+static int WfCmdPost(WfCtx *wf, uint16_t cmd, uint16_t dataLen,
+		const void *payload, uint32_t payLen, int flags, int queue) {
+	struct iovec iov[2];
+	struct iovec *v = iov;
+	int iovcnt = 0;
+
+	wf->tx.cmd.cmd = cmd;
+	wf->tx.cmd.len = dataLen;
+	wf->io.cmds++;
+	wf->stats.io.cmds++;
+	wf->txUs = TimeUs();
+	if (wf->rec) {
+		RecFrame(wf->rec, REC_TX, cmd, wf->tx.cmd.data, dataLen, payload,
+				payLen);
+	}
+	// Queue the command if batching and it fits. Otherwise send it along
+	// with anything already queued.
+	if (queue && wf->batch.active && dataLen <= WF_BATCH_ARGLEN) {
+		if (wf->batch.ncmd == WF_PIPE_MAX && WfBatchFlush(wf)) return WF_ERROR;
+		v = wf->batch.iov + wf->batch.niov;
+		memcpy(wf->batch.frame[wf->batch.ncmd], &wf->tx, WF_HEADLEN + dataLen);
+		v[0].iov_base = wf->batch.frame[wf->batch.ncmd++];
+	} else {
+		if (WfBatchFlush(wf)) return WF_ERROR;
+		v[0].iov_base = &wf->tx;
+	}
+	v[0].iov_len = WF_HEADLEN + dataLen;
+	iovcnt++;
+	if (payLen) {
+		v[1].iov_base = (void*)payload;
+		v[1].iov_len = payLen;
+		iovcnt++;
+	}
+	if (v != iov) {
+		wf->batch.niov += iovcnt;
+		return dataLen + WF_HEADLEN;
+	}
+
+	if (WfSendV(wf, iov, iovcnt, flags)) {
+		if (wf->connected) WfDisconnect(wf);
 		PrintErr("Error sending data to server!\n");
 		return WF_ERROR;
 	}
 	return dataLen + WF_HEADLEN;
 }
 
+// Sends a payload following a previously sent command.
+static int WfPayloadSend(WfCtx *wf, const void *data, uint32_t len,
+		int flags) {
+	struct iovec iov = {(void*)data, len};
+
+	if (wf->rec) {
+		RecFrame(wf->rec, REC_DATA, wf->tx.cmd.cmd, NULL, 0, data, len);
+	}
+	if (WfSendV(wf, &iov, 1, flags)) {
+		if (wf->connected) WfDisconnect(wf);
+		PrintErr("Error sending data!\n");
+		return WF_ERROR;
+	}
+	return WF_OK;
+}
+
+// Waits until all pipelined commands are acknowledged. Acknowledges are
+// not received in wf->tx, so command arguments already there are preserved.
+static int WfPipeDrain(WfCtx *wf) {
+	while (wf->pipe.count) {
+		if (WfPipeAckRecv(wf) != WF_OK) return WF_ERROR;
+	}
+	return WF_OK;
+}
+
+// NOTE: Data must be directly copied to wf->tx.cmd.data
+static inline int WfCmdSend(WfCtx *wf, uint16_t cmd, uint16_t dataLen) {
+	// Synchronous commands cannot be mixed with unacknowledged ones
+	if (WfPipeDrain(wf) != WF_OK) return WF_ERROR;
+	return WfCmdPost(wf, cmd, dataLen, NULL, 0, 0, FALSE);
+}
 
-static inline int WfReplyRecv(int dataLen) {
-	int recvd;
+// Receives the reply to the command in wf->tx, which must have dataLen
+// bytes of data, before the command deadline. Read commands are accounted
+// once their data is received.
+static inline int WfReplyRecv(WfCtx *wf, int dataLen) {
+	// Range length is the second argument of range commands
+	uint16_t cmd = wf->tx.cmd.cmd;
+	uint64_t startUs = TimeUs();
+	uint64_t deadline = startUs + WfCmdUs(cmd, wf->tx.cmd.dwdata[1]);
 
-	recvd = recv(d.sock, (char*)&d.buf, WF_HEADLEN + dataLen, 0);
-	if ((recvd != (WF_HEADLEN + dataLen)) || (d.buf.cmd.cmd != WF_OK) ||
-			(d.buf.cmd.len != dataLen)) {
-		closesck(d.sock);
-		d.connected = FALSE;
+	if ((WfRecvAll(wf, &wf->rx, WF_HEADLEN, deadline) != WF_OK) ||
+			(wf->rx.cmd.cmd != WF_OK) || (wf->rx.cmd.len != dataLen) ||
+			(WfRecvAll(wf, wf->rx.cmd.data, dataLen, deadline) != WF_OK)) {
+		if (wf->connected) WfDisconnect(wf);
 		PrintErr("Error receiving data from server!\n");
 		return WF_ERROR;
 	}
-	return recvd;
+	TraceSpan("net", "ack wait", startUs, wf->tx.cmd.dwdata[0],
+			WfCmdBytes(cmd, wf->tx.cmd.dwdata[1]));
+	if (cmd != WF_CMD_READ) {
+		WfCmdDone(wf, cmd, wf->tx.cmd.dwdata[0], wf->txUs,
+				WfCmdBytes(cmd, wf->tx.cmd.dwdata[1]), wf->rx.cmd.data,
+				dataLen);
+	}
+	return WF_HEADLEN + dataLen;
+}
+
+/************************************************************************//**
+ * Waits until the bootloader is ready to process commands. Data sent
+ * while the bootloader is starting is lost, so echo commands carrying a
+ * nonce are sent with exponential backoff, until the echo of the last one
+ * is received. Echoes of previous probes are discarded.
+ *
+ * \param[in] wf        Connection context.
+ * \param[in] timeoutMs Maximum time to wait, in milliseconds.
+ *
+ * \return Number of probes sent if the bootloader is ready, or WF_ERROR
+ * if it did not answer in time.
+ ****************************************************************************/
+int WfReady(WfCtx *wf, uint32_t timeoutMs) {
+	uint64_t deadline = TimeUs() + (uint64_t)timeoutMs * 1000;
+	uint32_t waitMs = WF_PROBE_MIN_MS;
+	uint64_t startUs = TimeUs();
+	uint32_t nonce;
+	int probes = 0;
+
+	if (WfPipeDrain(wf) != WF_OK) return WF_ERROR;
+	while (TimeUs() < deadline) {
+		// Nonces only need to differ from the previous ones
+		nonce = ++wf->nonce;
+		memcpy(wf->tx.cmd.data, &nonce, sizeof(uint32_t));
+		if (WfCmdPost(wf, WF_CMD_ECHO, sizeof(uint32_t), NULL, 0, 0, FALSE) !=
+				(sizeof(uint32_t) + WF_HEADLEN)) return WF_ERROR;
+		probes++;
+		// Collect replies until the one to this probe, or until the wait
+		// times out. Replies come in order, so older ones arrive first.
+		while (WfIoWait(wf, WF_EV_IN, TimeUs() + waitMs * 1000) > 0) {
+			if ((WfRecvAll(wf, &wf->rx, WF_HEADLEN, deadline) != WF_OK) ||
+					(wf->rx.cmd.len > (WF_MAX_DATALEN - WF_HEADLEN)) ||
+					(WfRecvAll(wf, wf->rx.cmd.data, wf->rx.cmd.len,
+							   deadline) != WF_OK)) {
+				PrintErr("Error receiving probe reply!\n");
+				return WF_ERROR;
+			}
+			if ((wf->rx.cmd.cmd == WF_CMD_OK) &&
+					(wf->rx.cmd.len == sizeof(uint32_t)) &&
+					!memcmp(wf->rx.cmd.data, &nonce, sizeof(uint32_t))) {
+				WfCmdDone(wf, WF_CMD_ECHO, 0, wf->txUs, 0, &nonce,
+						sizeof(uint32_t));
+				TraceSpan("net", "settle", startUs, 0, 0);
+				return probes;
+			}
+		}
+		waitMs = MIN(2 * waitMs, WF_PROBE_MAX_MS);
+	}
+
+	PrintErr("Bootloader not ready after %u ms!\n", timeoutMs);
+	return WF_ERROR;
 }
 
 /************************************************************************//**
  * Obtains the version numbers of the bootloader.
  *
+ * \param[in] wf Connection context.
+ *
  * \return A two byte array with the bootloader version numbers (the first
  * is the major number and the second is the minor number), or NULL if
  * the version numbers could not be obtained.
  ****************************************************************************/
-uint8_t *WfBootVerGet(void) {
+uint8_t *WfBootVerGet(WfCtx *wf) {
 	// Send command and receive reply
-	if (WfCmdSend(WF_CMD_VERSION_GET, 0) != WF_HEADLEN) {
+	if (WfCmdSend(wf, WF_CMD_VERSION_GET, 0) != WF_HEADLEN) {
 		PrintErr("Error requesting wflash version.\n");
 		return NULL;
 	}
-	if (WfReplyRecv(2) != (2 + WF_HEADLEN)) {
+	if (WfReplyRecv(wf, 2) != (2 + WF_HEADLEN)) {
 		PrintErr("Error receiving version data.\n");
 		return NULL;
 	}
-	return d.buf.cmd.data;
+	return wf->rx.cmd.data;
 }
 
 /************************************************************************//**
  * Obtains the Flash chip identifiers.
  *
+ * \param[in] wf Connection context.
+ *
  * \return A four byte array with the Flash chip identifiers or NULL if the
  * Flash chip identifiers could not be obtained. The returned numbers are:
  * 1. The manufacturer ID
@@ -173,36 +969,37 @@ uint8_t *WfBootVerGet(void) {
  * 3. The chip ID (second byte)
  * 4. The chip ID (third byte)
  ****************************************************************************/
-uint8_t *WfFlashIdsGet(void) {
-	if (WfCmdSend(WF_CMD_ID_GET, 0) != WF_HEADLEN) {
+uint8_t *WfFlashIdsGet(WfCtx *wf) {
+	if (WfCmdSend(wf, WF_CMD_ID_GET, 0) != WF_HEADLEN) {
 		PrintErr("Error requesting flash IDs.\n");
 		return NULL;
 	}
-	if (WfReplyRecv(4) != (4 + WF_HEADLEN)) {
+	if (WfReplyRecv(wf, 4) != (4 + WF_HEADLEN)) {
 		PrintErr("Error receiving IDs.\n");
 		return NULL;
 	}
-	return d.buf.cmd.data;
+	return wf->rx.cmd.data;
 }
 
 /************************************************************************//**
  * Erases an address range of the flash chip.
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Start address of the range to erase.
  * \param[in] len  Length of the address to range.
  *
  * \return WF_OK if connection is successful, WF_ERROR otherwise.
  * \warning
  ****************************************************************************/
-int WfFlashErase(uint32_t addr, uint32_t len) {
-	d.buf.cmd.dwdata[0] = addr;
-	d.buf.cmd.dwdata[1] = len;
+int WfFlashErase(WfCtx *wf, uint32_t addr, uint32_t len) {
+	wf->tx.cmd.dwdata[0] = addr;
+	wf->tx.cmd.dwdata[1] = len;
 
-	if (WfCmdSend(WF_CMD_ERASE, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
+	if (WfCmdSend(wf, WF_CMD_ERASE, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
 		PrintErr("Error requesting FLASH ERASE.\n");
 		return WF_ERROR;
 	}
-	if (WfReplyRecv(0) != WF_HEADLEN) {
+	if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
 		PrintErr("Error executing FLASH ERASE.\n");
 		return WF_ERROR;
 	}
@@ -212,13 +1009,14 @@ int WfFlashErase(uint32_t addr, uint32_t len) {
 /************************************************************************//**
  * Programs a data block to the specified Flash address
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address to which the block will be written.
  * \param[in] len  Length of the data block.
  * \param[in] data Data block to program to the Flash.
  *
  * \return The number of bytes programmed to the Flash chip.
  ****************************************************************************/
-int WfFlash(uint32_t addr, uint32_t len, uint8_t data[]) {
+int WfFlash(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t data[]) {
 //	uint32_t i;
 //	uint16_t toSend;
 
@@ -226,71 +1024,745 @@ int WfFlash(uint32_t addr, uint32_t len, uint8_t data[]) {
 	// 1. write command is issued.
 	// 2. Once acknowledge, data is sent in chuncks of WF_MAX_DATALEN bytes
 	//    maximum
-	d.buf.cmd.dwdata[0] = addr;
-	d.buf.cmd.dwdata[1] = len;
-	if (WfCmdSend(WF_CMD_PROGRAM, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
+	wf->tx.cmd.dwdata[0] = addr;
+	wf->tx.cmd.dwdata[1] = len;
+	if (WfCmdSend(wf, WF_CMD_PROGRAM, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
 		PrintErr("Error requesting Flash Program.\n");
 		return WF_ERROR;
 	}
-	if (WfReplyRecv(0) != WF_HEADLEN) {
+	if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
 		PrintErr("Error receiving Flash Program confirmation.\n");
 		return WF_ERROR;
 	}
+	WfProgAdd(wf, WF_CMD_PROGRAM, len, len);
 	// Send data payload in chuncks of WF_MAX_DATALEN bytes
 //	for (i = 0; i < len; i += toSend) {
 //		toSend = MIN(len - i, WF_MAX_DATALEN);
-//		memcpy(d.buf.data, data + i, toSend);
-//		if (send(d.sock, d.buf.data, toSend, 0) != toSend) {
+//		memcpy(wf->tx.data, data + i, toSend);
+//		if (send(wf->sock, wf->tx.data, toSend, 0) != toSend) {
 //			PrintErr("Error sending Flash Program payload.\n");
 //			return WF_ERROR;
 //		}
 //	}
-	if (send(d.sock, (char*)data, len, 0) != len) {
-		PrintErr("Error sending data!\n");
+	return WfPayloadSend(wf, data, len, 0);
+}
+
+// Receives the reply to the oldest pending pipelined command. The server
+// processes commands in order, so the command deadline counts from when it
+// was sent or the previous one completed, whatever happened last.
+static int WfPipeAckRecv(WfCtx *wf) {
+	WfPending *p = &wf->pipe.pend[wf->pipe.head];
+	uint8_t count = wf->pipe.count;
+	uint64_t startUs = TimeUs();
+	uint64_t deadline;
+	int done, ready;
+
+	// Batched commands must be sent before waiting for their acknowledge.
+	// Replies received while sending them also count.
+	if (wf->batch.ncmd && WfBatchFlush(wf)) return WF_ERROR;
+	if (wf->pipe.count < count) return WF_OK;
+	deadline = MAX(p->sent, wf->pipe.lastAck) + WfCmdUs(p->cmd, p->len);
+	while (!(done = WfPipeRxStep(wf))) {
+		if ((ready = WfIoWait(wf, WF_EV_IN, deadline)) <= 0) {
+			PrintErr("%s acknowledge of command %d at 0x%06X!\n",
+					ready?"Error waiting for":"Timeout waiting for",
+					p->cmd, p->addr);
+			WfDisconnect(wf);
+			return WF_ERROR;
+		}
+	}
+	TraceSpan("net", "ack wait", startUs, p->addr,
+			WfCmdBytes(p->cmd, p->len));
+	return done < 0?WF_ERROR:WF_OK;
+}
+
+/************************************************************************//**
+ * Sets the maximum number of program commands that can be in flight
+ * (sent but not yet acknowledged). Also resets pipeline statistics.
+ *
+ * \param[in] wf     Connection context.
+ * \param[in] window Number of commands in flight, from 1 to WF_PIPE_MAX.
+ *
+ * \return WF_OK if the window was set, WF_ERROR if out of range.
+ ****************************************************************************/
+int WfPipeWindowSet(WfCtx *wf, unsigned int window) {
+	if (!window || window > WF_PIPE_MAX) return WF_ERROR;
+	wf->pipe.window = window;
+	memset(&wf->pipe.stats, 0, sizeof(WfPipeStats));
+	return WF_OK;
+}
+
+// Sends a command with address and length arguments through the pipeline,
+// followed by the first payLen bytes of its payload (if any). With a window
+// of 1, waits for the command acknowledge before sending the payload
+// (stop-and-wait). Otherwise only waits for room in the window, and command
+// and payload are sent with a single gather write. Any remaining payload
+// must be sent right after. Compressed program commands take the whole
+// payload, its length being their third argument.
+static int WfPipeCmd(WfCtx *wf, uint16_t cmd, uint32_t addr, uint32_t len,
+		const uint8_t *payload, uint32_t payLen, int flags) {
+	uint16_t argLen = 2 * 4;
+	WfPending *p;
+	uint64_t sent;
+
+	// Wait for room in the window, and collect any reply that has already
+	// arrived, even partially, to keep the receive path drained.
+	while (wf->pipe.count >= wf->pipe.window) {
+		if (WfPipeAckRecv(wf) != WF_OK) return WF_ERROR;
+	}
+	if (WfPipeRxPoll(wf)) return WF_ERROR;
+
+	wf->tx.cmd.dwdata[0] = addr;
+	wf->tx.cmd.dwdata[1] = len;
+	if (cmd == WF_CMD_PROGRAM_LZ) {
+		wf->tx.cmd.lz.zLen = payLen;
+		argLen = sizeof(WfLzRange);
+	}
+	if (WfCmdProgram(cmd)) {
+		wf->pipe.stats.chunks++;
+		WfProgAdd(wf, cmd, len, cmd == WF_CMD_PROGRAM_LZ?payLen:len);
+	}
+	if (wf->pipe.window <= 1) {
+		if (WfCmdProgram(cmd)) wf->pipe.stats.inFlight++;
+		sent = TimeUs();
+		if (WfCmdPost(wf, cmd, argLen, NULL, 0, 0, FALSE) !=
+				(argLen + WF_HEADLEN)) {
+			PrintErr("Error requesting command %d.\n", cmd);
+			return WF_ERROR;
+		}
+		if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
+			PrintErr("Error receiving command %d confirmation.\n", cmd);
+			return WF_ERROR;
+		}
+		if (WfCmdProgram(cmd)) wf->pipe.stats.ackUs = TimeUs() - sent;
+		return payLen?WfPayloadSend(wf, payload, payLen, flags):WF_OK;
+	}
+
+	// Command and payload are sent back to back: the server reads the
+	// payload from the stream once it has acknowledged the command.
+	if (WfCmdPost(wf, cmd, argLen, payload, payLen, flags, TRUE) !=
+			(argLen + WF_HEADLEN)) {
+		PrintErr("Error requesting command %d.\n", cmd);
+		return WF_ERROR;
+	}
+	p = &wf->pipe.pend[(wf->pipe.head + wf->pipe.count) % WF_PIPE_MAX];
+	p->cmd = cmd;
+	p->addr = addr;
+	p->len = len;
+	p->sent = TimeUs();
+	wf->pipe.count++;
+	if (WfCmdProgram(cmd)) wf->pipe.stats.inFlight += wf->pipe.count;
+
+	return WF_OK;
+}
+
+/************************************************************************//**
+ * Programs a data block to the specified Flash address, without waiting
+ * for the command to be acknowledged, as long as the window allows it.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address to which the block will be written.
+ * \param[in] len  Length of the data block.
+ * \param[in] data Data block to program to the Flash.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ *
+ * \note The data buffer can be reused as soon as this function returns.
+ * \note Call WfPipeFlush() after the last block, to make sure all the
+ * blocks have been acknowledged by the server.
+ ****************************************************************************/
+int WfFlashPipe(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t data[]) {
+	return WfPipeCmd(wf, WF_CMD_PROGRAM, addr, len, data, len, 0);
+}
+
+/************************************************************************//**
+ * Programs a compressed data block (see lz.h) to the specified Flash
+ * address, the bootloader decompressing it. Like WfFlashPipe(), does not
+ * wait for the command to be acknowledged if the window allows it. Only
+ * supported if WfLzSupported() returns TRUE.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address to which the block will be written.
+ * \param[in] len  Length of the data block, up to WF_LZ_CHUNK_MAX.
+ * \param[in] z    Compressed data block.
+ * \param[in] zLen Length of the compressed data block.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ *
+ * \note The compressed data buffer can be reused as soon as this function
+ * returns.
+ ****************************************************************************/
+int WfFlashLzPipe(WfCtx *wf, uint32_t addr, uint32_t len, const uint8_t z[],
+		uint32_t zLen) {
+	if (!len || (len > WF_LZ_CHUNK_MAX) || !zLen ||
+			(zLen > WF_LZ_CHUNK_MAX)) return WF_ERROR;
+	return WfPipeCmd(wf, WF_CMD_PROGRAM_LZ, addr, len, z, zLen, 0);
+}
+
+/************************************************************************//**
+ * Programs a data block to the specified Flash address, sending it
+ * directly from a file descriptor. On Linux, the data is sent using
+ * sendfile(), so it is not copied to user space. Like WfFlashPipe(), does
+ * not wait for the command to be acknowledged if the window allows it.
+ *
+ * \param[in] wf      Connection context.
+ * \param[in] addr    Address to which the block will be written.
+ * \param[in] len     Length of the data block.
+ * \param[in] fd      File descriptor of the file containing the block.
+ * \param[in] offset  Offset of the block in the file.
+ * \param[in] head    Data sent instead of the first headLen bytes of the
+ *                    block (e.g. a patched ROM header). Can be NULL.
+ * \param[in] headLen Length of the head data.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfFlashFd(WfCtx *wf, uint32_t addr, uint32_t len, int fd, uint32_t offset,
+		const uint8_t head[], uint32_t headLen) {
+	uint64_t startUs;
+	off_t pos;
+	ssize_t sent;
+
+	if (headLen > len) return WF_ERROR;
+	// Head is sent from user memory along with the command. Unless it is
+	// the whole block, tell the stack more data follows, to avoid sending
+	// a short segment. File data cannot be batched, so flush any batch.
+	if ((WfPipeCmd(wf, WF_CMD_PROGRAM, addr, len, head, headLen,
+			headLen < len?WF_MSG_MORE:0) != WF_OK) || WfBatchFlush(wf)) {
+		return WF_ERROR;
+	}
+	pos = offset + headLen;
+	len -= headLen;
+	// File data is not in memory, its CRC is not recorded
+	if (wf->rec && len) {
+		RecFrame(wf->rec, REC_DATA, WF_CMD_PROGRAM, NULL, 0, NULL, len);
+	}
+	startUs = TimeUs();
+	while (len) {
+#ifdef __linux__
+		sent = sendfile(wf->sock, fd, &pos, len);
+		WfIoSent(wf, sent);
+#else
+		sent = 0;
+		if (lseek(fd, pos, SEEK_SET) == pos) {
+			sent = read(fd, wf->tx.data, MIN(len, WF_MAX_DATALEN));
+		}
+		// File errors must not be taken for a full socket buffer
+		if (sent > 0) {
+			sent = send(wf->sock, (char*)wf->tx.data, sent, 0);
+			WfIoSent(wf, sent);
+		} else sent = 0;
+		if (sent > 0) pos += sent;
+#endif
+		if ((sent < 0) && WF_WOULDBLOCK()) {
+			if (WfSendWait(wf, TimeUs() + WF_CMD_MS * 1000)) sent = 0;
+			else continue;
+		}
+		if (sent <= 0) {
+			if (wf->connected) WfDisconnect(wf);
+			PrintErr("Error sending data!\n");
+			return WF_ERROR;
+		}
+		len -= sent;
+	}
+	TraceSpan("net", "sendfile", startUs, addr + headLen,
+			pos - offset - headLen);
+
+	return WF_OK;
+}
+
+/************************************************************************//**
+ * Erases an address range of the flash chip, without waiting for the
+ * command to be acknowledged, as long as the window allows it. Erase
+ * commands are processed in order with program commands, so an erase can
+ * be queued right ahead of the data that needs it.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Start address of the range to erase.
+ * \param[in] len  Length of the address to range.
+ *
+ * \return WF_OK if the command was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfErasePipe(WfCtx *wf, uint32_t addr, uint32_t len) {
+	return WfPipeCmd(wf, WF_CMD_ERASE, addr, len, NULL, 0, 0);
+}
+
+/************************************************************************//**
+ * Queues a read command in the pipeline, along with program and erase
+ * commands, without waiting for its data as long as the window allows it.
+ * Because commands are processed in order, the read sees the result of the
+ * commands queued before it. This allows reading back flashed data while
+ * the next chunks are being sent. The data is received later, while
+ * sending other commands or on WfPipeFlush(), and passed to the callback.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address from which to start reading.
+ * \param[in] len  Length of the data block to read.
+ * \param[in] buf  Buffer receiving the data. Must remain valid until the
+ *                 callback is called.
+ * \param[in] cb   Function receiving the data. Returning 0 makes the
+ *                 pipeline fail.
+ * \param[in] ctx  Context passed to the callback.
+ *
+ * \return WF_OK if the command was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfReadQueue(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t buf[],
+		WfReadCb cb, void *ctx) {
+	WfPending *p;
+
+	if (len > WF_READ_INFLIGHT) return WF_ERROR;
+	while (wf->pipe.readBytes + len > WF_READ_INFLIGHT) {
+		if (WfPipeAckRecv(wf) != WF_OK) return WF_ERROR;
+	}
+	if (WfPipeCmd(wf, WF_CMD_READ, addr, len, NULL, 0, 0) != WF_OK) {
 		return WF_ERROR;
 	}
+	// Stop-and-wait: command has already been acknowledged
+	if (wf->pipe.window <= 1) {
+		if (WfRecvAll(wf, buf, len, TimeUs() + WfCmdUs(WF_CMD_READ, len)) !=
+				WF_OK) {
+			PrintErr("Error receiving ROM data!\n");
+			return WF_ERROR;
+		}
+		WfCmdDone(wf, WF_CMD_READ, addr, wf->txUs, len, buf, len);
+		return cb(addr, buf, len, ctx)?WF_OK:WF_ERROR;
+	}
+	p = &wf->pipe.pend[(wf->pipe.head + wf->pipe.count - 1) % WF_PIPE_MAX];
+	p->buf = buf;
+	p->cb = cb;
+	p->ctx = ctx;
+	wf->pipe.readBytes += len;
+
 	return WF_OK;
 }
 
+/************************************************************************//**
+ * Waits until all the pipelined commands have been acknowledged.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if all commands were acknowledged, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfPipeFlush(WfCtx *wf) {
+	return WfPipeDrain(wf);
+}
+
+/************************************************************************//**
+ * Starts batching pipelined commands. Until WfBatchEnd() is called,
+ * pipelined commands are queued instead of being sent immediately. Queued
+ * commands are sent together with a single gather write, when the
+ * pipeline has to wait for an acknowledge or when the batch is full.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \warning While batching, data passed to WfFlashPipe() must remain valid
+ * until WfBatchEnd() returns.
+ ****************************************************************************/
+void WfBatchBegin(WfCtx *wf) {
+	wf->batch.active = TRUE;
+}
+
+/************************************************************************//**
+ * Sends any batched command and stops batching.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if batched commands were sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfBatchEnd(WfCtx *wf) {
+	wf->batch.active = FALSE;
+	return WfBatchFlush(wf);
+}
+
+/************************************************************************//**
+ * Obtains the program pipeline statistics.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the pipeline statistics.
+ ****************************************************************************/
+const WfPipeStats *WfPipeStatsGet(WfCtx *wf) {
+	return &wf->pipe.stats;
+}
+
+/************************************************************************//**
+ * Obtains the transport statistics.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the transport statistics.
+ ****************************************************************************/
+const WfIoStats *WfIoStatsGet(WfCtx *wf) {
+	return &wf->io;
+}
+
+/************************************************************************//**
+ * Obtains the TCP connection statistics, sampled since the transport
+ * statistics were reset (WfIoStatsReset()).
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the TCP connection statistics.
+ ****************************************************************************/
+const WfTcpStats *WfTcpStatsGet(WfCtx *wf) {
+	return &wf->tcp;
+}
+
+/************************************************************************//**
+ * Obtains the name of the backend used for the transport: "io_uring", or
+ * "classic" when not built with WF_URING or not supported by the kernel.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Backend name.
+ ****************************************************************************/
+const char *WfBackend(WfCtx *wf) {
+#ifdef WF_URING
+	if (wf->ring) return "io_uring";
+#endif
+	return "classic";
+}
+
+/************************************************************************//**
+ * Resets the transport statistics.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfIoStatsReset(WfCtx *wf) {
+	memset(&wf->io, 0, sizeof(WfIoStats));
+	memset(&wf->tcp, 0, sizeof(WfTcpStats));
+}
+
+/************************************************************************//**
+ * Resets the session statistics, and starts measuring a new session.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfStatsReset(WfCtx *wf) {
+	memset(&wf->stats, 0, sizeof(WfStats));
+	wf->stats.startUs = TimeUs();
+}
+
+// Obtains the difference of two sets of transport statistics, d = a - b.
+static void WfIoStatsDiff(WfIoStats *d, const WfIoStats *a,
+		const WfIoStats *b) {
+	d->cmds = a->cmds - b->cmds;
+	d->sendCalls = a->sendCalls - b->sendCalls;
+	d->recvCalls = a->recvCalls - b->recvCalls;
+	d->segments = a->segments - b->segments;
+	d->bytesSent = a->bytesSent - b->bytesSent;
+	d->bytesRecv = a->bytesRecv - b->bytesRecv;
+}
+
+/************************************************************************//**
+ * Starts a phase of the session. The running phase, if any, ends. Phases
+ * beyond WF_PHASES_MAX are added to the last one.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] name Name of the phase. Must remain valid while the
+ *                 statistics are used.
+ ****************************************************************************/
+void WfPhaseStart(WfCtx *wf, const char *name) {
+	WfStats *s = &wf->stats;
+	WfPhase *p;
+
+	WfPhaseEnd(wf);
+	if (s->nPhases < WF_PHASES_MAX) {
+		p = s->phase + s->nPhases++;
+		p->name = name;
+	} else p = s->phase + WF_PHASES_MAX - 1;
+	// While running, the phase holds the session values at its start,
+	// minus what it accounted before (when it is the last one)
+	wf->phaseUs = TimeUs();
+	p->startUs = wf->phaseUs - p->us;
+	p->bytes = s->bytes - p->bytes;
+	WfIoStatsDiff(&p->io, &s->io, &p->io);
+	s->inPhase = TRUE;
+}
+
+/************************************************************************//**
+ * Ends the running phase, if any.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfPhaseEnd(WfCtx *wf) {
+	WfStats *s = &wf->stats;
+	WfPhase *p;
+
+	if (!s->inPhase) return;
+	p = s->phase + s->nPhases - 1;
+	TraceSpan("phase", p->name, wf->phaseUs, 0, 0);
+	p->us = TimeUs() - p->startUs;
+	p->bytes = s->bytes - p->bytes;
+	WfIoStatsDiff(&p->io, &s->io, &p->io);
+	s->inPhase = FALSE;
+}
+
+/************************************************************************//**
+ * Obtains the session statistics. The running phase is only accounted
+ * once it ends.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the session statistics.
+ ****************************************************************************/
+const WfStats *WfStatsGet(WfCtx *wf) {
+	return &wf->stats;
+}
+
+/************************************************************************//**
+ * Obtains the name of a command code.
+ *
+ * \param[in] cmd Command code.
+ *
+ * \return Command name, or NULL if the code is not known.
+ ****************************************************************************/
+const char *WfCmdName(uint16_t cmd) {
+	static const char * const name[WF_CMD_MAX] = {
+		"version", "echo", "id", "erase", "program", "read", "run",
+		"autorun", "crc32", "program_lz"
+	};
+
+	return cmd < WF_CMD_MAX?name[cmd]:NULL;
+}
+
+/************************************************************************//**
+ * Starts recording the frames sent and received (see record.h), until
+ * WfRecordStop() is called. Commands are recorded when issued, and their
+ * replies when completely received.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] file Name of the file to write the recording to.
+ *
+ * \return WF_OK if recording, WF_ERROR if the file could not be created.
+ ****************************************************************************/
+int WfRecordStart(WfCtx *wf, const char *file) {
+	if (wf->rec) RecClose(wf->rec);
+	return (wf->rec = RecCreate(file))?WF_OK:WF_ERROR;
+}
+
+/************************************************************************//**
+ * Stops recording, writing the recording file.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if the recording was written or there was none, WF_ERROR
+ * otherwise.
+ ****************************************************************************/
+int WfRecordStop(WfCtx *wf) {
+	int err = RecClose(wf->rec);
+
+	wf->rec = NULL;
+	return err?WF_ERROR:WF_OK;
+}
+
 /************************************************************************//**
  * Reads a data block from the specified Flash address
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address from which to start reading.
  * \param[in] len  Length of the data block to read.
  * \param[in] buf  Buffer where the readed data will be placed.
  *
- * \return The number of bytes programmed to the Flash chip.
+ * \return WF_OK if the complete block was read, WF_ERROR otherwise.
  ****************************************************************************/
-uint32_t WfRead(uint32_t addr, uint32_t len, uint8_t buf[]) {
-	uint32_t total;
-	ssize_t recvd;
-
+int WfRead(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t buf[]) {
 	// Reading uses two stages:
 	// 1. Read command is issued.
 	// 2. Once acknowledged, data is received in chuncks of WF_MAX_DATALEN
 	//    bytes maximum (controlled automatically by recv().
-	d.buf.cmd.dwdata[0] = addr;
-	d.buf.cmd.dwdata[1] = len;
-	if (WfCmdSend(WF_CMD_READ, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
+	wf->tx.cmd.dwdata[0] = addr;
+	wf->tx.cmd.dwdata[1] = len;
+	if (WfCmdSend(wf, WF_CMD_READ, 2 * 4) != (2 * 4 + WF_HEADLEN)) {
 		PrintErr("Error requesting ROM read.\n");
-		return 0;
+		return WF_ERROR;
 	}
-	if (WfReplyRecv(0) != WF_HEADLEN) {
+	if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
 		PrintErr("Error receiving ROM read confirmation.\n");
-		return 0;
+		return WF_ERROR;
+	}
+	// Receive exactly the requested length, data is followed by the
+	// replies to the next commands.
+	if (WfRecvAll(wf, buf, len, TimeUs() + WfCmdUs(WF_CMD_READ, len)) != WF_OK) {
+		PrintErr("Error receiving ROM data!\n");
+		return WF_ERROR;
+	}
+	WfCmdDone(wf, WF_CMD_READ, addr, wf->txUs, len, buf, len);
+
+	return WF_OK;
+}
+
+// Receives the acknowledge and the data of a pipelined read request.
+static int WfReadChunkRecv(WfCtx *wf, uint8_t buf[], uint32_t len) {
+	uint64_t deadline = TimeUs() + WfCmdUs(WF_CMD_READ, len);
+	uint16_t ack[WF_HEADLEN / 2];
+
+	if (WfRecvAll(wf, ack, WF_HEADLEN, deadline) != WF_OK) return WF_ERROR;
+	if ((ack[0] != WF_CMD_OK) || (ack[1] != 0)) {
+		WfDisconnect(wf);
+		return WF_ERROR;
+	}
+	return WfRecvAll(wf, buf, len, deadline);
+}
+
+/************************************************************************//**
+ * Reads a memory range keeping several read commands in flight, so the
+ * link does not idle waiting for each chunk to be requested. Chunks are
+ * received in order into buf, and handed to a callback as soon as each one
+ * completes, so the range can be streamed without buffering it.
+ *
+ * \param[in] wf       Connection context.
+ * \param[in] addr     Address from which to start reading.
+ * \param[in] len      Length of the range to read.
+ * \param[in] chunkLen Length of the first chunks to request.
+ * \param[in] window   Number of read commands in flight, from 1 to
+ *                     WF_PIPE_MAX.
+ * \param[in] buf      Buffer receiving each chunk.
+ * \param[in] bufLen   Length of buf. Longer chunks are not requested.
+ * \param[in] cb       Function receiving each chunk.
+ * \param[in] ctx      Context passed to the callback.
+ *
+ * \return WF_OK if the complete range was read, WF_ERROR otherwise.
+ *
+ * \note Pipelined program commands are acknowledged before reading.
+ ****************************************************************************/
+int WfReadPipe(WfCtx *wf, uint32_t addr, uint32_t len, uint32_t chunkLen,
+		unsigned int window, uint8_t buf[], uint32_t bufLen, WfReadCb cb,
+		void *ctx) {
+	// Lengths and issue times of the requests in flight, oldest first
+	uint32_t reqLen[WF_PIPE_MAX];
+	uint64_t reqUs[WF_PIPE_MAX];
+	uint8_t head = 0, count = 0;
+	uint32_t reqAddr = addr;
+	uint32_t end = addr + len;
+	uint32_t toRead;
+	int batching = wf->batch.active;
+
+	if (!window || (window > WF_PIPE_MAX) || !bufLen) return WF_ERROR;
+	// Data replies cannot be mixed with unacknowledged commands
+	if (WfPipeDrain(wf) != WF_OK) return WF_ERROR;
+
+	// Requests issued together are sent with a single gather write
+	wf->batch.active = TRUE;
+	chunkLen = MIN(chunkLen, bufLen);
+	while (addr < end) {
+		while (chunkLen && (count < window) && (reqAddr < end)) {
+			toRead = MIN(chunkLen, end - reqAddr);
+			wf->tx.cmd.dwdata[0] = reqAddr;
+			wf->tx.cmd.dwdata[1] = toRead;
+			if (WfCmdPost(wf, WF_CMD_READ, 2 * 4, NULL, 0, 0, TRUE) !=
+					(2 * 4 + WF_HEADLEN)) break;
+			reqUs[(head + count) % WF_PIPE_MAX] = wf->txUs;
+			reqLen[(head + count++) % WF_PIPE_MAX] = toRead;
+			reqAddr += toRead;
+		}
+		if (!count) break;
+		if (WfBatchFlush(wf) ||
+				(WfReadChunkRecv(wf, buf, reqLen[head]) != WF_OK)) {
+			PrintErr("Error receiving ROM data at 0x%06X!\n", addr);
+			wf->batch.active = batching;
+			return WF_ERROR;
+		}
+		toRead = reqLen[head];
+		WfCmdDone(wf, WF_CMD_READ, addr, reqUs[head], toRead, buf,
+				toRead);
+		head = (head + 1) % WF_PIPE_MAX;
+		count--;
+		// Callback sets the length of the next requests. Once it aborts,
+		// replies to the requests in flight are just discarded.
+		if (chunkLen) {
+			chunkLen = cb(addr, buf, toRead, ctx);
+			chunkLen = MIN(chunkLen, bufLen);
+		}
+		addr += toRead;
+		if (!chunkLen) end = reqAddr;
 	}
-	// Receive data
-	total = 0;
-	while ((recvd = recv(d.sock, (char*)(buf + total), len - total, 0)) > 0) {
-		total += recvd;
+	wf->batch.active = batching;
+
+	return (addr == end) && chunkLen?WF_OK:WF_ERROR;
+}
+
+// Queries the bootloader version the first time, to know the commands it
+// supports. Returns FALSE if the version is not known.
+static int WfVerQuery(WfCtx *wf) {
+	uint8_t *ver;
+
+	if (!wf->verKnown) {
+		if (!(ver = WfBootVerGet(wf))) return FALSE;
+		wf->crc = ver[0] > 0 || ver[1] >= WF_CRC32_MINOR;
+		wf->lz = ver[0] > 0 || ver[1] >= WF_LZ_MINOR;
+		wf->verKnown = TRUE;
+	}
+	return TRUE;
+}
+
+/************************************************************************//**
+ * Checks if the bootloader supports computing CRCs (WfCrc32()). The
+ * bootloader version is queried the first time.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if supported, FALSE if not supported or not known.
+ ****************************************************************************/
+int WfCrc32Supported(WfCtx *wf) {
+	return WfVerQuery(wf) && wf->crc;
+}
+
+/************************************************************************//**
+ * Checks if the bootloader supports programming compressed data
+ * (WfFlashLzPipe()). The bootloader version is queried the first time.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if supported, FALSE if not supported or not known.
+ ****************************************************************************/
+int WfLzSupported(WfCtx *wf) {
+	return WfVerQuery(wf) && wf->lz;
+}
+
+/************************************************************************//**
+ * Obtains the CRC-32 of the blocks of a memory range, computed by the
+ * bootloader, so the range can be verified without reading it back.
+ *
+ * \param[in]  wf       Connection context.
+ * \param[in]  addr     Start address of the range.
+ * \param[in]  len      Length of the range.
+ * \param[in]  blockLen Length of each block. The last block can be
+ *                      shorter.
+ * \param[out] crc      CRC of each block, in order.
+ *
+ * \return WF_OK if all the CRCs were obtained, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfCrc32(WfCtx *wf, uint32_t addr, uint32_t len, uint32_t blockLen,
+		uint32_t crc[]) {
+	uint32_t toCheck, n;
+
+	if (!blockLen) return WF_ERROR;
+	// Each command can get up to WF_CRC32_MAX CRCs
+	for (; len; len -= toCheck, addr += toCheck, crc += n) {
+		toCheck = MIN(len, (uint64_t)blockLen * WF_CRC32_MAX);
+		n = (toCheck + blockLen - 1) / blockLen;
+		wf->tx.cmd.crc.addr = addr;
+		wf->tx.cmd.crc.len = toCheck;
+		wf->tx.cmd.crc.blockLen = blockLen;
+		if (WfCmdSend(wf, WF_CMD_CRC32, sizeof(WfCrcRange)) !=
+				(sizeof(WfCrcRange) + WF_HEADLEN)) {
+			PrintErr("Error requesting CRC.\n");
+			return WF_ERROR;
+		}
+		if (WfReplyRecv(wf, n * 4) != (n * 4 + WF_HEADLEN)) {
+			PrintErr("Error receiving CRC of 0x%06X:%X.\n", addr, toCheck);
+			return WF_ERROR;
+		}
+		memcpy(crc, wf->rx.cmd.data, n * 4);
 	}
 
-	return total;
+	return WF_OK;
 }
 
 /************************************************************************//**
  * Reads a data block from the specified Flash address
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address from where to boot the ROM.
  *
  * \return WF_OK if boot command completed, or WF_ERROR if command failed.
@@ -299,14 +1771,14 @@ uint32_t WfRead(uint32_t addr, uint32_t len, uint8_t buf[]) {
  * before shutting down the WiFi module, it is possible that WF_ERROR is
  * returned on a boot command completed successfully.
  ****************************************************************************/
-int WfBoot(uint32_t addr) {
-	d.buf.cmd.dwdata[0] = addr;
+int WfBoot(WfCtx *wf, uint32_t addr) {
+	wf->tx.cmd.dwdata[0] = addr;
 
-	if (WfCmdSend(WF_CMD_RUN, 4) != (4 + WF_HEADLEN)) {
+	if (WfCmdSend(wf, WF_CMD_RUN, 4) != (4 + WF_HEADLEN)) {
 		PrintErr("Error requesting ROM boot.\n");
 		return WF_ERROR;
 	}
-	if (WfReplyRecv(0) != WF_HEADLEN) {
+	if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
 		PrintErr("Error receiving ROM boot confirmation.\n");
 		return WF_ERROR;
 	}
@@ -316,6 +1788,8 @@ int WfBoot(uint32_t addr) {
 /************************************************************************//**
  * Boots the ROM automatically.
  *
+ * \param[in] wf Connection context.
+ *
  * \return WF_OK if boot command completed, or WF_ERROR if command failed.
  *
  * \note Because the bootloader will only wait a small fraction of time
@@ -325,12 +1799,12 @@ int WfBoot(uint32_t addr) {
  * field of the ROM header. The boot address is located there by the
  * ROM upload utility.
  ****************************************************************************/
-int WfAutoRun(void) {
-	if (WfCmdSend(WF_CMD_AUTORUN, 0) != (WF_HEADLEN)) {
+int WfAutoRun(WfCtx *wf) {
+	if (WfCmdSend(wf, WF_CMD_AUTORUN, 0) != (WF_HEADLEN)) {
 		PrintErr("Error requesting ROM boot.\n");
 		return WF_ERROR;
 	}
-	if (WfReplyRecv(0) != WF_HEADLEN) {
+	if (WfReplyRecv(wf, 0) != WF_HEADLEN) {
 		PrintErr("Error receiving ROM boot confirmation.\n");
 		return WF_ERROR;
 	}
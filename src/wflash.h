@@ -18,39 +18,195 @@
 /// Function completed with error
 #define WF_ERROR	-1
 
+/// Maximum number of commands that can be in flight in the pipeline
+#define WF_PIPE_MAX	32
+
+/// Program pipeline statistics
+typedef struct {
+	uint32_t chunks;	///< Number of program commands sent
+	uint32_t inFlight;	///< Sum of commands in flight, sampled on each send
+	uint32_t ackUs;		///< Latency of the last program acknowledge, in us
+} WfPipeStats;
+
+/// Transport statistics
+typedef struct {
+	uint32_t cmds;		///< Number of commands sent
+	uint32_t sendCalls;	///< Number of send system calls
+	uint32_t recvCalls;	///< Number of receive system calls
+	uint32_t segments;	///< Estimated number of TCP segments sent
+	uint32_t bytesSent;	///< Number of bytes sent
+	uint32_t bytesRecv;	///< Number of bytes received
+} WfIoStats;
+
+/// Minimum time between TCP connection state samples, in milliseconds
+#define WF_TCP_SAMPLE_MS	50
+
+/// TCP connection statistics, sampled from the kernel (TCP_INFO, Linux
+/// only) as commands complete and data is sent, at most every
+/// WF_TCP_SAMPLE_MS.
+typedef struct {
+	uint32_t samples;		///< Number of samples taken
+	uint32_t rttUs;			///< Last smoothed round trip time, in us
+	uint32_t rttMinUs;		///< Lowest smoothed round trip time, in us
+	uint32_t rttMaxUs;		///< Highest smoothed round trip time, in us
+	uint64_t rttSumUs;		///< Sum of the sampled round trip times, in us
+	uint32_t rttvarMaxUs;	///< Highest round trip time variation, in us
+	uint32_t cwnd;			///< Last congestion window, in segments
+	uint32_t cwndMin;		///< Smallest congestion window, in segments
+	uint32_t retrans;		///< Segments retransmitted since the first sample
+	uint32_t retransBase;	///< Retransmitted segments at the first sample
+	uint32_t unackedMax;	///< Most segments in flight
+	uint32_t notsentMax;	///< Most bytes in the send buffer not sent yet
+	uint32_t sndBuf;		///< Socket send buffer size, in bytes
+} WfTcpStats;
+
+/// Number of command codes with statistics
+#define WF_STATS_CMDS	16
+/// Number of buckets of the command latency histograms. Bucket n counts the
+/// latencies from 2^(n-1) us up to 2^n us, the last one also longer ones.
+#define WF_LAT_BUCKETS	25
+/// Maximum number of phases recorded in a session
+#define WF_PHASES_MAX	16
+
+/// Statistics of a command type. Latency goes from the command being
+/// issued until its reply (including read data) is completely received.
+typedef struct {
+	uint32_t count;					///< Number of completed commands
+	uint32_t maxUs;					///< Longest latency, in us
+	uint64_t totalUs;				///< Sum of the latencies, in us
+	uint64_t bytes;					///< Flash bytes covered by the commands
+	uint32_t hist[WF_LAT_BUCKETS];	///< Latency histogram
+} WfCmdStats;
+
+/// Statistics of a phase of the session (e.g. erase, flash or verify)
+typedef struct {
+	const char *name;	///< Name of the phase
+	uint64_t startUs;	///< Start time, in us
+	uint64_t us;		///< Duration, in us
+	uint64_t bytes;		///< Flash bytes covered by the completed commands
+	WfIoStats io;		///< Transport statistics
+} WfPhase;
+
+/// Program statistics. Tell how much compressing the program payloads
+/// (WfFlashLzPipe()) saved.
+typedef struct {
+	uint32_t chunks;				///< Program commands sent
+	uint32_t lzChunks;				///< Of them, sent compressed
+	uint64_t bytes;					///< Bytes to program
+	uint64_t sent;					///< Payload bytes sent for them
+} WfProgStats;
+
+/// Session statistics, kept for the whole session regardless of
+/// WfIoStatsReset() calls
+typedef struct {
+	uint64_t startUs;				///< Time statistics were reset, in us
+	uint64_t bytes;					///< Flash bytes covered by commands
+	WfIoStats io;					///< Transport statistics
+	WfTcpStats tcp;					///< TCP connection statistics
+	WfProgStats prog;				///< Program statistics
+	WfCmdStats cmd[WF_STATS_CMDS];	///< Statistics of each command code
+	WfPhase phase[WF_PHASES_MAX];	///< Phases, in order
+	uint8_t nPhases;				///< Number of phases
+	uint8_t inPhase;				///< Last phase is still running
+} WfStats;
+
+/// Connection context, holding the state of a connection to a cart
+typedef struct WfCtx WfCtx;
+
 /************************************************************************//**
- * Module initialization. Must be called once before using the module.
+ * Creates a connection context. Each context has its own connection,
+ * buffers and statistics. A context must not be used by several threads
+ * at once, but different contexts can be used concurrently.
+ *
+ * \return The new context, or NULL if it could not be allocated.
+ ****************************************************************************/
+WfCtx *WfCtxNew(void);
+
+/************************************************************************//**
+ * Closes the connection of a context, if open, and frees the context.
+ *
+ * \param[in] wf Connection context. Can be NULL.
  ****************************************************************************/
-void WfInit(void);
+void WfCtxFree(WfCtx *wf);
 
 /************************************************************************//**
  * Connects to specified MegaWiFi host (address/IP and port).
  *
+ * \param[in] wf   Connection context.
  * \param[in] host Host name of the MegaWiFi node. Address name and IP are
  *            supported.
  * \param[in] port TCP port number of the MegaWiFi host.
  *
  * \return WF_OK if connection is successful, WF_ERROR otherwise.
  ****************************************************************************/
-int WfConnect(char host[], uint16_t port);
+int WfConnect(WfCtx *wf, char host[], uint16_t port);
+
+/************************************************************************//**
+ * Sets socket options applied to the next connections. They are meant to
+ * be tuned using the TCP statistics (WfTcpStatsGet()): a bigger send
+ * buffer can keep more data in flight when the congestion window is
+ * limited by it, and a not sent low water mark keeps data queued in the
+ * kernel (which delays the commands behind it) low.
+ *
+ * \param[in] wf           Connection context.
+ * \param[in] sndBuf       Socket send buffer size (SO_SNDBUF) in bytes, 0
+ *                         for the system default.
+ * \param[in] notsentLowat Bytes not sent yet above which the socket is not
+ *                         writable (TCP_NOTSENT_LOWAT), 0 for the system
+ *                         default.
+ *
+ * \return WF_OK if the options are supported, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfSockTune(WfCtx *wf, uint32_t sndBuf, uint32_t notsentLowat);
 
 /************************************************************************//**
  * Closes a previously established connection with a MegaWiFi host.
+ *
+ * \param[in] wf Connection context.
  ****************************************************************************/
-void WfClose(void);
+void WfClose(WfCtx *wf);
+
+/************************************************************************//**
+ * Checks if the connection to the host is still usable. The connection is
+ * idle between commands, so data or end of stream waiting to be received
+ * means the host closed it, or is not the bootloader anymore.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if connected and no data is waiting, FALSE otherwise.
+ ****************************************************************************/
+int WfAlive(WfCtx *wf);
+
+/************************************************************************//**
+ * Waits until the bootloader is ready to process commands. Data sent
+ * while the bootloader is starting is lost, so echo commands carrying a
+ * nonce are sent with exponential backoff, until the echo of the last one
+ * is received. Echoes of previous probes are discarded.
+ *
+ * \param[in] wf        Connection context.
+ * \param[in] timeoutMs Maximum time to wait, in milliseconds.
+ *
+ * \return Number of probes sent if the bootloader is ready, or WF_ERROR
+ * if it did not answer in time.
+ ****************************************************************************/
+int WfReady(WfCtx *wf, uint32_t timeoutMs);
 
 /************************************************************************//**
  * Obtains the version numbers of the bootloader.
  *
+ * \param[in] wf Connection context.
+ *
  * \return A two byte array with the bootloader version numbers (the first
  * is the major number and the second is the minor number), or NULL if
  * the version numbers could not be obtained.
  ****************************************************************************/
-uint8_t *WfBootVerGet(void);
+uint8_t *WfBootVerGet(WfCtx *wf);
 	
 /************************************************************************//**
  * Obtains the Flash chip identifiers.
  *
+ * \param[in] wf Connection context.
+ *
  * \return A four byte array with the Flash chip identifiers or NULL if the
  * Flash chip identifiers could not be obtained. The returned numbers are:
  * 1. The manufacturer ID
@@ -58,44 +214,368 @@ uint8_t *WfBootVerGet(void);
  * 3. The chip ID (second byte)
  * 4. The chip ID (third byte)
  ****************************************************************************/
-uint8_t *WfFlashIdsGet(void);
+uint8_t *WfFlashIdsGet(WfCtx *wf);
 
 /************************************************************************//**
  * Erases an address range of the flash chip.
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Start address of the range to erase.
  * \param[in] len  Length of the address to range.
  *
  * \return WF_OK if connection is successful, WF_ERROR otherwise.
  * \warning
  ****************************************************************************/
-int WfFlashErase(uint32_t addr, uint32_t len);
+int WfFlashErase(WfCtx *wf, uint32_t addr, uint32_t len);
 
 /************************************************************************//**
  * Programs a data block to the specified Flash address
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address to which the block will be written.
  * \param[in] len  Length of the data block.
  * \param[in] data Data block to program to the Flash.
  *
  * \return The number of bytes programmed to the Flash chip.
  ****************************************************************************/
-int WfFlash(uint32_t addr, uint32_t len, uint8_t data[]);
+int WfFlash(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t data[]);
+
+/************************************************************************//**
+ * Sets the maximum number of program commands that can be in flight
+ * (sent but not yet acknowledged). Also resets pipeline statistics.
+ *
+ * \param[in] wf     Connection context.
+ * \param[in] window Number of commands in flight, from 1 to WF_PIPE_MAX.
+ *
+ * \return WF_OK if the window was set, WF_ERROR if out of range.
+ ****************************************************************************/
+int WfPipeWindowSet(WfCtx *wf, unsigned int window);
+
+/************************************************************************//**
+ * Programs a data block to the specified Flash address, without waiting
+ * for the command to be acknowledged, as long as the window allows it.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address to which the block will be written.
+ * \param[in] len  Length of the data block.
+ * \param[in] data Data block to program to the Flash.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ *
+ * \note The data buffer can be reused as soon as this function returns.
+ * \note Call WfPipeFlush() after the last block, to make sure all the
+ * blocks have been acknowledged by the server.
+ ****************************************************************************/
+int WfFlashPipe(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t data[]);
+
+/************************************************************************//**
+ * Programs a compressed data block (see lz.h) to the specified Flash
+ * address, the bootloader decompressing it. Like WfFlashPipe(), does not
+ * wait for the command to be acknowledged if the window allows it. Only
+ * supported if WfLzSupported() returns TRUE.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address to which the block will be written.
+ * \param[in] len  Length of the data block, up to WF_LZ_CHUNK_MAX.
+ * \param[in] z    Compressed data block.
+ * \param[in] zLen Length of the compressed data block.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ *
+ * \note The compressed data buffer can be reused as soon as this function
+ * returns.
+ ****************************************************************************/
+int WfFlashLzPipe(WfCtx *wf, uint32_t addr, uint32_t len, const uint8_t z[],
+		uint32_t zLen);
+
+/************************************************************************//**
+ * Programs a data block to the specified Flash address, sending it
+ * directly from a file descriptor. On Linux, the data is sent using
+ * sendfile(), so it is not copied to user space. Like WfFlashPipe(), does
+ * not wait for the command to be acknowledged if the window allows it.
+ *
+ * \param[in] wf      Connection context.
+ * \param[in] addr    Address to which the block will be written.
+ * \param[in] len     Length of the data block.
+ * \param[in] fd      File descriptor of the file containing the block.
+ * \param[in] offset  Offset of the block in the file.
+ * \param[in] head    Data sent instead of the first headLen bytes of the
+ *                    block (e.g. a patched ROM header). Can be NULL.
+ * \param[in] headLen Length of the head data.
+ *
+ * \return WF_OK if the block was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfFlashFd(WfCtx *wf, uint32_t addr, uint32_t len, int fd, uint32_t offset,
+		const uint8_t head[], uint32_t headLen);
+
+/************************************************************************//**
+ * Erases an address range of the flash chip, without waiting for the
+ * command to be acknowledged, as long as the window allows it. Erase
+ * commands are processed in order with program commands, so an erase can
+ * be queued right ahead of the data that needs it.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Start address of the range to erase.
+ * \param[in] len  Length of the address to range.
+ *
+ * \return WF_OK if the command was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfErasePipe(WfCtx *wf, uint32_t addr, uint32_t len);
+
+/************************************************************************//**
+ * Waits until all the pipelined commands have been acknowledged.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if all commands were acknowledged, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfPipeFlush(WfCtx *wf);
+
+/************************************************************************//**
+ * Starts batching pipelined commands. Until WfBatchEnd() is called,
+ * pipelined commands are queued instead of being sent immediately. Queued
+ * commands are sent together with a single gather write, when the
+ * pipeline has to wait for an acknowledge or when the batch is full.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \warning While batching, data passed to WfFlashPipe() must remain valid
+ * until WfBatchEnd() returns.
+ ****************************************************************************/
+void WfBatchBegin(WfCtx *wf);
+
+/************************************************************************//**
+ * Sends any batched command and stops batching.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if batched commands were sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfBatchEnd(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the program pipeline statistics.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the pipeline statistics.
+ ****************************************************************************/
+const WfPipeStats *WfPipeStatsGet(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the transport statistics.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the transport statistics.
+ ****************************************************************************/
+const WfIoStats *WfIoStatsGet(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the TCP connection statistics, sampled since the transport
+ * statistics were reset (WfIoStatsReset()).
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the TCP connection statistics.
+ ****************************************************************************/
+const WfTcpStats *WfTcpStatsGet(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the name of the backend used for the transport: "io_uring", or
+ * "classic" when not built with WF_URING or not supported by the kernel.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Backend name.
+ ****************************************************************************/
+const char *WfBackend(WfCtx *wf);
+
+/************************************************************************//**
+ * Resets the transport statistics.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfIoStatsReset(WfCtx *wf);
+
+/************************************************************************//**
+ * Resets the session statistics, and starts measuring a new session.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfStatsReset(WfCtx *wf);
+
+/************************************************************************//**
+ * Starts a phase of the session. The running phase, if any, ends. Phases
+ * beyond WF_PHASES_MAX are added to the last one.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] name Name of the phase. Must remain valid while the
+ *                 statistics are used.
+ ****************************************************************************/
+void WfPhaseStart(WfCtx *wf, const char *name);
+
+/************************************************************************//**
+ * Ends the running phase, if any.
+ *
+ * \param[in] wf Connection context.
+ ****************************************************************************/
+void WfPhaseEnd(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the session statistics. The running phase is only accounted
+ * once it ends.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return Pointer to the session statistics.
+ ****************************************************************************/
+const WfStats *WfStatsGet(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the name of a command code.
+ *
+ * \param[in] cmd Command code.
+ *
+ * \return Command name, or NULL if the code is not known.
+ ****************************************************************************/
+const char *WfCmdName(uint16_t cmd);
+
+/************************************************************************//**
+ * Starts recording the frames sent and received (see record.h), until
+ * WfRecordStop() is called. Commands are recorded when issued, and their
+ * replies when completely received.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] file Name of the file to write the recording to.
+ *
+ * \return WF_OK if recording, WF_ERROR if the file could not be created.
+ ****************************************************************************/
+int WfRecordStart(WfCtx *wf, const char *file);
+
+/************************************************************************//**
+ * Stops recording, writing the recording file.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return WF_OK if the recording was written or there was none, WF_ERROR
+ * otherwise.
+ ****************************************************************************/
+int WfRecordStop(WfCtx *wf);
 
 /************************************************************************//**
  * Reads a data block from the specified Flash address
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address from which to start reading.
  * \param[in] len  Length of the data block to read.
  * \param[in] buf  Buffer where the readed data will be placed.
  *
- * \return The number of bytes programmed to the Flash chip.
+ * \return WF_OK if the complete block was read, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfRead(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t buf[]);
+
+/************************************************************************//**
+ * Receives the data of a pipelined read chunk.
+ *
+ * \param[in] addr Address the chunk was read from.
+ * \param[in] data Chunk data. Only valid until the function returns.
+ * \param[in] len  Length of the chunk.
+ * \param[in] ctx  Context passed to WfReadPipe().
+ *
+ * \return Length of the chunks to request from now on, or 0 to abort the
+ * read.
  ****************************************************************************/
-uint32_t WfRead(uint32_t addr, uint32_t len, uint8_t buf[]);
+typedef uint32_t (*WfReadCb)(uint32_t addr, const uint8_t *data,
+		uint32_t len, void *ctx);
+
+/************************************************************************//**
+ * Reads a memory range keeping several read commands in flight, so the
+ * link does not idle waiting for each chunk to be requested. Chunks are
+ * received in order into buf, and handed to a callback as soon as each one
+ * completes, so the range can be streamed without buffering it.
+ *
+ * \param[in] wf       Connection context.
+ * \param[in] addr     Address from which to start reading.
+ * \param[in] len      Length of the range to read.
+ * \param[in] chunkLen Length of the first chunks to request.
+ * \param[in] window   Number of read commands in flight, from 1 to
+ *                     WF_PIPE_MAX.
+ * \param[in] buf      Buffer receiving each chunk.
+ * \param[in] bufLen   Length of buf. Longer chunks are not requested.
+ * \param[in] cb       Function receiving each chunk.
+ * \param[in] ctx      Context passed to the callback.
+ *
+ * \return WF_OK if the complete range was read, WF_ERROR otherwise.
+ *
+ * \note Pipelined program commands are acknowledged before reading.
+ ****************************************************************************/
+int WfReadPipe(WfCtx *wf, uint32_t addr, uint32_t len, uint32_t chunkLen,
+		unsigned int window, uint8_t buf[], uint32_t bufLen, WfReadCb cb,
+		void *ctx);
+
+/************************************************************************//**
+ * Queues a read command in the pipeline, along with program and erase
+ * commands, without waiting for its data as long as the window allows it.
+ * Because commands are processed in order, the read sees the result of the
+ * commands queued before it. This allows reading back flashed data while
+ * the next chunks are being sent. The data is received later, while
+ * sending other commands or on WfPipeFlush(), and passed to the callback.
+ *
+ * \param[in] wf   Connection context.
+ * \param[in] addr Address from which to start reading.
+ * \param[in] len  Length of the data block to read.
+ * \param[in] buf  Buffer receiving the data. Must remain valid until the
+ *                 callback is called.
+ * \param[in] cb   Function receiving the data. Returning 0 makes the
+ *                 pipeline fail and closes the connection.
+ * \param[in] ctx  Context passed to the callback.
+ *
+ * \return WF_OK if the command was sent, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfReadQueue(WfCtx *wf, uint32_t addr, uint32_t len, uint8_t buf[],
+		WfReadCb cb, void *ctx);
+
+/************************************************************************//**
+ * Checks if the bootloader supports computing CRCs (WfCrc32()). The
+ * bootloader version is queried the first time.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if supported, FALSE if not supported or not known.
+ ****************************************************************************/
+int WfCrc32Supported(WfCtx *wf);
+
+/************************************************************************//**
+ * Checks if the bootloader supports programming compressed data
+ * (WfFlashLzPipe()). The bootloader version is queried the first time.
+ *
+ * \param[in] wf Connection context.
+ *
+ * \return TRUE if supported, FALSE if not supported or not known.
+ ****************************************************************************/
+int WfLzSupported(WfCtx *wf);
+
+/************************************************************************//**
+ * Obtains the CRC-32 of the blocks of a memory range, computed by the
+ * bootloader, so the range can be verified without reading it back.
+ *
+ * \param[in]  wf       Connection context.
+ * \param[in]  addr     Start address of the range.
+ * \param[in]  len      Length of the range.
+ * \param[in]  blockLen Length of each block. The last block can be
+ *                      shorter.
+ * \param[out] crc      CRC of each block, in order.
+ *
+ * \return WF_OK if all the CRCs were obtained, WF_ERROR otherwise.
+ ****************************************************************************/
+int WfCrc32(WfCtx *wf, uint32_t addr, uint32_t len, uint32_t blockLen,
+		uint32_t crc[]);
 
 /************************************************************************//**
  * Boots the ROM from the specified address.
  *
+ * \param[in] wf   Connection context.
  * \param[in] addr Address from where to boot the ROM.
  *
  * \return WF_OK if boot command completed, or WF_ERROR if command failed.
@@ -104,11 +584,13 @@ uint32_t WfRead(uint32_t addr, uint32_t len, uint8_t buf[]);
  * before shutting down the WiFi module, it is possible that WF_ERROR is
  * returned on a boot command completed successfully.
  ****************************************************************************/
-int WfBoot(uint32_t addr);
+int WfBoot(WfCtx *wf, uint32_t addr);
 
 /************************************************************************//**
  * Boots the ROM automatically.
  *
+ * \param[in] wf Connection context.
+ *
  * \return WF_OK if boot command completed, or WF_ERROR if command failed.
  *
  * \note Because the bootloader will only wait a small fraction of time
@@ -118,7 +600,7 @@ int WfBoot(uint32_t addr);
  * field of the ROM header. The boot address is located there by the
  * ROM upload utility.
  ****************************************************************************/
-int WfAutoRun(void);
+int WfAutoRun(WfCtx *wf);
 
 #endif /*_WFLASH_H_*/
 